@@ -0,0 +1,171 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "kdump.h"
+#include "sha256.h"
+
+/* Commit the output and rewrite the checkpoint every this many windows */
+#define CHECKPOINT_WINDOWS 4
+
+static void checkpoint_digest(const void *headers, size_t header_bytes,
+	const void *notes, size_t note_bytes, uint8_t *digest)
+{
+	sha256_context ctx;
+
+	sha256_starts(&ctx);
+	sha256_update(&ctx, headers, header_bytes);
+	sha256_update(&ctx, notes, note_bytes);
+	sha256_finish(&ctx, digest);
+}
+
+/*
+ * Replace the checkpoint file with the current state.  The new state is
+ * written beside it and renamed over it, so an interruption leaves
+ * either the old or the new checkpoint, never a torn one.
+ */
+static void checkpoint_write(struct checkpoint *ckp)
+{
+	int fd;
+
+	fd = open(ckp->tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		fprintf(stderr, "Cannot create %s: %s\n",
+			ckp->tmp_path, strerror(errno));
+		exit(12);
+	}
+	write_all(fd, &ckp->state, sizeof(ckp->state));
+	if (fsync(fd) < 0) {
+		fprintf(stderr, "Cannot sync %s: %s\n",
+			ckp->tmp_path, strerror(errno));
+		exit(12);
+	}
+	close(fd);
+	if (rename(ckp->tmp_path, ckp->path) < 0) {
+		fprintf(stderr, "Cannot rename %s to %s: %s\n",
+			ckp->tmp_path, ckp->path, strerror(errno));
+		exit(12);
+	}
+}
+
+/* Make everything written so far durable, then record it as committed */
+static void checkpoint_commit(struct checkpoint *ckp, uint64_t committed)
+{
+	if (fdatasync(ckp->out_fd) < 0) {
+		fprintf(stderr, "Cannot sync the output: %s\n",
+			strerror(errno));
+		exit(12);
+	}
+	ckp->state.committed = committed;
+	checkpoint_write(ckp);
+}
+
+void checkpoint_init(struct checkpoint *ckp, const char *path, int out_fd,
+	struct window *windows, size_t nr_windows, size_t window_size,
+	const void *headers, size_t header_bytes,
+	const void *notes, size_t note_bytes)
+{
+	memset(ckp, 0, sizeof(*ckp));
+	pthread_mutex_init(&ckp->lock, NULL);
+	ckp->path = path;
+	ckp->tmp_path = xmalloc(strlen(path) + sizeof(".tmp"));
+	sprintf(ckp->tmp_path, "%s.tmp", path);
+	ckp->out_fd = out_fd;
+	ckp->windows = windows;
+	ckp->done = calloc(nr_windows ? nr_windows : 1, 1);
+	if (!ckp->done) {
+		fprintf(stderr, "Cannot allocate the checkpoint map: %s\n",
+			strerror(errno));
+		exit(7);
+	}
+
+	memcpy(ckp->state.magic, KDUMP_CHECKPOINT_MAGIC,
+		sizeof(ckp->state.magic));
+	ckp->state.window_size = window_size;
+	ckp->state.nr_windows = nr_windows;
+	ckp->state.committed = 0;
+	ckp->state.core_bytes = header_bytes + note_bytes;
+	checkpoint_digest(headers, header_bytes, notes, note_bytes,
+		ckp->state.digest);
+}
+
+/*
+ * Check that an existing checkpoint describes the core we are about to
+ * write, and return the first window that still has to be copied.
+ */
+size_t checkpoint_resume(struct checkpoint *ckp)
+{
+	struct kdump_checkpoint saved;
+	ssize_t result;
+	size_t i;
+	int fd;
+
+	fd = open(ckp->path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Cannot open checkpoint %s: %s\n",
+			ckp->path, strerror(errno));
+		exit(12);
+	}
+	result = read(fd, &saved, sizeof(saved));
+	close(fd);
+	if ((result != sizeof(saved)) ||
+	    (memcmp(saved.magic, KDUMP_CHECKPOINT_MAGIC,
+		    sizeof(saved.magic)) != 0)) {
+		fprintf(stderr, "%s is not a kdump checkpoint\n", ckp->path);
+		exit(12);
+	}
+	if ((saved.window_size != ckp->state.window_size) ||
+	    (saved.nr_windows != ckp->state.nr_windows) ||
+	    (saved.core_bytes != ckp->state.core_bytes) ||
+	    (memcmp(saved.digest, ckp->state.digest,
+		    sizeof(saved.digest)) != 0) ||
+	    (saved.committed > saved.nr_windows)) {
+		fprintf(stderr, "Checkpoint %s is for a different core, "
+			"not resuming\n", ckp->path);
+		exit(12);
+	}
+
+	ckp->state.committed = saved.committed;
+	ckp->next = saved.committed;
+	for (i = 0; i < ckp->next; i++)
+		ckp->done[i] = 1;
+	return ckp->next;
+}
+
+/* Record the headers and notes as written before any window is */
+void checkpoint_start(struct checkpoint *ckp)
+{
+	checkpoint_commit(ckp, 0);
+}
+
+/*
+ * Called once a window has been handed to the kernel.  Windows may
+ * finish out of order, so only the prefix that is complete counts; once
+ * it has grown by CHECKPOINT_WINDOWS it is synced and recorded.
+ */
+void checkpoint_window_done(struct checkpoint *ckp, struct window *w)
+{
+	pthread_mutex_lock(&ckp->lock);
+	ckp->done[w - ckp->windows] = 1;
+	while ((ckp->next < ckp->state.nr_windows) && ckp->done[ckp->next])
+		ckp->next++;
+	if (ckp->next < ckp->state.committed + CHECKPOINT_WINDOWS) {
+		pthread_mutex_unlock(&ckp->lock);
+		return;
+	}
+	checkpoint_commit(ckp, ckp->next);
+	pthread_mutex_unlock(&ckp->lock);
+}
+
+void checkpoint_finish(struct checkpoint *ckp)
+{
+	checkpoint_commit(ckp, ckp->next);
+	pthread_mutex_destroy(&ckp->lock);
+	free(ckp->done);
+	free(ckp->tmp_path);
+}
@@ -0,0 +1,532 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "kdump.h"
+
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+#ifdef HAVE_LIBLZMA
+#include <lzma.h>
+#endif
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
+static const struct {
+	const char *name;
+	int algorithm;
+	int default_level;
+	int max_level;
+} compressors[] = {
+#ifdef HAVE_LIBZ
+	{ "zlib", KDUMPZ_ZLIB, 1, 9 },
+#endif
+#ifdef HAVE_LIBLZMA
+	{ "lzma", KDUMPZ_LZMA, 0, 9 },
+#endif
+#ifdef HAVE_LIBZSTD
+	{ "zstd", KDUMPZ_ZSTD, 1, 19 },
+#endif
+	{ NULL, KDUMPZ_NONE, 0, 0 },
+};
+
+/* Parse "algorithm[:level]", returns 0 on success */
+int compress_parse(const char *arg, struct compress_params *params)
+{
+	const char *colon;
+	size_t len;
+	int i;
+
+	colon = strchr(arg, ':');
+	len = colon ? (size_t)(colon - arg) : strlen(arg);
+	for (i = 0; compressors[i].name; i++) {
+		if (strlen(compressors[i].name) != len)
+			continue;
+		if (memcmp(compressors[i].name, arg, len) != 0)
+			continue;
+		params->algorithm = compressors[i].algorithm;
+		params->level = compressors[i].default_level;
+		if (colon) {
+			char *end;
+			long level = strtol(colon + 1, &end, 10);
+			if ((end == colon + 1) || (*end != '\0') ||
+			    (level < 0) || (level > compressors[i].max_level))
+				return -1;
+			params->level = level;
+		}
+		return 0;
+	}
+	return -1;
+}
+
+const char *compress_name(int algorithm)
+{
+	int i;
+
+	for (i = 0; compressors[i].name; i++) {
+		if (compressors[i].algorithm == algorithm)
+			return compressors[i].name;
+	}
+	return "none";
+}
+
+size_t compress_bound(const struct compress_params *params, size_t size)
+{
+	switch (params->algorithm) {
+#ifdef HAVE_LIBZ
+	case KDUMPZ_ZLIB:
+		return compressBound(size);
+#endif
+#ifdef HAVE_LIBLZMA
+	case KDUMPZ_LZMA:
+		return lzma_stream_buffer_bound(size);
+#endif
+#ifdef HAVE_LIBZSTD
+	case KDUMPZ_ZSTD:
+		return ZSTD_compressBound(size);
+#endif
+	}
+	return size;
+}
+
+/*
+ * Compress one block into dst.  Returns the compressed size, or 0 when
+ * the block did not shrink and should be stored as is.
+ */
+size_t compress_block(const struct compress_params *params,
+	void *dst, size_t dst_size, const void *src, size_t size)
+{
+	size_t csize = 0;
+
+	switch (params->algorithm) {
+#ifdef HAVE_LIBZ
+	case KDUMPZ_ZLIB:
+	{
+		uLongf len = dst_size;
+		if (compress2(dst, &len, src, size, params->level) != Z_OK)
+			return 0;
+		csize = len;
+		break;
+	}
+#endif
+#ifdef HAVE_LIBLZMA
+	case KDUMPZ_LZMA:
+	{
+		size_t pos = 0;
+		if (lzma_easy_buffer_encode(params->level, LZMA_CHECK_NONE,
+					    NULL, src, size, dst, &pos,
+					    dst_size) != LZMA_OK)
+			return 0;
+		csize = pos;
+		break;
+	}
+#endif
+#ifdef HAVE_LIBZSTD
+	case KDUMPZ_ZSTD:
+		csize = ZSTD_compress(dst, dst_size, src, size, params->level);
+		if (ZSTD_isError(csize))
+			return 0;
+		break;
+#endif
+	}
+	if (csize >= size)
+		return 0;
+	return csize;
+}
+
+void kdumpz_begin(struct kdumpz_writer *writer, int fd,
+	const struct compress_params *params, size_t block_size,
+	const void *headers, size_t header_bytes,
+	const void *notes, size_t note_bytes)
+{
+	struct kdumpz_header hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, KDUMPZ_MAGIC, sizeof(hdr.magic));
+	hdr.algorithm = params->algorithm;
+	hdr.block_size = block_size;
+	hdr.raw_bytes = header_bytes + note_bytes;
+
+	writer->fd = fd;
+	writer->nr_blocks = 0;
+	writer->max_blocks = 1024;
+	writer->index = xmalloc(sizeof(*writer->index) * writer->max_blocks);
+
+	write_all(fd, &hdr, sizeof(hdr));
+	write_all(fd, headers, header_bytes);
+	write_all(fd, notes, note_bytes);
+	writer->offset = sizeof(hdr) + hdr.raw_bytes;
+}
+
+void kdumpz_write_block(struct kdumpz_writer *writer,
+	unsigned long long uoffset, size_t usize,
+	const void *data, size_t csize, uint32_t flags)
+{
+	struct kdumpz_index_entry *entry;
+	struct kdumpz_block blk;
+
+	if (writer->nr_blocks == writer->max_blocks) {
+		writer->max_blocks *= 2;
+		writer->index = realloc(writer->index,
+			sizeof(*writer->index) * writer->max_blocks);
+		if (!writer->index) {
+			fprintf(stderr, "Cannot grow the block index to %zu "
+				"entries: %s\n", writer->max_blocks,
+				strerror(errno));
+			exit(7);
+		}
+	}
+	entry = &writer->index[writer->nr_blocks++];
+	entry->uoffset = uoffset;
+	entry->coffset = writer->offset;
+
+	blk.magic = KDUMPZ_BLOCK_MAGIC;
+	blk.flags = flags;
+	blk.usize = usize;
+	blk.csize = csize;
+	blk.uoffset = uoffset;
+	write_all(writer->fd, &blk, sizeof(blk));
+	write_all(writer->fd, data, csize);
+	writer->offset += sizeof(blk) + csize;
+}
+
+void kdumpz_finish(struct kdumpz_writer *writer,
+	unsigned long long core_size)
+{
+	struct kdumpz_trailer trailer;
+
+	trailer.index_offset = writer->offset;
+	trailer.nr_blocks = writer->nr_blocks;
+	trailer.core_size = core_size;
+	memcpy(trailer.magic, KDUMPZ_INDEX_MAGIC, sizeof(trailer.magic));
+
+	write_all(writer->fd, writer->index,
+		sizeof(*writer->index) * writer->nr_blocks);
+	write_all(writer->fd, &trailer, sizeof(trailer));
+	writer->offset += sizeof(*writer->index) * writer->nr_blocks +
+		sizeof(trailer);
+
+	free(writer->index);
+	writer->index = NULL;
+}
+
+/*
+ * Inflate one block into dst.  Returns 0 if it came out as exactly usize
+ * bytes.
+ */
+static int decompress_block(int algorithm, void *dst, size_t usize,
+	const void *src, size_t csize)
+{
+	switch (algorithm) {
+#ifdef HAVE_LIBZ
+	case KDUMPZ_ZLIB:
+	{
+		uLongf len = usize;
+		if (uncompress(dst, &len, src, csize) != Z_OK)
+			return -1;
+		return len == usize ? 0 : -1;
+	}
+#endif
+#ifdef HAVE_LIBLZMA
+	case KDUMPZ_LZMA:
+	{
+		uint64_t memlimit = UINT64_MAX;
+		size_t in_pos = 0, out_pos = 0;
+		if (lzma_stream_buffer_decode(&memlimit, 0, NULL, src, &in_pos,
+					      csize, dst, &out_pos,
+					      usize) != LZMA_OK)
+			return -1;
+		return out_pos == usize ? 0 : -1;
+	}
+#endif
+#ifdef HAVE_LIBZSTD
+	case KDUMPZ_ZSTD:
+	{
+		size_t len = ZSTD_decompress(dst, usize, src, csize);
+		if (ZSTD_isError(len))
+			return -1;
+		return len == usize ? 0 : -1;
+	}
+#endif
+	}
+	return -1;
+}
+
+static int pread_all(int fd, void *buf, size_t count, off_t offset)
+{
+	ssize_t result;
+	char *ptr = buf;
+
+	while (count > 0) {
+		result = pread(fd, ptr, count, offset);
+		if (result < 0 && errno == EINTR)
+			continue;
+		if (result <= 0)
+			return -1;
+		ptr += result;
+		count -= result;
+		offset += result;
+	}
+	return 0;
+}
+
+/*
+ * Write the ELF core a compressed core was made from to out_fd,
+ * checking every block against the index and the trailer on the way.
+ * Returns 0 on success.
+ */
+int kdumpz_decode(int in_fd, int out_fd)
+{
+	struct kdumpz_header hdr;
+	struct kdumpz_trailer trailer;
+	struct kdumpz_index_entry *index = NULL;
+	struct kdumpz_block blk;
+	unsigned long long pos, index_end;
+	char *cbuf = NULL, *ubuf = NULL;
+	const char *why;
+	struct stat st;
+	uint64_t i;
+	size_t len;
+	int ret = -1;
+
+	why = "it is too short";
+	if ((fstat(in_fd, &st) < 0) ||
+	    (st.st_size < (off_t)(sizeof(hdr) + sizeof(trailer))) ||
+	    pread_all(in_fd, &hdr, sizeof(hdr), 0) ||
+	    pread_all(in_fd, &trailer, sizeof(trailer),
+		      st.st_size - sizeof(trailer)))
+		goto bad;
+	why = "the magic numbers do not match";
+	if (memcmp(hdr.magic, KDUMPZ_MAGIC, sizeof(hdr.magic)) ||
+	    memcmp(trailer.magic, KDUMPZ_INDEX_MAGIC, sizeof(trailer.magic)))
+		goto bad;
+	why = "the header or trailer is inconsistent";
+	index_end = trailer.index_offset +
+		trailer.nr_blocks * sizeof(*index);
+	if ((hdr.block_size == 0) || (hdr.block_size > (1U << 30)) ||
+	    (hdr.raw_bytes > trailer.core_size) ||
+	    (trailer.nr_blocks > (unsigned long long)st.st_size /
+	     sizeof(*index)) ||
+	    (sizeof(hdr) + hdr.raw_bytes > trailer.index_offset) ||
+	    (index_end + sizeof(trailer) != (unsigned long long)st.st_size))
+		goto bad;
+	if (hdr.algorithm != KDUMPZ_NONE &&
+	    !strcmp(compress_name(hdr.algorithm), "none")) {
+		fprintf(stderr, "kdump was built without support for "
+			"compression algorithm %u\n", hdr.algorithm);
+		return -1;
+	}
+
+	ubuf = xmalloc(hdr.block_size);
+	cbuf = xmalloc(hdr.block_size);
+	index = xmalloc(sizeof(*index) * (trailer.nr_blocks ?
+					  trailer.nr_blocks : 1));
+	why = "the index cannot be read";
+	if (pread_all(in_fd, index, sizeof(*index) * trailer.nr_blocks,
+		      trailer.index_offset))
+		goto bad;
+
+	/* The ELF headers and notes are stored as they are */
+	why = "the ELF headers cannot be read";
+	for (pos = 0; pos < hdr.raw_bytes; pos += len) {
+		len = hdr.raw_bytes - pos;
+		if (len > hdr.block_size)
+			len = hdr.block_size;
+		if (pread_all(in_fd, ubuf, len, sizeof(hdr) + pos))
+			goto bad;
+		write_all(out_fd, ubuf, len);
+	}
+
+	for (i = 0; i < trailer.nr_blocks; i++) {
+		why = "a block is out of place";
+		if ((index[i].uoffset != pos) ||
+		    (index[i].coffset < sizeof(hdr) + hdr.raw_bytes) ||
+		    (index[i].coffset + sizeof(blk) > trailer.index_offset) ||
+		    pread_all(in_fd, &blk, sizeof(blk), index[i].coffset))
+			goto bad;
+		why = "a block header is damaged";
+		if ((blk.magic != KDUMPZ_BLOCK_MAGIC) ||
+		    (blk.uoffset != index[i].uoffset) ||
+		    (blk.usize == 0) || (blk.usize > hdr.block_size) ||
+		    (index[i].coffset + sizeof(blk) + blk.csize >
+		     trailer.index_offset))
+			goto bad;
+		why = "a block cannot be decompressed";
+		if (blk.flags & KDUMPZ_BLOCK_STORED) {
+			if ((blk.csize != blk.usize) ||
+			    pread_all(in_fd, ubuf, blk.usize,
+				      index[i].coffset + sizeof(blk)))
+				goto bad;
+		} else {
+			if ((blk.csize >= blk.usize) ||
+			    pread_all(in_fd, cbuf, blk.csize,
+				      index[i].coffset + sizeof(blk)) ||
+			    decompress_block(hdr.algorithm, ubuf, blk.usize,
+					     cbuf, blk.csize))
+				goto bad;
+		}
+		write_all(out_fd, ubuf, blk.usize);
+		pos += blk.usize;
+	}
+	why = "the blocks do not add up to the core size";
+	if (pos != trailer.core_size)
+		goto bad;
+	ret = 0;
+	goto out;
+
+bad:
+	fprintf(stderr, "Invalid compressed core: %s\n", why);
+out:
+	free(index);
+	free(cbuf);
+	free(ubuf);
+	return ret;
+}
+
+#ifdef TEST
+/*
+ * "make kdumpz-check" builds kdump/kdumpz-check, which writes a synthetic
+ * core with every compressor kdump was built with, decodes it again and
+ * compares, then checks that a damaged block is refused.
+ */
+void *xmalloc(size_t size)
+{
+	void *result = malloc(size);
+
+	if (result == NULL) {
+		fprintf(stderr, "malloc of %zu bytes failed\n", size);
+		exit(7);
+	}
+	return result;
+}
+
+void write_all(int fd, const void *buf, size_t count)
+{
+	ssize_t result;
+	const char *ptr = buf;
+
+	while (count > 0) {
+		result = write(fd, ptr, count);
+		if (result < 0 && errno == EINTR)
+			continue;
+		if (result <= 0) {
+			fprintf(stderr, "write failed: %s\n", strerror(errno));
+			exit(8);
+		}
+		ptr += result;
+		count -= result;
+	}
+}
+
+#define TEST_BLOCK_SIZE	(64*1024)
+#define TEST_RAW_BYTES	1000
+#define TEST_CORE_SIZE	(TEST_RAW_BYTES + 7 * TEST_BLOCK_SIZE / 2)
+
+static int check_algorithm(const struct compress_params *params,
+	const unsigned char *core)
+{
+	struct kdumpz_writer writer;
+	unsigned long long second = 0;
+	uint32_t magic = 0;
+	unsigned char *cbuf, *out;
+	size_t bound, csize, usize, pos;
+	FILE *zf, *of;
+	int ret = -1;
+
+	zf = tmpfile();
+	of = tmpfile();
+	if (!zf || !of) {
+		fprintf(stderr, "Cannot create a temporary file: %s\n",
+			strerror(errno));
+		exit(3);
+	}
+	bound = compress_bound(params, TEST_BLOCK_SIZE);
+	cbuf = xmalloc(bound);
+	out = xmalloc(TEST_CORE_SIZE);
+
+	kdumpz_begin(&writer, fileno(zf), params, TEST_BLOCK_SIZE,
+		     core, TEST_RAW_BYTES / 2, core + TEST_RAW_BYTES / 2,
+		     TEST_RAW_BYTES - TEST_RAW_BYTES / 2);
+	for (pos = TEST_RAW_BYTES; pos < TEST_CORE_SIZE; pos += usize) {
+		usize = TEST_CORE_SIZE - pos;
+		if (usize > TEST_BLOCK_SIZE)
+			usize = TEST_BLOCK_SIZE;
+		csize = compress_block(params, cbuf, bound, core + pos, usize);
+		if (csize)
+			kdumpz_write_block(&writer, pos, usize, cbuf, csize, 0);
+		else
+			kdumpz_write_block(&writer, pos, usize, core + pos,
+					   usize, KDUMPZ_BLOCK_STORED);
+		if (writer.nr_blocks == 1)
+			second = writer.offset;
+	}
+	kdumpz_finish(&writer, TEST_CORE_SIZE);
+
+	if (kdumpz_decode(fileno(zf), fileno(of)) ||
+	    pread_all(fileno(of), out, TEST_CORE_SIZE, 0) ||
+	    (lseek(fileno(of), 0, SEEK_END) != TEST_CORE_SIZE) ||
+	    memcmp(out, core, TEST_CORE_SIZE)) {
+		fprintf(stderr, "%s: the decoded core differs\n",
+			compress_name(params->algorithm));
+		goto out;
+	}
+
+	/* Damage the second block's header, which has to be noticed */
+	if (pwrite(fileno(zf), &magic, sizeof(magic), second) !=
+	    sizeof(magic))
+		goto out;
+	if ((ftruncate(fileno(of), 0) < 0) ||
+	    (lseek(fileno(of), 0, SEEK_SET) != 0))
+		goto out;
+	if (kdumpz_decode(fileno(zf), fileno(of)) == 0) {
+		fprintf(stderr, "%s: a damaged block was accepted\n",
+			compress_name(params->algorithm));
+		goto out;
+	}
+	printf("%s: %u byte core, %llu bytes compressed, round trip ok\n",
+	       compress_name(params->algorithm), TEST_CORE_SIZE,
+	       writer.offset);
+	ret = 0;
+out:
+	fclose(zf);
+	fclose(of);
+	free(cbuf);
+	free(out);
+	return ret;
+}
+
+int main(void)
+{
+	struct compress_params params;
+	unsigned char *core;
+	uint32_t seed = 1;
+	size_t i;
+	int failed = 0;
+
+	/* Text, then zeros, then noise that will not compress */
+	core = xmalloc(TEST_CORE_SIZE);
+	for (i = 0; i < TEST_CORE_SIZE; i++) {
+		seed = seed * 1103515245 + 12345;
+		if (i < TEST_CORE_SIZE / 3)
+			core[i] = "kdump compressed core "[i % 22];
+		else if (i < 2 * TEST_CORE_SIZE / 3)
+			core[i] = 0;
+		else
+			core[i] = seed >> 16;
+	}
+	for (i = 0; compressors[i].name; i++) {
+		params.algorithm = compressors[i].algorithm;
+		params.level = compressors[i].default_level;
+		if (check_algorithm(&params, core))
+			failed = 1;
+	}
+	free(core);
+	return failed;
+}
+#endif
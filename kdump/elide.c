@@ -0,0 +1,319 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <elf.h>
+
+#include "kdump.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/* Memory is scanned for zero pages one window at a time */
+#define SCAN_WINDOW_SIZE (64*1024*1024)
+
+/* How much we look at before giving up on a page that is not zero */
+#define ZERO_PROBE_SIZE 256
+
+/*
+ * Most pages are not zero and differ from it in their first few bytes,
+ * so check a small probe first and only then OR the rest together
+ * 64 bytes at a time.
+ */
+static int mem_is_zero_block(const unsigned char *p, size_t len)
+{
+#if defined(__SSE2__)
+	__m128i acc = _mm_setzero_si128();
+	for (; len >= 64; len -= 64, p += 64) {
+		const __m128i *v = (const __m128i *)p;
+		acc = _mm_or_si128(acc,
+			_mm_or_si128(_mm_or_si128(_mm_loadu_si128(v),
+						  _mm_loadu_si128(v + 1)),
+				     _mm_or_si128(_mm_loadu_si128(v + 2),
+						  _mm_loadu_si128(v + 3))));
+	}
+	if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) !=
+	    0xffff)
+		return 0;
+#elif defined(__ARM_NEON)
+	uint8x16_t acc = vdupq_n_u8(0);
+	for (; len >= 64; len -= 64, p += 64) {
+		acc = vorrq_u8(acc,
+			vorrq_u8(vorrq_u8(vld1q_u8(p), vld1q_u8(p + 16)),
+				 vorrq_u8(vld1q_u8(p + 32), vld1q_u8(p + 48))));
+	}
+	if (vgetq_lane_u64(vreinterpretq_u64_u8(acc), 0) |
+	    vgetq_lane_u64(vreinterpretq_u64_u8(acc), 1))
+		return 0;
+#endif
+	for (; len >= sizeof(unsigned long); len -= sizeof(unsigned long)) {
+		unsigned long word;
+		memcpy(&word, p, sizeof(word));
+		if (word)
+			return 0;
+		p += sizeof(word);
+	}
+	for (; len; len--, p++) {
+		if (*p)
+			return 0;
+	}
+	return 1;
+}
+
+int mem_is_zero(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	size_t probe;
+
+	probe = len < ZERO_PROBE_SIZE ? len : ZERO_PROBE_SIZE;
+	if (!mem_is_zero_block(p, probe))
+		return 0;
+	return mem_is_zero_block(p + probe, len - probe);
+}
+
+struct zero_run {
+	unsigned long long start;	/* offsets in /dev/mem */
+	unsigned long long end;
+	size_t phdr;
+};
+
+struct scan_window {
+	size_t phdr;			/* index of the PT_LOAD */
+	unsigned long long src;		/* offset in /dev/mem */
+	size_t size;
+	struct zero_run *runs;
+	size_t nr_runs;
+};
+
+struct scan_pool {
+	pthread_mutex_t lock;
+	struct scan_window *windows;
+	size_t nr;
+	size_t next;
+	int fd;
+	size_t page_size;
+};
+
+static void scan_window(struct scan_pool *pool, struct scan_window *w)
+{
+	unsigned char *buf;
+	size_t off, len, max_runs;
+	struct zero_run *run = NULL;
+
+	max_runs = 0;
+	buf = map_addr(pool->fd, w->size, w->src);
+	for (off = 0; off < w->size; off += len) {
+		len = w->size - off;
+		if (len > pool->page_size)
+			len = pool->page_size;
+		if (!mem_is_zero(buf + off, len)) {
+			run = NULL;
+			continue;
+		}
+		if (run) {
+			run->end += len;
+			continue;
+		}
+		if (w->nr_runs == max_runs) {
+			max_runs = max_runs ? max_runs * 2 : 16;
+			w->runs = realloc(w->runs, sizeof(*w->runs) * max_runs);
+			if (!w->runs) {
+				fprintf(stderr, "Cannot grow the zero run "
+					"list: %s\n", strerror(errno));
+				exit(7);
+			}
+		}
+		run = &w->runs[w->nr_runs++];
+		run->start = w->src + off;
+		run->end = run->start + len;
+	}
+	unmap_addr(buf, w->size);
+}
+
+static void *scan_worker(void *arg)
+{
+	struct scan_pool *pool = arg;
+	struct scan_window *w;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		if (pool->next >= pool->nr) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		w = &pool->windows[pool->next++];
+		pthread_mutex_unlock(&pool->lock);
+		scan_window(pool, w);
+	}
+	return NULL;
+}
+
+/*
+ * Find every page sized run of zeros in the PT_LOAD segments, merged
+ * across window boundaries, using up to threads scanners.  Runs come
+ * back sorted, tagged with the index of the segment they belong to.
+ */
+static struct zero_run *find_zero_runs(int fd, Elf64_Phdr *phdr,
+	size_t phnum, unsigned threads, size_t *nr_runs)
+{
+	struct scan_pool pool;
+	pthread_t tid[MAX_THREADS];
+	struct zero_run *runs;
+	size_t nr, i, j;
+	unsigned t;
+	int result;
+
+	memset(&pool, 0, sizeof(pool));
+	pthread_mutex_init(&pool.lock, NULL);
+	pool.fd = fd;
+	pool.page_size = getpagesize();
+
+	nr = 0;
+	for (i = 0; i < phnum; i++) {
+		if (phdr[i].p_type != PT_LOAD)
+			continue;
+		nr += (phdr[i].p_filesz + SCAN_WINDOW_SIZE - 1) /
+			SCAN_WINDOW_SIZE;
+	}
+	pool.windows = xmalloc(sizeof(*pool.windows) * (nr ? nr : 1));
+	for (i = 0; i < phnum; i++) {
+		unsigned long long offset, size;
+		size_t wsize;
+		if (phdr[i].p_type != PT_LOAD)
+			continue;
+		offset = phdr[i].p_offset;
+		size = phdr[i].p_filesz;
+		for (; size > 0; size -= wsize, offset += wsize) {
+			struct scan_window *w = &pool.windows[pool.nr++];
+			wsize = SCAN_WINDOW_SIZE;
+			if (wsize > size)
+				wsize = size;
+			w->phdr = i;
+			w->src = offset;
+			w->size = wsize;
+			w->runs = NULL;
+			w->nr_runs = 0;
+		}
+	}
+
+	for (t = 0; t < threads; t++) {
+		result = pthread_create(&tid[t], NULL, scan_worker, &pool);
+		if (result != 0) {
+			fprintf(stderr, "Cannot create scan thread: %s\n",
+				strerror(result));
+			exit(10);
+		}
+	}
+	for (t = 0; t < threads; t++)
+		pthread_join(tid[t], NULL);
+
+	nr = 0;
+	for (i = 0; i < pool.nr; i++)
+		nr += pool.windows[i].nr_runs;
+	runs = xmalloc(sizeof(*runs) * (nr ? nr : 1));
+
+	/* Concatenate, joining runs that continue into the next window */
+	nr = 0;
+	for (i = 0; i < pool.nr; i++) {
+		struct scan_window *w = &pool.windows[i];
+		for (j = 0; j < w->nr_runs; j++) {
+			if (nr && (runs[nr - 1].phdr == w->phdr) &&
+			    (runs[nr - 1].end == w->runs[j].start)) {
+				runs[nr - 1].end = w->runs[j].end;
+				continue;
+			}
+			runs[nr] = w->runs[j];
+			runs[nr].phdr = w->phdr;
+			nr++;
+		}
+		free(w->runs);
+	}
+	free(pool.windows);
+	pthread_mutex_destroy(&pool.lock);
+
+	*nr_runs = nr;
+	return runs;
+}
+
+static size_t count_segments(size_t phnum, struct zero_run *runs,
+	size_t nr_runs, unsigned long long min_run)
+{
+	size_t count, i;
+
+	count = phnum;
+	for (i = 0; i < nr_runs; i++) {
+		if (runs[i].end - runs[i].start >= min_run)
+			count++;
+	}
+	return count;
+}
+
+/*
+ * Rewrite the program headers so that every run of at least min_run
+ * zero bytes becomes the p_memsz > p_filesz tail of the segment before
+ * it.  The PT_LOAD is split after each such run, so the zeros never
+ * reach the output while the memory covered stays exactly the same.
+ * The returned headers still carry /dev/mem offsets in p_offset, like
+ * the ones passed in; there are *nphnum of them.
+ */
+Elf64_Phdr *elide_zero_runs(int fd, Elf64_Phdr *phdr, size_t phnum,
+	unsigned threads, unsigned long long min_run, size_t *nphnum)
+{
+	struct zero_run *runs;
+	Elf64_Phdr *nphdr, *seg;
+	size_t nr_runs, count, r, i;
+
+	runs = find_zero_runs(fd, phdr, phnum, threads, &nr_runs);
+	count = count_segments(phnum, runs, nr_runs, min_run);
+
+	nphdr = xmalloc(sizeof(*nphdr) * count);
+	seg = nphdr;
+	r = 0;
+	for (i = 0; i < phnum; i++) {
+		unsigned long long start, end;
+
+		*seg = phdr[i];
+		if (phdr[i].p_type != PT_LOAD) {
+			seg++;
+			continue;
+		}
+		start = phdr[i].p_offset;
+		end = phdr[i].p_offset + phdr[i].p_filesz;
+		for (; (r < nr_runs) && (runs[r].phdr == i); r++) {
+			unsigned long long delta;
+			if (runs[r].end - runs[r].start < min_run)
+				continue;
+			if (runs[r].end == end) {
+				/* Zeros to the end just shorten p_filesz */
+				end = runs[r].start;
+				continue;
+			}
+			/* Close the current segment with the run as its tail */
+			seg->p_filesz = runs[r].start - start;
+			seg->p_memsz = runs[r].end - start;
+			seg++;
+
+			/* and start the next one right after it */
+			delta = runs[r].end - phdr[i].p_offset;
+			*seg = phdr[i];
+			seg->p_offset = runs[r].end;
+			seg->p_vaddr += delta;
+			seg->p_paddr += delta;
+			seg->p_filesz -= delta;
+			seg->p_memsz -= delta;
+			start = runs[r].end;
+		}
+		seg->p_filesz = end - start;
+		seg++;
+	}
+	free(runs);
+
+	*nphnum = seg - nphdr;
+	return nphdr;
+}
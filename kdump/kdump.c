@@ -7,8 +7,13 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <time.h>
 #include <endian.h>
 #include <elf.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include "kdump.h"
 
 #if !defined(__BYTE_ORDER) || !defined(__LITTLE_ENDIAN) || !defined(__BIG_ENDIAN)
 #error Endian defines missing
@@ -25,10 +30,30 @@
 #define MAP_WINDOW_SIZE (64*1024*1024)
 #define DEV_MEM "/dev/mem"
 
+/* How many windows each worker may have mapped ahead of the writer
+ * in ordered mode.
+ */
+#define MAP_AHEAD	2
+
+/* Uncompressed size of each independently compressed block */
+#define COMPRESS_BLOCK_SIZE (4*1024*1024)
+
+/* Shortest run of zero bytes --elide-zero splits a PT_LOAD around */
+#define ELIDE_MIN_RUN (1024*1024)
+
+enum {
+	OPT_COMPRESS = 256,
+	OPT_ELIDE_ZERO,
+	OPT_SPARSE,
+	OPT_CHECKPOINT,
+	OPT_RESUME,
+	OPT_DECOMPRESS,
+};
+
 #define ALIGN_MASK(x,y) (((x) + (y)) & ~(y))
 #define ALIGN(x,y)	ALIGN_MASK(x, (y) - 1)
 
-static void *map_addr(int fd, unsigned long size, off_t offset)
+void *map_addr(int fd, unsigned long size, off_t offset)
 {
 	unsigned long page_size = getpagesize();
 	unsigned long map_offset = offset & (page_size - 1);
@@ -44,7 +69,7 @@ static void *map_addr(int fd, unsigned long size, off_t offset)
 	return result + map_offset;
 }
 
-static void unmap_addr(void *addr, unsigned long size)
+void unmap_addr(void *addr, unsigned long size)
 {
 	unsigned long page_size = getpagesize();
 	unsigned long map_offset = (uintptr_t)addr & (page_size - 1);
@@ -61,7 +86,7 @@ static void unmap_addr(void *addr, unsigned long size)
 	}
 }
 
-static void *xmalloc(size_t size)
+void *xmalloc(size_t size)
 {
 	void *result;
 	result = malloc(size);
@@ -74,16 +99,16 @@ static void *xmalloc(size_t size)
 }
 
 static void *collect_notes(
-	int fd, Elf64_Ehdr *ehdr, Elf64_Phdr *phdr, size_t *note_bytes)
+	int fd, Elf64_Phdr *phdr, size_t phnum, size_t *note_bytes)
 {
-	int i;
+	size_t i;
 	size_t bytes, result_bytes;
 	char *notes;
 
 	result_bytes = 0;
 	/* Find the worst case note memory usage */
 	bytes = 0;
-	for(i = 0; i < ehdr->e_phnum; i++) {
+	for(i = 0; i < phnum; i++) {
 		if (phdr[i].p_type == PT_NOTE) {
 			bytes += phdr[i].p_filesz;
 		}
@@ -93,7 +118,7 @@ static void *collect_notes(
 	notes = xmalloc(bytes);
 
 	/* Walk through and capture the notes */
-	for(i = 0; i < ehdr->e_phnum; i++) {
+	for(i = 0; i < phnum; i++) {
 		Elf64_Nhdr *hdr, *lhdr, *nhdr;
 		void *pnotes;
 		if (phdr[i].p_type != PT_NOTE) {
@@ -133,29 +158,35 @@ static void *collect_notes(
 	return notes;
 }
 
-static void *generate_new_headers(
-	Elf64_Ehdr *ehdr, Elf64_Phdr *phdr, size_t note_bytes, size_t *header_bytes)
+static void *generate_new_headers(Elf64_Ehdr *ehdr, Elf64_Phdr *phdr,
+	size_t phnum, size_t note_bytes, size_t *header_bytes)
 {
-	unsigned phnum;
+	size_t nphnum;
 	size_t bytes;
 	char *headers;
 	Elf64_Ehdr *nehdr;
 	Elf64_Phdr *nphdr;
+	Elf64_Shdr *nshdr;
 	unsigned long long offset;
-	int i;
+	size_t i;
 	/* Count the number of program headers.
 	 * When we are done there will be only one note header.
 	 */
-	phnum = 1;
-	for(i = 0; i < ehdr->e_phnum; i++) {
+	nphnum = 1;
+	for(i = 0; i < phnum; i++) {
 		if (phdr[i].p_type == PT_NOTE) {
 			continue;
 		}
-		phnum++;
+		nphnum++;
 	}
 
-	/* Compute how many bytes we will need for headers */
-	bytes = sizeof(*ehdr) + sizeof(*phdr)*phnum;
+	/* Compute how many bytes we will need for headers, including
+	 * the section header that holds the count past PN_XNUM.
+	 */
+	bytes = sizeof(*ehdr) + sizeof(*phdr)*nphnum;
+	if (nphnum >= PN_XNUM) {
+		bytes += sizeof(*nshdr);
+	}
 
 	/* Allocate memory for the headers */
 	headers = xmalloc(bytes);
@@ -167,11 +198,21 @@ static void *generate_new_headers(
 	/* Copy and adjust the Elf header */
 	memcpy(nehdr, ehdr, sizeof(*nehdr));
 	nehdr->e_phoff = sizeof(*nehdr);
-	nehdr->e_phnum = phnum;
+	nehdr->e_phnum = nphnum;
 	nehdr->e_shoff = 0;
 	nehdr->e_shentsize = 0;
 	nehdr->e_shnum = 0;
 	nehdr->e_shstrndx = 0;
+	if (nphnum >= PN_XNUM) {
+		nshdr = (Elf64_Shdr *)(nphdr + nphnum);
+		memset(nshdr, 0, sizeof(*nshdr));
+		nshdr->sh_type = SHT_NULL;
+		nshdr->sh_info = nphnum;
+		nehdr->e_phnum = PN_XNUM;
+		nehdr->e_shoff = (char *)nshdr - headers;
+		nehdr->e_shentsize = sizeof(*nshdr);
+		nehdr->e_shnum = 1;
+	}
 
 	/* Write the note program header */
 	nphdr->p_type = PT_NOTE;
@@ -186,7 +227,7 @@ static void *generate_new_headers(
 
 	/* Write the rest of the program headers */
 	offset = bytes + note_bytes;
-	for(i = 0; i < ehdr->e_phnum; i++) {
+	for(i = 0; i < phnum; i++) {
 		if (phdr[i].p_type == PT_NOTE) {
 			continue;
 		}
@@ -200,7 +241,7 @@ static void *generate_new_headers(
 	return headers;
 }
 
-static void write_all(int fd, const void *buf, size_t count)
+void write_all(int fd, const void *buf, size_t count)
 {
 	ssize_t result;
 	size_t written = 0;
@@ -223,23 +264,570 @@ static void write_all(int fd, const void *buf, size_t count)
 	} while(written < count);
 }
 
+static void pwrite_all(int fd, const void *buf, size_t count, off_t offset)
+{
+	ssize_t result;
+	size_t written = 0;
+	const char *ptr;
+	size_t left;
+	ptr = buf;
+	left = count;
+	do {
+		result = pwrite(fd, ptr, left, offset + written);
+		if (result >= 0) {
+			written += result;
+			ptr += result;
+			left -= result;
+		}
+		else if ((errno != EAGAIN) && (errno != EINTR)) {
+			fprintf(stderr, "pwrite failed: %s\n",
+				strerror(errno));
+			exit(8);
+		}
+	} while(written < count);
+}
+
+static struct window *build_windows(
+	Elf64_Phdr *phdr, size_t phnum, size_t header_bytes,
+	size_t note_bytes, size_t window_size, size_t *nr_windows)
+{
+	struct window *windows;
+	unsigned long long dst;
+	size_t nr;
+	size_t i;
+
+	/* Count the windows first so we only allocate once */
+	nr = 0;
+	for(i = 0; i < phnum; i++) {
+		if (phdr[i].p_type == PT_NOTE) {
+			continue;
+		}
+		nr += (phdr[i].p_filesz + window_size - 1) / window_size;
+	}
+	windows = xmalloc(sizeof(*windows) * (nr ? nr : 1));
+
+	/* Lay the windows out exactly as generate_new_headers() does */
+	nr = 0;
+	dst = header_bytes + note_bytes;
+	for(i = 0; i < phnum; i++) {
+		unsigned long long offset, size;
+		size_t wsize;
+		if (phdr[i].p_type == PT_NOTE) {
+			continue;
+		}
+		offset = phdr[i].p_offset;
+		size   = phdr[i].p_filesz;
+		for(; size > 0; size -= wsize, offset += wsize) {
+			wsize = window_size;
+			if (wsize > size) {
+				wsize = size;
+			}
+			windows[nr].src   = offset;
+			windows[nr].dst   = dst;
+			windows[nr].size  = wsize;
+			windows[nr].buf   = NULL;
+			windows[nr].out   = NULL;
+			windows[nr].out_size = 0;
+			windows[nr].ready = 0;
+			dst += wsize;
+			nr++;
+		}
+	}
+	*nr_windows = nr;
+	return windows;
+}
+
+/*
+ * Write one window at the output's file position, or at *pos when the
+ * caller is one of several positioned writers.  buf may be NULL if the
+ * window has not been mapped yet.
+ */
+static void output_window(int fd, int out_fd, struct window *w,
+	void *buf, off_t *pos)
+{
+	int mapped = 0;
+
+	if (!buf) {
+		buf = map_addr(fd, w->size, w->src);
+		mapped = 1;
+	}
+	if (pos) {
+		pwrite_all(out_fd, buf, w->size, *pos);
+	} else {
+		write_all(out_fd, buf, w->size);
+	}
+	if (mapped) {
+		unmap_addr(buf, w->size);
+	}
+}
+
+/*
+ * Write only the pages of a window that hold something, leaving holes
+ * in the file for the rest.
+ */
+static void output_window_sparse(int fd, int out_fd,
+	struct window *w, off_t pos)
+{
+	unsigned long page_size = getpagesize();
+	size_t off, len, data_start;
+	int in_data = 0;
+	char *buf;
+
+	buf = map_addr(fd, w->size, w->src);
+	data_start = 0;
+	for (off = 0; off < w->size; off += len) {
+		len = w->size - off;
+		if (len > page_size) {
+			len = page_size;
+		}
+		if (mem_is_zero(buf + off, len)) {
+			if (in_data) {
+				pwrite_all(out_fd, buf + data_start,
+					off - data_start, pos + data_start);
+				in_data = 0;
+			}
+		} else if (!in_data) {
+			data_start = off;
+			in_data = 1;
+		}
+	}
+	if (in_data) {
+		pwrite_all(out_fd, buf + data_start, w->size - data_start,
+			pos + data_start);
+	}
+	unmap_addr(buf, w->size);
+}
+
+static double elapsed_seconds(const struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) +
+		(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void copy_windows_serial(int fd, int out_fd,
+	struct window *windows, size_t nr, struct checkpoint *ckp)
+{
+	size_t i;
+	for(i = 0; i < nr; i++) {
+		output_window(fd, out_fd, &windows[i], NULL, NULL);
+		if (ckp) {
+			checkpoint_window_done(ckp, &windows[i]);
+		}
+	}
+}
+
+struct copy_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct window *windows;
+	size_t nr;
+	size_t next_map;	/* next window a worker will claim */
+	size_t next_write;	/* next window the writer will emit */
+	size_t max_ahead;	/* bound on windows mapped but not written */
+	int fd;
+	int out_fd;
+	int positioned;		/* workers write their own windows */
+	off_t out_base;
+	int sparse;		/* positioned writers skip zero pages */
+	const struct compress_params *compress;
+	struct checkpoint *ckp;
+};
+
+/* Compress a mapped window, keeping the mapping only if it is stored */
+static void compress_window(const struct compress_params *compress,
+	struct window *w, void *buf)
+{
+	size_t bound;
+
+	bound = compress_bound(compress, w->size);
+	w->out = xmalloc(bound);
+	w->out_size = compress_block(compress, w->out, bound, buf, w->size);
+	if (w->out_size == 0) {
+		free(w->out);
+		w->out = NULL;
+		w->buf = buf;
+		return;
+	}
+	unmap_addr(buf, w->size);
+}
+
+static void *copy_worker(void *arg)
+{
+	struct copy_pool *pool = arg;
+	struct window *w;
+	void *buf;
+
+	for(;;) {
+		pthread_mutex_lock(&pool->lock);
+		while (!pool->positioned && (pool->next_map < pool->nr) &&
+			(pool->next_map >= pool->next_write + pool->max_ahead)) {
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		}
+		if (pool->next_map >= pool->nr) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		w = &pool->windows[pool->next_map++];
+		pthread_mutex_unlock(&pool->lock);
+
+		if (pool->positioned) {
+			off_t pos = pool->out_base + w->dst;
+			if (pool->sparse) {
+				output_window_sparse(pool->fd, pool->out_fd, w,
+					pos);
+			} else {
+				output_window(pool->fd, pool->out_fd, w, NULL,
+					&pos);
+			}
+			if (pool->ckp) {
+				checkpoint_window_done(pool->ckp, w);
+			}
+			continue;
+		}
+		buf = map_addr(pool->fd, w->size, w->src);
+		if (pool->compress) {
+			compress_window(pool->compress, w, buf);
+		}
+
+		/* Hand the mapping or the compressed block to the writer */
+		pthread_mutex_lock(&pool->lock);
+		if (!pool->compress) {
+			w->buf = buf;
+		}
+		w->ready = 1;
+		pthread_cond_broadcast(&pool->cond);
+		pthread_mutex_unlock(&pool->lock);
+	}
+	return NULL;
+}
+
+/*
+ * Map windows from several threads at once.  When the output is a
+ * regular file each worker writes its own window at its final offset,
+ * otherwise this thread writes the windows out in order as they
+ * become ready.  Compressed windows are always written in order,
+ * framed by the kdumpz writer.  A sparse copy has to be positioned.
+ * The output's file position has to be at the first window's offset.
+ */
+static void copy_windows_parallel(int fd, int out_fd,
+	struct window *windows, size_t nr, unsigned threads, int sparse,
+	const struct compress_params *compress, struct kdumpz_writer *writer,
+	struct checkpoint *ckp)
+{
+	struct copy_pool pool;
+	pthread_t tid[MAX_THREADS];
+	struct stat st;
+	unsigned i;
+	int result;
+
+	memset(&pool, 0, sizeof(pool));
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.cond, NULL);
+	pool.windows = windows;
+	pool.nr = nr;
+	pool.max_ahead = threads * MAP_AHEAD;
+	pool.fd = fd;
+	pool.out_fd = out_fd;
+	pool.compress = compress;
+	pool.ckp = ckp;
+
+	/* pwrite() ignores the file offset with O_APPEND, so only use
+	 * positioned output when it lands where write() would have.
+	 */
+	if (!compress && nr && (fstat(out_fd, &st) == 0) &&
+		S_ISREG(st.st_mode) && !(fcntl(out_fd, F_GETFL) & O_APPEND)) {
+		pool.out_base = lseek(out_fd, 0, SEEK_CUR);
+		if (pool.out_base != (off_t)-1) {
+			/* Window offsets count from the start of the core */
+			pool.out_base -= windows[0].dst;
+			pool.positioned = 1;
+		}
+	}
+
+	if (sparse && !pool.positioned) {
+		fprintf(stderr, "--sparse needs stdout to be a regular file "
+			"that is not opened for appending\n");
+		exit(11);
+	}
+	pool.sparse = sparse;
+
+	for(i = 0; i < threads; i++) {
+		result = pthread_create(&tid[i], NULL, copy_worker, &pool);
+		if (result != 0) {
+			fprintf(stderr, "Cannot create copy thread: %s\n",
+				strerror(result));
+			exit(10);
+		}
+	}
+
+	if (!pool.positioned) {
+		size_t n;
+		for(n = 0; n < nr; n++) {
+			struct window *w = &windows[n];
+			pthread_mutex_lock(&pool.lock);
+			while (!w->ready) {
+				pthread_cond_wait(&pool.cond, &pool.lock);
+			}
+			pthread_mutex_unlock(&pool.lock);
+
+			if (w->out) {
+				kdumpz_write_block(writer, w->dst, w->size,
+					w->out, w->out_size, 0);
+				free(w->out);
+				w->out = NULL;
+			} else if (compress) {
+				kdumpz_write_block(writer, w->dst, w->size,
+					w->buf, w->size, KDUMPZ_BLOCK_STORED);
+				unmap_addr(w->buf, w->size);
+			} else {
+				output_window(fd, out_fd, w, w->buf, NULL);
+				unmap_addr(w->buf, w->size);
+				if (ckp) {
+					checkpoint_window_done(ckp, w);
+				}
+			}
+
+			pthread_mutex_lock(&pool.lock);
+			w->buf = NULL;
+			pool.next_write++;
+			pthread_cond_broadcast(&pool.cond);
+			pthread_mutex_unlock(&pool.lock);
+		}
+	}
+
+	for(i = 0; i < threads; i++) {
+		pthread_join(tid[i], NULL);
+	}
+
+	/* Leave the file offset where a sequential copy would have, and
+	 * make sure trailing holes still count towards the file size.
+	 */
+	if (pool.positioned && nr) {
+		struct window *last = &windows[nr - 1];
+		off_t end = pool.out_base + last->dst + last->size;
+		if (sparse && (fstat(out_fd, &st) == 0) &&
+			(st.st_size < end) && (ftruncate(out_fd, end) < 0)) {
+			fprintf(stderr, "Cannot extend the output to %llu "
+				"bytes: %s\n", (unsigned long long)end,
+				strerror(errno));
+			exit(8);
+		}
+		lseek(out_fd, end, SEEK_SET);
+	}
+	pthread_cond_destroy(&pool.cond);
+	pthread_mutex_destroy(&pool.lock);
+}
+
+/* --decompress: write the ELF core in a compressed one back out */
+static int decompress(const char *path, const char *output_path)
+{
+	int in_fd, out_fd;
+
+	in_fd = open(path, O_RDONLY);
+	if (in_fd < 0) {
+		fprintf(stderr, "Cannot open %s: %s\n", path,
+			strerror(errno));
+		exit(3);
+	}
+	out_fd = STDOUT_FILENO;
+	if (output_path) {
+		out_fd = open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		if (out_fd < 0) {
+			fprintf(stderr, "Cannot open %s: %s\n",
+				output_path, strerror(errno));
+			exit(3);
+		}
+	}
+	if (kdumpz_decode(in_fd, out_fd) != 0) {
+		exit(4);
+	}
+	if (output_path && (close(out_fd) < 0)) {
+		fprintf(stderr, "Cannot close %s: %s\n",
+			output_path, strerror(errno));
+		exit(8);
+	}
+	close(in_fd);
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [OPTION]... [start_address]\n"
+		"Write the crashed kernel's memory as an ELF core to stdout\n"
+		"\n"
+		" -h, --help           Print this help.\n"
+		" -j, --threads=N      Map and write N windows in parallel.\n"
+		"                      When stdout is a regular file each\n"
+		"                      thread writes its windows in place.\n"
+		" -s, --stats          Report the bytes written and the\n"
+		"                      throughput on stderr at exit.\n"
+		"     --compress=ALGO[:LEVEL]\n"
+		"                      Compress the memory in independent\n"
+		"                      blocks with an index at the end.\n"
+		"                      ALGO is one of:"
+#ifdef HAVE_LIBZ
+		" zlib"
+#endif
+#ifdef HAVE_LIBLZMA
+		" lzma"
+#endif
+#ifdef HAVE_LIBZSTD
+		" zstd"
+#endif
+		"\n"
+		"     --elide-zero     Split PT_LOAD segments around runs of\n"
+		"                      zero pages so the zeros are not written.\n"
+		"     --sparse         Leave holes in a regular file on stdout\n"
+		"                      where pages are zero.\n"
+		" -o, --output=FILE    Write the core to FILE, not stdout.\n"
+		"     --checkpoint=CKP Record in CKP how much of the core in\n"
+		"                      the --output FILE is safely on disk.\n"
+		"     --resume         Carry on from where CKP says an earlier\n"
+		"                      run with the same options stopped.\n"
+		"     --decompress=FILE\n"
+		"                      Write the ELF core a --compress FILE\n"
+		"                      holds to stdout or --output, and exit.\n"
+		"\n"
+		"start_address defaults to the elfcorehdr environment variable.\n",
+		name);
+}
+
 int main(int argc, char **argv)
 {
 	char *start_addr_str, *end;
 	unsigned long long start_addr;
 	Elf64_Ehdr *ehdr;
-	Elf64_Phdr *phdr;
+	Elf64_Phdr *phdr, *core_phdr;
+	Elf64_Shdr *shdr;
+	size_t phnum, core_phnum;
 	void *notes, *headers;
 	size_t note_bytes, header_bytes;
+	struct window *windows;
+	size_t nr_windows;
+	unsigned long threads;
+	struct timespec start;
+	unsigned long long total_bytes, core_bytes;
+	int stats, elide_zero, sparse, resume;
+	const char *output_path, *checkpoint_path, *decompress_path;
+	struct checkpoint ckp, *ckpp;
+	size_t first;
+	int out_fd;
+	struct compress_params compress;
+	struct kdumpz_writer writer;
+	double seconds;
+	size_t n;
 	int fd;
-	int i;
+	int opt;
+	static const struct option options[] = {
+		{ "help",		0, NULL, 'h' },
+		{ "threads",		1, NULL, 'j' },
+		{ "stats",		0, NULL, 's' },
+		{ "compress",		1, NULL, OPT_COMPRESS },
+		{ "elide-zero",		0, NULL, OPT_ELIDE_ZERO },
+		{ "sparse",		0, NULL, OPT_SPARSE },
+		{ "output",		1, NULL, 'o' },
+		{ "checkpoint",		1, NULL, OPT_CHECKPOINT },
+		{ "resume",		0, NULL, OPT_RESUME },
+		{ "decompress",		1, NULL, OPT_DECOMPRESS },
+		{ NULL,			0, NULL, 0 },
+	};
+	static const char short_options[] = "hj:so:";
+
+	threads = 1;
+	stats = 0;
+	elide_zero = 0;
+	sparse = 0;
+	resume = 0;
+	output_path = NULL;
+	checkpoint_path = NULL;
+	decompress_path = NULL;
+	compress.algorithm = KDUMPZ_NONE;
+	compress.level = 0;
+	while ((opt = getopt_long(argc, argv, short_options,
+				  options, NULL)) != -1) {
+		switch(opt) {
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		case 'j':
+			threads = strtoul(optarg, &end, 0);
+			if ((optarg == end) || (*end != '\0') ||
+				(threads < 1) || (threads > MAX_THREADS)) {
+				fprintf(stderr, "Bad thread count: %s\n",
+					optarg);
+				exit(9);
+			}
+			break;
+		case 's':
+			stats = 1;
+			break;
+		case OPT_COMPRESS:
+			if (compress_parse(optarg, &compress) != 0) {
+				fprintf(stderr, "Unsupported compression: %s\n",
+					optarg);
+				exit(9);
+			}
+			break;
+		case OPT_ELIDE_ZERO:
+			elide_zero = 1;
+			break;
+		case OPT_SPARSE:
+			sparse = 1;
+			break;
+		case 'o':
+			output_path = optarg;
+			break;
+		case OPT_CHECKPOINT:
+			checkpoint_path = optarg;
+			break;
+		case OPT_RESUME:
+			resume = 1;
+			break;
+		case OPT_DECOMPRESS:
+			decompress_path = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			exit(9);
+		}
+	}
+
+	if (sparse && (compress.algorithm != KDUMPZ_NONE)) {
+		fprintf(stderr, "--sparse and --compress do not mix\n");
+		exit(9);
+	}
+	if (checkpoint_path && !output_path) {
+		fprintf(stderr, "--checkpoint needs --output\n");
+		exit(9);
+	}
+	if (checkpoint_path && (compress.algorithm != KDUMPZ_NONE)) {
+		fprintf(stderr, "--checkpoint and --compress do not mix\n");
+		exit(9);
+	}
+	if (resume && !checkpoint_path) {
+		fprintf(stderr, "--resume needs --checkpoint\n");
+		exit(9);
+	}
+	if (decompress_path) {
+		if ((compress.algorithm != KDUMPZ_NONE) || sparse ||
+			elide_zero || checkpoint_path || (optind < argc)) {
+			fprintf(stderr, "--decompress only goes with "
+				"--output\n");
+			exit(9);
+		}
+		return decompress(decompress_path, output_path);
+	}
+
 	start_addr_str = 0;
-	if (argc > 2) {
+	if (argc - optind > 1) {
 		fprintf(stderr, "Invalid argument count\n");
 		exit(9);
 	}
-	if (argc == 2) {
-		start_addr_str = argv[1];
+	if (argc - optind == 1) {
+		start_addr_str = argv[optind];
 	}
 	if (!start_addr_str) {
 		start_addr_str = getenv("elfcorehdr");
@@ -262,6 +850,18 @@ int main(int argc, char **argv)
 		exit(3);
 	}
 
+	/* A resumed capture keeps what the earlier run left in the file */
+	out_fd = STDOUT_FILENO;
+	if (output_path) {
+		out_fd = open(output_path,
+			O_WRONLY | O_CREAT | (resume ? 0 : O_TRUNC), 0600);
+		if (out_fd < 0) {
+			fprintf(stderr, "Cannot open %s: %s\n",
+				output_path, strerror(errno));
+			exit(3);
+		}
+	}
+
 	/* Get the elf header */
 	ehdr = map_addr(fd, sizeof(*ehdr), start_addr);
 
@@ -283,45 +883,127 @@ int main(int argc, char **argv)
 		exit(4);
 	}
 	
+	/* Past PN_XNUM the real count is in section header 0 */
+	phnum = ehdr->e_phnum;
+	if (phnum == PN_XNUM) {
+		if ((ehdr->e_shoff == 0) ||
+			(ehdr->e_shentsize != sizeof(Elf64_Shdr)))
+		{
+			fprintf(stderr, "Invalid Elf header\n");
+			exit(4);
+		}
+		shdr = map_addr(fd, sizeof(*shdr), start_addr + ehdr->e_shoff);
+		phnum = shdr->sh_info;
+		unmap_addr(shdr, sizeof(*shdr));
+	}
+
 	/* Get the program header */
-	phdr = map_addr(fd, sizeof(*phdr)*(ehdr->e_phnum),
+	phdr = map_addr(fd, sizeof(*phdr)*phnum,
 			start_addr + ehdr->e_phoff);
 
 	/* Collect up the notes */
 	note_bytes = 0;
-	notes = collect_notes(fd, ehdr, phdr, &note_bytes);
+	notes = collect_notes(fd, phdr, phnum, &note_bytes);
 	
+	/* Find the zero runs to leave out of the PT_LOADs */
+	core_phdr = phdr;
+	core_phnum = phnum;
+	if (elide_zero) {
+		core_phdr = elide_zero_runs(fd, phdr, phnum, threads,
+					    ELIDE_MIN_RUN, &core_phnum);
+	}
+
 	/* Generate new headers */
 	header_bytes = 0;
-	headers = generate_new_headers(ehdr, phdr, note_bytes, &header_bytes);
+	headers = generate_new_headers(ehdr, core_phdr, core_phnum,
+				       note_bytes, &header_bytes);
 
 	/* Write out everything */
-	write_all(STDOUT_FILENO, headers, header_bytes);
-	write_all(STDOUT_FILENO, notes, note_bytes);
-	for(i = 0; i < ehdr->e_phnum; i++) {
-		unsigned long long offset, size;
-		size_t wsize;
-		if (phdr[i].p_type == PT_NOTE) {
-			continue;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	core_bytes = header_bytes + note_bytes;
+	total_bytes = 0;
+	if (compress.algorithm != KDUMPZ_NONE) {
+		/* The workers do the compressing, this thread only writes */
+		kdumpz_begin(&writer, out_fd, &compress, COMPRESS_BLOCK_SIZE,
+			     headers, header_bytes, notes, note_bytes);
+		windows = build_windows(core_phdr, core_phnum, header_bytes,
+					note_bytes, COMPRESS_BLOCK_SIZE,
+					&nr_windows);
+		copy_windows_parallel(fd, out_fd, windows, nr_windows,
+				      threads, 0, &compress, &writer, NULL);
+		for(n = 0; n < nr_windows; n++) {
+			core_bytes += windows[n].size;
 		}
-		offset = phdr[i].p_offset;
-		size   = phdr[i].p_filesz;
-		wsize  = MAP_WINDOW_SIZE;
-		if (wsize > size) {
-			wsize = size;
+		kdumpz_finish(&writer, core_bytes);
+		total_bytes = core_bytes;
+	} else {
+		windows = build_windows(core_phdr, core_phnum, header_bytes,
+					note_bytes, MAP_WINDOW_SIZE,
+					&nr_windows);
+		first = 0;
+		ckpp = NULL;
+		if (checkpoint_path) {
+			ckpp = &ckp;
+			checkpoint_init(ckpp, checkpoint_path, out_fd,
+					windows, nr_windows, MAP_WINDOW_SIZE,
+					headers, header_bytes,
+					notes, note_bytes);
 		}
-		for(;size > 0; size -= wsize, offset += wsize) {
-			void *buf;
-			wsize = MAP_WINDOW_SIZE;
-			if (wsize > size) {
-				wsize = size;
+		if (resume) {
+			first = checkpoint_resume(ckpp);
+			lseek(out_fd, first < nr_windows ?
+			      windows[first].dst : core_bytes, SEEK_SET);
+		} else {
+			write_all(out_fd, headers, header_bytes);
+			write_all(out_fd, notes, note_bytes);
+			total_bytes = header_bytes + note_bytes;
+			if (ckpp) {
+				checkpoint_start(ckpp);
 			}
-			buf = map_addr(fd, wsize, offset);
-			write_all(STDOUT_FILENO, buf, wsize);
-			unmap_addr(buf, wsize);
+		}
+		if ((threads > 1) || sparse) {
+			copy_windows_parallel(fd, out_fd, windows + first,
+					      nr_windows - first, threads,
+					      sparse, NULL, NULL, ckpp);
+		} else {
+			copy_windows_serial(fd, out_fd, windows + first,
+					    nr_windows - first, ckpp);
+		}
+		if (ckpp) {
+			checkpoint_finish(ckpp);
+		}
+		for(n = first; n < nr_windows; n++) {
+			total_bytes += windows[n].size;
 		}
 	}
+
+	if (stats) {
+		seconds = elapsed_seconds(&start);
+		if (compress.algorithm != KDUMPZ_NONE) {
+			fprintf(stderr, "kdump: compressed %llu bytes to %llu "
+				"in %.3f seconds (%.1f MiB/s) using %s\n",
+				total_bytes, writer.offset, seconds,
+				seconds > 0 ? total_bytes / seconds /
+					(1024*1024) : 0.0,
+				compress_name(compress.algorithm));
+		} else {
+			fprintf(stderr, "kdump: wrote %llu bytes in %.3f "
+				"seconds (%.1f MiB/s)\n",
+				total_bytes, seconds,
+				seconds > 0 ? total_bytes / seconds /
+					(1024*1024) : 0.0);
+		}
+	}
+	free(windows);
+	if (core_phdr != phdr) {
+		free(core_phdr);
+	}
 	free(notes);
+	if (output_path && (close(out_fd) < 0)) {
+		fprintf(stderr, "Cannot close %s: %s\n",
+			output_path, strerror(errno));
+		exit(8);
+	}
 	close(fd);
 	return 0;
 }
@@ -0,0 +1,177 @@
+#ifndef KDUMP_H
+#define KDUMP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <elf.h>
+#include <pthread.h>
+
+#include "config.h"
+
+#ifndef PN_XNUM
+#define PN_XNUM 0xffff
+#endif
+
+/* Upper bound on the worker pools */
+#define MAX_THREADS	256
+
+void *map_addr(int fd, unsigned long size, off_t offset);
+void unmap_addr(void *addr, unsigned long size);
+void *xmalloc(size_t size);
+void write_all(int fd, const void *buf, size_t count);
+
+/* A piece of a PT_LOAD segment that is mapped and written in one go */
+struct window {
+	unsigned long long src;		/* offset in /dev/mem */
+	unsigned long long dst;		/* offset in the new core */
+	size_t size;
+	void *buf;			/* mapping, once a worker has it */
+	void *out;			/* compressed payload, if any */
+	size_t out_size;
+	int ready;
+};
+
+int mem_is_zero(const void *buf, size_t len);
+Elf64_Phdr *elide_zero_runs(int fd, Elf64_Phdr *phdr, size_t phnum,
+	unsigned threads, unsigned long long min_run, size_t *nphnum);
+
+/*
+ * Compressed core format (--compress)
+ *
+ * All fields are in the byte order of the machine that wrote the dump,
+ * which is also the byte order of the ELF core inside it.
+ *
+ *   struct kdumpz_header
+ *   ELF header, program headers and notes, uncompressed (raw_bytes)
+ *   one struct kdumpz_block plus its payload per block, in core order
+ *   struct kdumpz_index_entry for every block
+ *   struct kdumpz_trailer, the last bytes of the file
+ *
+ * The program headers keep the offsets of the uncompressed core, and
+ * every block covers the core bytes [uoffset, uoffset + usize).  The
+ * first block starts at raw_bytes and each one starts where the one
+ * before it ends, up to core_size.  No block is longer than block_size.
+ *
+ * A block's payload is csize bytes, compressed on its own with the
+ * header's algorithm: a zlib stream for KDUMPZ_ZLIB, an .xz stream
+ * without a check for KDUMPZ_LZMA, a zstd frame for KDUMPZ_ZSTD.  A
+ * block with KDUMPZ_BLOCK_STORED set is the core bytes as they are, and
+ * its csize equals its usize.
+ *
+ * The index has one entry per block, in the same order, with the file
+ * offset of the block's struct kdumpz_block.  A reader that wants a
+ * given core offset reads the trailer, binary searches the index on
+ * uoffset and inflates just that one block.  "kdump --decompress"
+ * turns the whole file back into the ELF core.  The format is kdump's
+ * own; makedumpfile and crash cannot read it directly.
+ */
+#define KDUMPZ_MAGIC		"KDUMPZ\0\1"
+#define KDUMPZ_INDEX_MAGIC	"KDZINDEX"
+#define KDUMPZ_BLOCK_MAGIC	0x4b5a424bU	/* "KBZK" */
+
+#define KDUMPZ_NONE	0
+#define KDUMPZ_ZLIB	1
+#define KDUMPZ_LZMA	2
+#define KDUMPZ_ZSTD	3
+
+/* The block payload did not shrink and is stored as is */
+#define KDUMPZ_BLOCK_STORED	1
+
+/* 24 bytes at offset 0 */
+struct kdumpz_header {
+	char magic[8];		/* KDUMPZ_MAGIC */
+	uint32_t algorithm;	/* KDUMPZ_ZLIB, KDUMPZ_LZMA or KDUMPZ_ZSTD */
+	uint32_t block_size;	/* largest usize of any block */
+	uint64_t raw_bytes;	/* ELF headers and notes that follow */
+};
+
+/* 24 bytes, followed by csize bytes of payload */
+struct kdumpz_block {
+	uint32_t magic;		/* KDUMPZ_BLOCK_MAGIC */
+	uint32_t flags;		/* KDUMPZ_BLOCK_STORED */
+	uint32_t usize;
+	uint32_t csize;
+	uint64_t uoffset;
+};
+
+struct kdumpz_index_entry {
+	uint64_t uoffset;
+	uint64_t coffset;	/* file offset of the struct kdumpz_block */
+};
+
+/* 32 bytes at the end of the file */
+struct kdumpz_trailer {
+	uint64_t index_offset;	/* file offset of the first index entry */
+	uint64_t nr_blocks;
+	uint64_t core_size;	/* bytes in the uncompressed core */
+	char magic[8];		/* KDUMPZ_INDEX_MAGIC */
+};
+
+struct compress_params {
+	int algorithm;
+	int level;
+};
+
+int compress_parse(const char *arg, struct compress_params *params);
+const char *compress_name(int algorithm);
+size_t compress_bound(const struct compress_params *params, size_t size);
+size_t compress_block(const struct compress_params *params,
+	void *dst, size_t dst_size, const void *src, size_t size);
+
+struct kdumpz_writer {
+	int fd;
+	unsigned long long offset;
+	struct kdumpz_index_entry *index;
+	size_t nr_blocks;
+	size_t max_blocks;
+};
+
+void kdumpz_begin(struct kdumpz_writer *writer, int fd,
+	const struct compress_params *params, size_t block_size,
+	const void *headers, size_t header_bytes,
+	const void *notes, size_t note_bytes);
+void kdumpz_write_block(struct kdumpz_writer *writer,
+	unsigned long long uoffset, size_t usize,
+	const void *data, size_t csize, uint32_t flags);
+void kdumpz_finish(struct kdumpz_writer *writer,
+	unsigned long long core_size);
+int kdumpz_decode(int in_fd, int out_fd);
+
+/*
+ * Checkpoint file (--checkpoint), rewritten as windows become durable.
+ * The digest covers the ELF headers and notes, which have to come out
+ * byte for byte the same before a capture is resumed.
+ */
+#define KDUMP_CHECKPOINT_MAGIC	"KDUMPCKP"
+
+struct kdump_checkpoint {
+	char magic[8];
+	uint64_t window_size;
+	uint64_t nr_windows;
+	uint64_t committed;	/* windows [0, committed) are on disk */
+	uint64_t core_bytes;	/* bytes of headers and notes */
+	uint8_t digest[32];
+};
+
+struct checkpoint {
+	const char *path;
+	char *tmp_path;
+	int out_fd;
+	struct kdump_checkpoint state;
+	pthread_mutex_t lock;
+	struct window *windows;
+	unsigned char *done;	/* per window, set once it is written */
+	size_t next;		/* first window that is not done */
+};
+
+void checkpoint_init(struct checkpoint *ckp, const char *path, int out_fd,
+	struct window *windows, size_t nr_windows, size_t window_size,
+	const void *headers, size_t header_bytes,
+	const void *notes, size_t note_bytes);
+size_t checkpoint_resume(struct checkpoint *ckp);
+void checkpoint_start(struct checkpoint *ckp);
+void checkpoint_window_done(struct checkpoint *ckp, struct window *w);
+void checkpoint_finish(struct checkpoint *ckp);
+
+#endif /* KDUMP_H */
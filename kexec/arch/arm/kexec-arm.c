@@ -21,43 +21,38 @@
 #include "iomem.h"
 
 #define MAX_MEMORY_RANGES 64
-#define MAX_LINE 160
 static struct memory_range memory_range[MAX_MEMORY_RANGES];
 
 /* Return a sorted list of available memory ranges. */
 int get_memory_ranges(struct memory_range **range, int *ranges,
 		unsigned long UNUSED(kexec_flags))
 {
-	const char *iomem = proc_iomem();
+	const struct iomem_resource *res;
 	int memory_ranges = 0;
-	char line[MAX_LINE];
-	FILE *fp;
-	fp = fopen(iomem, "r");
-	if (!fp) {
+	int i, nr;
+
+	res = kexec_iomem_resources(&nr);
+	if (!res) {
 		fprintf(stderr, "Cannot open %s: %s\n",
-			iomem, strerror(errno));
+			proc_iomem(), strerror(errno));
 		return -1;
 	}
 
-	while(fgets(line, sizeof(line), fp) != 0) {
+	for (i = 0; i < nr; i++) {
 		unsigned long long start, end;
-		char *str;
+		const char *str;
 		int type;
-		int consumed;
-		int count;
 		if (memory_ranges >= MAX_MEMORY_RANGES)
 			break;
-		count = sscanf(line, "%llx-%llx : %n",
-			&start, &end, &consumed);
-		if (count != 2)
-			continue;
-		str = line + consumed;
+		start = res[i].start;
+		end = res[i].end;
+		str = res[i].name;
 
-		if (memcmp(str, SYSTEM_RAM_BOOT, strlen(SYSTEM_RAM_BOOT)) == 0 ||
-		    memcmp(str, SYSTEM_RAM, strlen(SYSTEM_RAM)) == 0) {
+		if (strncmp(str, SYSTEM_RAM_BOOT, strlen(SYSTEM_RAM_BOOT)) == 0 ||
+		    strncmp(str, SYSTEM_RAM, strlen(SYSTEM_RAM)) == 0) {
 			type = RANGE_RAM;
 		}
-		else if (memcmp(str, "reserved\n", 9) == 0) {
+		else if (strncmp(str, "reserved\n", 9) == 0) {
 			type = RANGE_RESERVED;
 		}
 		else {
@@ -69,7 +64,6 @@ int get_memory_ranges(struct memory_range **range, int *ranges,
 		memory_range[memory_ranges].type = type;
 		memory_ranges++;
 	}
-	fclose(fp);
 	*range = memory_range;
 	*ranges = memory_ranges;
 
@@ -98,7 +92,10 @@ void arch_usage(void)
 	       "               to the compressed images size * 4.\n"
 	       "     --dt-no-old-root\n"
 	       "               do not reuse old kernel root= param.\n"
-	       "               while creating flatten device tree.\n");
+	       "               while creating flatten device tree.\n"
+	       "     --dt-snapshot\n"
+	       "               build the device tree from /sys/firmware/fdt.\n"
+	       "               Faster, but misses changes made since boot.\n");
 }
 
 int arch_process_options(int argc, char **argv)
@@ -119,6 +116,9 @@ int arch_process_options(int argc, char **argv)
 		case OPT_DT_NO_OLD_ROOT:
 			dt_no_old_root = 1;
 			break;
+		case OPT_DT_SNAPSHOT:
+			dt_snapshot = 1;
+			break;
 		default:
 			break;
 		}
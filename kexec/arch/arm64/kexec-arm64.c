@@ -6,6 +6,7 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <inttypes.h>
 #include <libfdt.h>
@@ -520,6 +521,29 @@ unsigned long arm64_locate_kernel_segment(struct kexec_info *info)
 	return hole;
 }
 
+/**
+ * arm64_load_file_mode - Pass the initrd and command line to kexec_file_load.
+ */
+
+int arm64_load_file_mode(struct kexec_info *info)
+{
+	if (arm64_opts.initrd) {
+		info->initrd_fd = open(arm64_opts.initrd, O_RDONLY);
+		if (info->initrd_fd == -1) {
+			fprintf(stderr, "Could not open initrd file %s:%s\n",
+				arm64_opts.initrd, strerror(errno));
+			return EFAILED;
+		}
+	}
+
+	if (arm64_opts.command_line) {
+		info->command_line = (char *)arm64_opts.command_line;
+		info->command_line_len = strlen(arm64_opts.command_line) + 1;
+	}
+
+	return 0;
+}
+
 /**
  * arm64_load_other_segments - Prepare the dtb, initrd and purgatory segments.
  */
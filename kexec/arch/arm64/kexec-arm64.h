@@ -76,6 +76,7 @@ static inline void set_phys_offset(uint64_t v)
 
 int arm64_process_image_header(const struct arm64_image_header *h);
 unsigned long arm64_locate_kernel_segment(struct kexec_info *info);
+int arm64_load_file_mode(struct kexec_info *info);
 int arm64_load_other_segments(struct kexec_info *info,
 	unsigned long image_base);
 
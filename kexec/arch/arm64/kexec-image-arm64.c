@@ -35,6 +35,11 @@ int image_arm64_load(int argc, char **argv, const char *kernel_buf,
 	unsigned long kernel_segment;
 	int result;
 
+	if (info->file_mode) {
+		result = arm64_load_file_mode(info);
+		goto exit;
+	}
+
 	header = (const struct arm64_image_header *)(kernel_buf);
 
 	if (arm64_process_image_header(header))
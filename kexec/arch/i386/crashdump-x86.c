@@ -41,6 +41,7 @@
 #include "../../kexec-syscall.h"
 #include "../../firmware_memmap.h"
 #include "../../crashdump.h"
+#include "../../mem_regions.h"
 #include "kexec-x86.h"
 #include "crashdump-x86.h"
 
@@ -221,18 +222,45 @@ static int get_kernel_vaddr_and_size(struct kexec_info *UNUSED(info),
 }
 
 /* Forward Declaration. */
-static void segregate_lowmem_region(int *nr_ranges, unsigned long lowmem_limit);
-static int exclude_region(int *nr_ranges, uint64_t start, uint64_t end);
+static int add_crash_memory_range(unsigned long long start,
+				  unsigned long long end, int type,
+				  unsigned long lowmem_limit);
+static int exclude_region(uint64_t start, uint64_t end);
 
 /* Stores a sorted list of RAM memory ranges for which to create elf headers.
  * A separate program header is created for backup region */
-static struct memory_range crash_memory_range[CRASH_MAX_MEMORY_RANGES];
+static struct memory_ranges crash_memory_ranges;
 
 /* Memory region reserved for storing panic kernel and other data. */
 #define CRASH_RESERVED_MEM_NR	8
 static struct memory_range crash_reserved_mem[CRASH_RESERVED_MEM_NR];
 static int crash_reserved_mem_nr;
 
+/* The type of crash memory range an iomem resource gives, or -1 for none */
+static int crash_range_type(const char *str)
+{
+	/* Only Dumping memory of type System RAM. */
+	if (strncmp(str, "System RAM\n", 11) == 0)
+		return RANGE_RAM;
+	/*
+	 * ACPI Tables area need to be passed to new kernel with
+	 * appropriate memmap= option. This is needed so that x86_64
+	 * kernel creates linear mapping for this region which is
+	 * required for initializing acpi tables in second kernel.
+	 */
+	if (strncmp(str, "ACPI Tables\n", 12) == 0)
+		return RANGE_ACPI;
+	if (strncmp(str, "ACPI Non-volatile Storage\n", 26) == 0)
+		return RANGE_ACPI_NVS;
+	if (strncmp(str, "Persistent Memory (legacy)\n", 27) == 0)
+		return RANGE_PRAM;
+	if (strncmp(str, "Persistent Memory\n", 18) == 0)
+		return RANGE_PMEM;
+	if (strncmp(str, "reserved\n", 9) == 0)
+		return RANGE_RESERVED;
+	return -1;
+}
+
 /* Reads the appropriate file and retrieves the SYSTEM RAM regions for whom to
  * create Elf headers. Keeping it separate from get_memory_ranges() as
  * requirements are different in the case of normal kexec and crashdumps.
@@ -247,76 +275,61 @@ static int crash_reserved_mem_nr;
 static int get_crash_memory_ranges(struct memory_range **range, int *ranges,
 				   int kexec_flags, unsigned long lowmem_limit)
 {
-	const char *iomem = proc_iomem();
-	int memory_ranges = 0, gart = 0, i;
-	char line[MAX_LINE];
-	FILE *fp;
+	const struct iomem_resource *res, *parent;
+	int gart = 0, i, nr;
 	unsigned long long start, end;
 	uint64_t gart_start = 0, gart_end = 0;
 
-	fp = fopen(iomem, "r");
-	if (!fp) {
+	res = kexec_iomem_resources(&nr);
+	if (!res) {
 		fprintf(stderr, "Cannot open %s: %s\n",
-			iomem, strerror(errno));
+			proc_iomem(), strerror(errno));
 		return -1;
 	}
 
-	while(fgets(line, sizeof(line), fp) != 0) {
-		char *str;
-		int type, consumed, count;
+	for (i = 0; i < nr; i++) {
+		const char *str;
+		int type;
 
-		if (memory_ranges >= CRASH_MAX_MEMORY_RANGES)
-			break;
-		count = sscanf(line, "%llx-%llx : %n",
-			&start, &end, &consumed);
-		if (count != 2)
-			continue;
-		str = line + consumed;
+		start = res[i].start;
+		end = res[i].end;
+		str = res[i].name;
 		dbgprintf("%016llx-%016llx : %s",
 			start, end, str);
-		/* Only Dumping memory of type System RAM. */
-		if (memcmp(str, "System RAM\n", 11) == 0) {
-			type = RANGE_RAM;
-		} else if (memcmp(str, "ACPI Tables\n", 12) == 0) {
-			/*
-			 * ACPI Tables area need to be passed to new
-			 * kernel with appropriate memmap= option. This
-			 * is needed so that x86_64 kernel creates linear
-			 * mapping for this region which is required for
-			 * initializing acpi tables in second kernel.
-			 */
-			type = RANGE_ACPI;
-		} else if(memcmp(str,"ACPI Non-volatile Storage\n",26) == 0 ) {
-			type = RANGE_ACPI_NVS;
-		} else if(memcmp(str,"Persistent Memory (legacy)\n",27) == 0 ) {
-			type = RANGE_PRAM;
-		} else if(memcmp(str,"Persistent Memory\n",18) == 0 ) {
-			type = RANGE_PMEM;
-		} else if(memcmp(str,"reserved\n",9) == 0 ) {
-			type = RANGE_RESERVED;
-		} else if (memcmp(str, "GART\n", 5) == 0) {
+		if (strncmp(str, "GART\n", 5) == 0) {
 			gart_start = start;
 			gart_end = end;
 			gart = 1;
 			continue;
-		} else {
-			continue;
 		}
+		type = crash_range_type(str);
+		if (type < 0)
+			continue;
 
-		crash_memory_range[memory_ranges].start = start;
-		crash_memory_range[memory_ranges].end = end;
-		crash_memory_range[memory_ranges].type = type;
-
-		segregate_lowmem_region(&memory_ranges, lowmem_limit);
+		/*
+		 * Leave out anything nested in a range that is already in,
+		 * like the reserved parts of a Persistent Memory region, so
+		 * that the ranges do not overlap.
+		 */
+		for (parent = res[i].parent; parent->depth >= 0;
+		     parent = parent->parent) {
+			if (crash_range_type(parent->name) >= 0)
+				break;
+		}
+		if (parent->depth >= 0)
+			continue;
 
-		memory_ranges++;
+		if (add_crash_memory_range(start, end, type, lowmem_limit) < 0)
+			return -1;
 	}
-	fclose(fp);
+	/* Nested resources come after their parents, not always in order */
+	mem_regions_sort(&crash_memory_ranges);
+
 	if (kexec_flags & KEXEC_PRESERVE_CONTEXT) {
-		for (i = 0; i < memory_ranges; i++) {
-			if (crash_memory_range[i].end > 0x0009ffff) {
+		for (i = 0; i < (int)crash_memory_ranges.size; i++) {
+			if (crash_memory_ranges.ranges[i].end > 0x0009ffff) {
 				crash_reserved_mem[0].start = \
-					crash_memory_range[i].start;
+					crash_memory_ranges.ranges[i].start;
 				break;
 			}
 		}
@@ -331,17 +344,17 @@ static int get_crash_memory_ranges(struct memory_range **range, int *ranges,
 	}
 
 	for (i = 0; i < crash_reserved_mem_nr; i++)
-		if (exclude_region(&memory_ranges, crash_reserved_mem[i].start,
+		if (exclude_region(crash_reserved_mem[i].start,
 				crash_reserved_mem[i].end) < 0)
 			return -1;
 
 	if (gart) {
 		/* exclude GART region if the system has one */
-		if (exclude_region(&memory_ranges, gart_start, gart_end) < 0)
+		if (exclude_region(gart_start, gart_end) < 0)
 			return -1;
 	}
-	*range = crash_memory_range;
-	*ranges = memory_ranges;
+	*range = crash_memory_ranges.ranges;
+	*ranges = crash_memory_ranges.size;
 
 	return 0;
 }
@@ -350,9 +363,9 @@ static int get_crash_memory_ranges(struct memory_range **range, int *ranges,
 static int get_crash_memory_ranges_xen(struct memory_range **range,
 					int *ranges, unsigned long lowmem_limit)
 {
-	int j, rc, ret = -1;
-	struct e820entry e820entries[CRASH_MAX_MEMORY_RANGES];
-	unsigned int i;
+	int rc, ret = -1;
+	struct e820entry *e820entries = NULL;
+	unsigned int i, max_entries = MAX_MEMORY_RANGES;
 	xc_interface *xc;
 
 	xc = xc_interface_open(NULL, NULL, 0);
@@ -362,33 +375,42 @@ static int get_crash_memory_ranges_xen(struct memory_range **range,
 		return -1;
 	}
 
-	rc = xc_get_machine_memory_map(xc, e820entries, CRASH_MAX_MEMORY_RANGES);
+	/* A full buffer may mean the map did not fit, so ask again */
+	for (;;) {
+		e820entries = xrealloc(e820entries,
+				       max_entries * sizeof(*e820entries));
+		rc = xc_get_machine_memory_map(xc, e820entries, max_entries);
+		if (rc < 0 || (unsigned int)rc < max_entries)
+			break;
+		max_entries *= 2;
+	}
 
 	if (rc < 0) {
 		fprintf(stderr, "%s: xc_get_machine_memory_map: %s\n", __func__, strerror(-rc));
 		goto err;
 	}
 
-	for (i = 0, j = 0; i < rc && j < CRASH_MAX_MEMORY_RANGES; ++i, ++j) {
-		crash_memory_range[j].start = e820entries[i].addr;
-		crash_memory_range[j].end = e820entries[i].addr + e820entries[i].size - 1;
-		crash_memory_range[j].type = xen_e820_to_kexec_type(e820entries[i].type);
-		segregate_lowmem_region(&j, lowmem_limit);
-	}
-
-	*range = crash_memory_range;
-	*ranges = j;
+	for (i = 0; i < rc; ++i)
+		if (add_crash_memory_range(e820entries[i].addr,
+				e820entries[i].addr + e820entries[i].size - 1,
+				xen_e820_to_kexec_type(e820entries[i].type),
+				lowmem_limit) < 0)
+			goto err;
 
-	qsort(*range, *ranges, sizeof(struct memory_range), compare_ranges);
+	mem_regions_sort(&crash_memory_ranges);
 
 	for (i = 0; i < crash_reserved_mem_nr; i++)
-		if (exclude_region(ranges, crash_reserved_mem[i].start,
+		if (exclude_region(crash_reserved_mem[i].start,
 						crash_reserved_mem[i].end) < 0)
 			goto err;
 
+	*range = crash_memory_ranges.ranges;
+	*ranges = crash_memory_ranges.size;
+
 	ret = 0;
 
 err:
+	free(e820entries);
 	xc_interface_close(xc);
 
 	return ret;
@@ -401,197 +423,87 @@ static int get_crash_memory_ranges_xen(struct memory_range **range,
 }
 #endif /* HAVE_LIBXENCTRL */
 
-static void segregate_lowmem_region(int *nr_ranges, unsigned long lowmem_limit)
+/* Adds a range to crash_memory_ranges, split in two if it straddles
+ * lowmem_limit. */
+static int add_crash_memory_range(unsigned long long start,
+				  unsigned long long end, int type,
+				  unsigned long lowmem_limit)
 {
-	unsigned long long end, start;
-	unsigned type;
-
-	start = crash_memory_range[*nr_ranges].start;
-	end = crash_memory_range[*nr_ranges].end;
-	type = crash_memory_range[*nr_ranges].type;
-
-	if (!(lowmem_limit && lowmem_limit > start && lowmem_limit < end))
-		return;
-
-	crash_memory_range[*nr_ranges].end = lowmem_limit - 1;
-
-	if (*nr_ranges >= CRASH_MAX_MEMORY_RANGES - 1)
-		return;
-
-	++*nr_ranges;
+	if (lowmem_limit && lowmem_limit > start && lowmem_limit < end) {
+		if (mem_regions_alloc_and_add(&crash_memory_ranges, start,
+					      lowmem_limit - start, type) < 0)
+			goto nomem;
+		start = lowmem_limit;
+	}
+	if (mem_regions_alloc_and_add(&crash_memory_ranges, start,
+				      end - start + 1, type) < 0)
+		goto nomem;
+	return 0;
 
-	crash_memory_range[*nr_ranges].start = lowmem_limit;
-	crash_memory_range[*nr_ranges].end = end;
-	crash_memory_range[*nr_ranges].type = type;
+nomem:
+	fprintf(stderr, "Cannot allocate memory for crash memory ranges\n");
+	return -1;
 }
 
 /* Removes crash reserve region from list of memory chunks for whom elf program
- * headers have to be created. Assuming crash reserve region to be a single
- * continuous area fully contained inside one of the memory chunks */
-static int exclude_region(int *nr_ranges, uint64_t start, uint64_t end)
+ * headers have to be created. The region may cover, or cut into, any number
+ * of the chunks. */
+static int exclude_region(uint64_t start, uint64_t end)
 {
-	int i, j, tidx = -1;
-	struct memory_range temp_region = {0, 0, 0};
-
-
-	for (i = 0; i < (*nr_ranges); i++) {
-		unsigned long long mstart, mend;
-		mstart = crash_memory_range[i].start;
-		mend = crash_memory_range[i].end;
-		if (start < mend && end > mstart) {
-			if (start != mstart && end != mend) {
-				/* Split memory region */
-				crash_memory_range[i].end = start - 1;
-				temp_region.start = end + 1;
-				temp_region.end = mend;
-				temp_region.type = RANGE_RAM;
-				tidx = i+1;
-			} else if (start != mstart)
-				crash_memory_range[i].end = start - 1;
-			else
-				crash_memory_range[i].start = end + 1;
-		}
-	}
-	/* Insert split memory region, if any. */
-	if (tidx >= 0) {
-		if (*nr_ranges == CRASH_MAX_MEMORY_RANGES) {
-			/* No space to insert another element. */
-			fprintf(stderr, "Error: Number of crash memory ranges"
-					" excedeed the max limit\n");
-			return -1;
-		}
-		for (j = (*nr_ranges - 1); j >= tidx; j--)
-			crash_memory_range[j+1] = crash_memory_range[j];
-		crash_memory_range[tidx] = temp_region;
-		(*nr_ranges)++;
+	struct memory_range range = { start, end, RANGE_RAM };
+
+	if (mem_regions_alloc_and_exclude(&crash_memory_ranges, &range) < 0) {
+		fprintf(stderr, "Cannot allocate memory for crash memory ranges\n");
+		return -1;
 	}
 	return 0;
 }
 
 /* Adds a segment from list of memory regions which new kernel can use to
  * boot. Segment start and end should be aligned to 1K boundary. */
-static int add_memmap(struct memory_range *memmap_p, int *nr_memmap,
+static int add_memmap(struct memory_ranges *memmap,
 			unsigned long long addr, size_t size, int type)
 {
-	int i, j, nr_entries = 0, tidx = 0, align = 1024;
-	unsigned long long mstart, mend;
+	int align = 1024;
 
 	/* Do alignment check if it's RANGE_RAM */
 	if ((type == RANGE_RAM) && ((addr%align) || (size%align)))
 		return -1;
 
-	/* Make sure at least one entry in list is free. */
-	for (i = 0; i < CRASH_MAX_MEMMAP_NR;  i++) {
-		mstart = memmap_p[i].start;
-		mend = memmap_p[i].end;
-		if (!mstart  && !mend)
-			break;
-		else
-			nr_entries++;
-	}
-	if (nr_entries == CRASH_MAX_MEMMAP_NR)
+	/* Fails on an overlapping region too */
+	if (mem_regions_alloc_and_insert(memmap, addr, size, type) < 0)
 		return -1;
 
-	for (i = 0; i < CRASH_MAX_MEMMAP_NR;  i++) {
-		mstart = memmap_p[i].start;
-		mend = memmap_p[i].end;
-		if (mstart == 0 && mend == 0)
-			break;
-		if (mstart <= (addr+size-1) && mend >=addr)
-			/* Overlapping region. */
-			return -1;
-		else if (addr > mend)
-			tidx = i+1;
-	}
-	/* Insert the memory region. */
-	for (j = nr_entries-1; j >= tidx; j--)
-		memmap_p[j+1] = memmap_p[j];
-	memmap_p[tidx].start = addr;
-	memmap_p[tidx].end = addr + size - 1;
-	memmap_p[tidx].type = type;
-	*nr_memmap = nr_entries + 1;
-
-	dbgprint_mem_range("Memmap after adding segment", memmap_p, *nr_memmap);
+	dbgprint_mem_range("Memmap after adding segment", memmap->ranges,
+			   memmap->size);
 
 	return 0;
 }
 
 /* Removes a segment from list of memory regions which new kernel can use to
  * boot. Segment start and end should be aligned to 1K boundary. */
-static int delete_memmap(struct memory_range *memmap_p, int *nr_memmap,
+static int delete_memmap(struct memory_ranges *memmap,
 				unsigned long long addr, size_t size)
 {
-	int i, j, nr_entries = 0, tidx = -1, operation = 0, align = 1024;
-	unsigned long long mstart, mend;
-	struct memory_range temp_region;
+	struct memory_range range;
+	int align = 1024;
 
 	/* Do alignment check. */
 	if ((addr%align) || (size%align))
 		return -1;
 
-	/* Make sure at least one entry in list is free. */
-	for (i = 0; i < CRASH_MAX_MEMMAP_NR;  i++) {
-		mstart = memmap_p[i].start;
-		mend = memmap_p[i].end;
-		if (!mstart  && !mend)
-			break;
-		else
-			nr_entries++;
-	}
-	if (nr_entries == CRASH_MAX_MEMMAP_NR)
-		/* List if full */
+	/* The segment has to be inside one region of the list. */
+	if (!mem_regions_find(memmap, addr, size))
 		return -1;
 
-	for (i = 0; i < CRASH_MAX_MEMMAP_NR;  i++) {
-		mstart = memmap_p[i].start;
-		mend = memmap_p[i].end;
-		if (mstart == 0 && mend == 0)
-			/* Did not find the segment in the list. */
-			return -1;
-		if (mstart <= addr && mend >= (addr + size - 1)) {
-			if (mstart == addr && mend == (addr + size - 1)) {
-				/* Exact match. Delete region */
-				operation = -1;
-				tidx = i;
-				break;
-			}
-			if (mstart != addr && mend != (addr + size - 1)) {
-				/* Split in two */
-				memmap_p[i].end = addr - 1;
-				temp_region.start = addr + size;
-				temp_region.end = mend;
-				temp_region.type = memmap_p[i].type;
-				operation = 1;
-				tidx = i;
-				break;
-			}
-
-			/* No addition/deletion required. Adjust the existing.*/
-			if (mstart != addr) {
-				memmap_p[i].end = addr - 1;
-				break;
-			} else {
-				memmap_p[i].start = addr + size;
-				break;
-			}
-		}
-	}
-	if ((operation == 1) && tidx >=0) {
-		/* Insert the split memory region. */
-		for (j = nr_entries-1; j > tidx; j--)
-			memmap_p[j+1] = memmap_p[j];
-		memmap_p[tidx+1] = temp_region;
-		*nr_memmap = nr_entries + 1;
-	}
-	if ((operation == -1) && tidx >=0) {
-		/* Delete the exact match memory region. */
-		for (j = i+1; j < CRASH_MAX_MEMMAP_NR; j++)
-			memmap_p[j-1] = memmap_p[j];
-		memmap_p[j-1].start = memmap_p[j-1].end = 0;
-		*nr_memmap = nr_entries - 1;
-	}
+	range.start = addr;
+	range.end = addr + size - 1;
+	range.type = RANGE_RAM;
+	if (mem_regions_alloc_and_exclude(memmap, &range) < 0)
+		return -1;
 
-	dbgprint_mem_range("Memmap after deleting segment", memmap_p, *nr_memmap);
+	dbgprint_mem_range("Memmap after deleting segment", memmap->ranges,
+			   memmap->size);
 
 	return 0;
 }
@@ -646,9 +558,11 @@ static void cmdline_add_memmap_internal(char *cmdline, unsigned long startk,
 
 /* Adds the appropriate memmap= options to command line, indicating the
  * memory regions the new kernel can use to boot into. */
-static int cmdline_add_memmap(char *cmdline, struct memory_range *memmap_p)
+static int cmdline_add_memmap(char *cmdline, struct memory_ranges *memmap)
 {
-	int i, cmdlen, len;
+	struct memory_range *memmap_p = memmap->ranges;
+	unsigned int i;
+	int cmdlen, len;
 	unsigned long min_sizek = 100;
 	char str_mmap[256];
 
@@ -660,7 +574,7 @@ static int cmdline_add_memmap(char *cmdline, struct memory_range *memmap_p)
 		die("Command line overflow\n");
 	strcat(cmdline, str_mmap);
 
-	for (i = 0; i < CRASH_MAX_MEMMAP_NR;  i++) {
+	for (i = 0; i < memmap->size;  i++) {
 		unsigned long startk, endk, type;
 
 		startk = memmap_p[i].start/1024;
@@ -677,10 +591,6 @@ static int cmdline_add_memmap(char *cmdline, struct memory_range *memmap_p)
 		if (type == RANGE_ACPI || type == RANGE_ACPI_NVS)
 			endk = _ALIGN_UP(memmap_p[i].end + 1, 1024)/1024;
 
-		if (!startk && !endk)
-			/* All regions traversed. */
-			break;
-
 		/* A RAM region is not worth adding if region size < 100K.
 		 * It eats up precious command line length. */
 		if (type == RANGE_RAM && (endk - startk) < min_sizek)
@@ -854,8 +764,9 @@ int load_crashdump_segments(struct kexec_info *info, char* mod_cmdline,
 {
 	void *tmp;
 	unsigned long sz, bufsz, memsz, elfcorehdr;
-	int nr_ranges = 0, nr_memmap = 0, align = 1024, i;
-	struct memory_range *mem_range, *memmap_p;
+	int nr_ranges = 0, align = 1024, i;
+	struct memory_range *mem_range = NULL;
+	struct memory_ranges memmap = { 0, 0, NULL };
 	struct crash_elf_info elf_info;
 	unsigned kexec_arch;
 
@@ -924,13 +835,10 @@ int load_crashdump_segments(struct kexec_info *info, char* mod_cmdline,
 		return -1;
 
 	/* Memory regions which panic kernel can safely use to boot into */
-	sz = (sizeof(struct memory_range) * CRASH_MAX_MEMMAP_NR);
-	memmap_p = xmalloc(sz);
-	memset(memmap_p, 0, sz);
-	add_memmap(memmap_p, &nr_memmap, info->backup_src_start, info->backup_src_size, RANGE_RAM);
+	add_memmap(&memmap, info->backup_src_start, info->backup_src_size, RANGE_RAM);
 	for (i = 0; i < crash_reserved_mem_nr; i++) {
 		sz = crash_reserved_mem[i].end - crash_reserved_mem[i].start +1;
-		if (add_memmap(memmap_p, &nr_memmap, crash_reserved_mem[i].start, sz, RANGE_RAM) < 0)
+		if (add_memmap(&memmap, crash_reserved_mem[i].start, sz, RANGE_RAM) < 0)
 			return ENOCRASHKERNEL;
 	}
 
@@ -943,7 +851,7 @@ int load_crashdump_segments(struct kexec_info *info, char* mod_cmdline,
 						0, max_addr, -1);
 		dbgprintf("Created backup segment at 0x%lx\n",
 			  info->backup_start);
-		if (delete_memmap(memmap_p, &nr_memmap, info->backup_start, sz) < 0)
+		if (delete_memmap(&memmap, info->backup_start, sz) < 0)
 			return EFAILED;
 	}
 
@@ -979,7 +887,7 @@ int load_crashdump_segments(struct kexec_info *info, char* mod_cmdline,
 	elfcorehdr = add_buffer(info, tmp, bufsz, memsz, align, min_base,
 							max_addr, -1);
 	dbgprintf("Created elf header segment at 0x%lx\n", elfcorehdr);
-	if (delete_memmap(memmap_p, &nr_memmap, elfcorehdr, memsz) < 0)
+	if (delete_memmap(&memmap, elfcorehdr, memsz) < 0)
 		return -1;
 	if (!bzImage_support_efi_boot || arch_options.noefi ||
 	    !sysfs_efi_runtime_map_exist())
@@ -987,7 +895,7 @@ int load_crashdump_segments(struct kexec_info *info, char* mod_cmdline,
 	cmdline_add_elfcorehdr(mod_cmdline, elfcorehdr);
 
 	/* Inform second kernel about the presence of ACPI tables. */
-	for (i = 0; i < CRASH_MAX_MEMORY_RANGES; i++) {
+	for (i = 0; i < nr_ranges; i++) {
 		unsigned long start, end, size, type;
 		if ( !( mem_range[i].type == RANGE_ACPI
 			|| mem_range[i].type == RANGE_ACPI_NVS
@@ -999,16 +907,16 @@ int load_crashdump_segments(struct kexec_info *info, char* mod_cmdline,
 		end = mem_range[i].end;
 		type = mem_range[i].type;
 		size = end - start + 1;
-		add_memmap(memmap_p, &nr_memmap, start, size, type);
+		add_memmap(&memmap, start, size, type);
 	}
 
 	if (arch_options.pass_memmap_cmdline)
-		cmdline_add_memmap(mod_cmdline, memmap_p);
+		cmdline_add_memmap(mod_cmdline, &memmap);
 
 	/* Store 2nd kernel boot memory ranges for later reference in
 	 * x86-setup-linux.c: setup_linux_system_parameters() */
-	info->crash_range = memmap_p;
-	info->nr_crash_ranges = nr_memmap;
+	info->crash_range = memmap.ranges;
+	info->nr_crash_ranges = memmap.size;
 
 	return 0;
 }
@@ -38,6 +38,7 @@
 #include "../../kexec-syscall.h"
 #include "../../firmware_memmap.h"
 #include "../../crashdump.h"
+#include "../../mem_regions.h"
 #include "kexec-x86.h"
 
 #ifdef HAVE_LIBXENCTRL
@@ -50,7 +51,13 @@
 #define E820_PRAM         12
 #endif
 
+#ifdef HAVE_LIBXENCTRL
 static struct memory_range memory_range[MAX_MEMORY_RANGES];
+#endif
+
+/* /proc/iomem and the firmware memmap can have any number of ranges */
+static struct memory_ranges iomem_ranges;
+static struct memory_ranges firmware_ranges;
 
 /**
  * The old /proc/iomem parsing code.
@@ -63,64 +70,56 @@ static struct memory_range memory_range[MAX_MEMORY_RANGES];
  */
 static int get_memory_ranges_proc_iomem(struct memory_range **range, int *ranges)
 {
-	const char *iomem= proc_iomem();
-	int memory_ranges = 0;
-	char line[MAX_LINE];
-	FILE *fp;
-	fp = fopen(iomem, "r");
-	if (!fp) {
+	const struct iomem_resource *res;
+	int i, nr;
+
+	res = kexec_iomem_resources(&nr);
+	if (!res) {
 		fprintf(stderr, "Cannot open %s: %s\n",
-			iomem, strerror(errno));
+			proc_iomem(), strerror(errno));
 		return -1;
 	}
-	while(fgets(line, sizeof(line), fp) != 0) {
+	for (i = 0; i < nr; i++) {
 		unsigned long long start, end;
-		char *str;
+		const char *str;
 		int type;
-		int consumed;
-		int count;
-		if (memory_ranges >= MAX_MEMORY_RANGES)
-			break;
-		count = sscanf(line, "%llx-%llx : %n",
-			&start, &end, &consumed);
-		if (count != 2)
-			continue;
-		str = line + consumed;
+		start = res[i].start;
+		end = res[i].end;
+		str = res[i].name;
 
 		dbgprintf("%016Lx-%016Lx : %s", start, end, str);
 
-		if (memcmp(str, "System RAM\n", 11) == 0) {
+		if (strncmp(str, "System RAM\n", 11) == 0) {
 			type = RANGE_RAM;
 		}
-		else if (memcmp(str, "reserved\n", 9) == 0) {
+		else if (strncmp(str, "reserved\n", 9) == 0) {
 			type = RANGE_RESERVED;
 		}
-		else if (memcmp(str, "ACPI Tables\n", 12) == 0) {
+		else if (strncmp(str, "ACPI Tables\n", 12) == 0) {
 			type = RANGE_ACPI;
 		}
-		else if (memcmp(str, "ACPI Non-volatile Storage\n", 26) == 0) {
+		else if (strncmp(str, "ACPI Non-volatile Storage\n", 26) == 0) {
 			type = RANGE_ACPI_NVS;
 		}
-		else if (memcmp(str, "Persistent Memory (legacy)\n", 27) == 0) {
+		else if (strncmp(str, "Persistent Memory (legacy)\n", 27) == 0) {
 			type = RANGE_PRAM;
 		}
-		else if (memcmp(str, "Persistent Memory\n", 18) == 0) {
+		else if (strncmp(str, "Persistent Memory\n", 18) == 0) {
 			type = RANGE_PMEM;
 		}
 		else {
 			continue;
 		}
-		memory_range[memory_ranges].start = start;
-		memory_range[memory_ranges].end = end;
-		memory_range[memory_ranges].type = type;
+		if (mem_regions_alloc_and_add(&iomem_ranges, start,
+					      end - start + 1, type) < 0) {
+			fprintf(stderr, "Cannot allocate memory for memory ranges\n");
+			return -1;
+		}
 
 		dbgprintf("%016Lx-%016Lx : %x\n", start, end, type);
-
-		memory_ranges++;
 	}
-	fclose(fp);
-	*range = memory_range;
-	*ranges = memory_ranges;
+	*range = iomem_ranges.ranges;
+	*ranges = iomem_ranges.size;
 	return 0;
 }
 
@@ -137,17 +136,16 @@ static int get_memory_ranges_proc_iomem(struct memory_range **range, int *ranges
 static int get_memory_ranges_sysfs(struct memory_range **range, int *ranges)
 {
 	int ret;
-	size_t range_number = MAX_MEMORY_RANGES;
 
-	ret = get_firmware_memmap_ranges(memory_range, &range_number);
+	ret = get_firmware_memmap_ranges(&firmware_ranges);
 	if (ret != 0) {
 		fprintf(stderr, "Parsing the /sys/firmware memory map failed. "
 			"Falling back to /proc/iomem.\n");
 		return get_memory_ranges_proc_iomem(range, ranges);
 	}
 
-	*range = memory_range;
-	*ranges = range_number;
+	*range = firmware_ranges.ranges;
+	*ranges = firmware_ranges.size;
 
 	return 0;
 }
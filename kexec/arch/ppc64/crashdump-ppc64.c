@@ -127,41 +127,44 @@ static int get_dyn_reconf_crash_memory_ranges(void)
 {
 	uint64_t start, end;
 	uint64_t startrange, endrange;
-	char fname[128], buf[32];
-	FILE *file;
+	char fname[128], *buf, *lmb;
+	off_t size, nread;
 	unsigned int i;
-	int n;
 	uint32_t flags;
 
 	strcpy(fname, "/proc/device-tree/");
 	strcat(fname, "ibm,dynamic-reconfiguration-memory/ibm,dynamic-memory");
-	if ((file = fopen(fname, "r")) == NULL) {
-		perror(fname);
+	size = 4 + (off_t)num_of_lmbs * 24;
+	buf = slurp_file_len(fname, size, &nread);
+	if (!buf)
+		return -1;
+	if (nread < size) {
+		fprintf(stderr, "%s: short read, expected %u LMBs\n",
+			fname, num_of_lmbs);
+		free(buf);
 		return -1;
 	}
 
-	fseek(file, 4, SEEK_SET);
 	startrange = endrange = 0;
 	for (i = 0; i < num_of_lmbs; i++) {
-		if ((n = fread(buf, 1, 24, file)) < 0) {
-			perror(fname);
-			fclose(file);
-			return -1;
-		}
 		if (memory_ranges >= (max_memory_ranges + 1)) {
 			/* No space to insert another element. */
 				fprintf(stderr,
 				"Error: Number of crash memory ranges"
 				" excedeed the max limit\n");
+			free(buf);
 			return -1;
 		}
 
-		start = be64_to_cpu(((uint64_t *)buf)[DRCONF_ADDR]);
+		lmb = buf + 4 + (size_t)i * 24;
+		memcpy(&start, lmb + DRCONF_ADDR, sizeof(start));
+		start = be64_to_cpu(start);
 		end = start + lmb_size;
 		if (start == 0 && end >= (BACKUP_SRC_END + 1))
 			start = BACKUP_SRC_END + 1;
 
-		flags = be32_to_cpu((*((uint32_t *)&buf[DRCONF_FLAGS])));
+		memcpy(&flags, lmb + DRCONF_FLAGS, sizeof(flags));
+		flags = be32_to_cpu(flags);
 		/* skip this block if the reserved bit is set in flags (0x80)
 		   or if the block is not assigned to this partition (0x8) */
 		if ((flags & 0x80) || !(flags & 0x8))
@@ -177,7 +180,7 @@ static int get_dyn_reconf_crash_memory_ranges(void)
 	if (startrange != endrange)
 		exclude_crash_region(startrange, endrange);
 
-	fclose(file);
+	free(buf);
 	return 0;
 }
 
@@ -3,7 +3,8 @@
 
 #define OPT_ELF64_CORE		(OPT_MAX+0)
 #define OPT_DT_NO_OLD_ROOT	(OPT_MAX+1)
-#define OPT_ARCH_MAX		(OPT_MAX+2)
+#define OPT_DT_SNAPSHOT		(OPT_MAX+2)
+#define OPT_ARCH_MAX		(OPT_MAX+3)
 
 /* All 'local' loader options: */
 #define OPT_APPEND		(OPT_ARCH_MAX+0)
@@ -16,6 +17,7 @@
 	KEXEC_OPTIONS \
 	{ "elf64-core-headers", 0, 0, OPT_ELF64_CORE }, \
 	{ "dt-no-old-root",	0, 0, OPT_DT_NO_OLD_ROOT }, \
+	{ "dt-snapshot",	0, 0, OPT_DT_SNAPSHOT }, \
 
 #define KEXEC_ARCH_OPT_STR KEXEC_OPT_STR ""
 
@@ -895,6 +895,8 @@ void arch_usage(void)
 	fprintf(stderr, "     --elf64-core-headers Prepare core headers in ELF64 format\n");
 	fprintf(stderr, "     --dt-no-old-root Do not reuse old kernel root= param.\n" \
 	                "                      while creating flatten device tree.\n");
+	fprintf(stderr, "     --dt-snapshot Build the device tree from /sys/firmware/fdt.\n" \
+	                "                   Faster, but misses changes made since boot.\n");
 }
 
 struct arch_options_t arch_options = {
@@ -924,6 +926,9 @@ int arch_process_options(int argc, char **argv)
 		case OPT_DT_NO_OLD_ROOT:
 			dt_no_old_root = 1;
 			break;
+		case OPT_DT_SNAPSHOT:
+			dt_snapshot = 1;
+			break;
 		}
 	}
 	/* Reset getopt for the next pass; called in other source modules */
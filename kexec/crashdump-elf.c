@@ -1,6 +1,6 @@
 
-#if !defined(FUNC) || !defined(EHDR) || !defined(PHDR)
-#error FUNC, EHDR and PHDR must be defined
+#if !defined(FUNC) || !defined(EHDR) || !defined(PHDR) || !defined(SHDR)
+#error FUNC, EHDR, PHDR and SHDR must be defined
 #endif
 
 #if (ELF_WIDTH == 64)
@@ -33,20 +33,33 @@ int FUNC(struct kexec_info *info,
 {
 	EHDR *elf;
 	PHDR *phdr;
+	SHDR *shdr = NULL;
 	int i;
-	unsigned long sz;
+	unsigned long sz, max_phnum, phnum = 0;
+	unsigned long long pstart = 0, pend = 0;
 	char *bufp;
 	long int nr_cpus = 0;
 	uint64_t notes_addr, notes_len;
 	uint64_t vmcoreinfo_addr, vmcoreinfo_len;
 	int has_vmcoreinfo = 0;
 	int (*get_note_info)(int cpu, uint64_t *addr, uint64_t *len);
-	long int count_cpu;
+	int nr_notes;
+
+	/* Default way to get crash notes is by get_crash_notes_per_cpu() */
+
+	get_note_info = elf_info->get_note_info;
+	if (!get_note_info)
+		get_note_info = get_crash_notes_per_cpu;
 
 	if (xen_present())
-		nr_cpus = xen_get_nr_phys_cpus();
+		get_note_info = xen_get_note;
+
+	if (xen_present())
+		nr_cpus = nr_notes = xen_get_nr_phys_cpus();
+	else if (get_note_info == get_crash_notes_per_cpu)
+		nr_cpus = get_crash_notes_cpus(&nr_notes);
 	else
-		nr_cpus = sysconf(_SC_NPROCESSORS_CONF);
+		nr_cpus = nr_notes = sysconf(_SC_NPROCESSORS_CONF);
 
 	if (nr_cpus < 0) {
 		return -1;
@@ -59,8 +72,8 @@ int FUNC(struct kexec_info *info,
 		if (!get_kernel_vmcoreinfo(&vmcoreinfo_addr, &vmcoreinfo_len))
 			has_vmcoreinfo = 1;
 
-	sz = sizeof(EHDR) + (nr_cpus + has_vmcoreinfo) * sizeof(PHDR) +
-	     ranges * sizeof(PHDR);
+	max_phnum = nr_notes + has_vmcoreinfo +
+		crash_ram_headers(info, elf_info, range, ranges);
 
 	/*
 	 * Certain architectures such as x86_64 and ia64 require a separate
@@ -83,9 +96,18 @@ int FUNC(struct kexec_info *info,
 	 */
 
 	if (elf_info->kern_size && !xen_present()) {
-		sz += sizeof(PHDR);
+		max_phnum++;
 	}
 
+	/*
+	 * e_phnum is only 16 bits.  Past that the real count goes in the
+	 * sh_info of a section header 0 after the program headers, as for
+	 * the kernel's own core dumps.
+	 */
+	sz = sizeof(EHDR) + max_phnum * sizeof(PHDR);
+	if (max_phnum >= PN_XNUM)
+		sz += sizeof(SHDR);
+
 	/*
 	 * Make sure the ELF core header is aligned to at least 1024.
 	 * We do this because the secondary kernel gets the ELF core
@@ -104,6 +126,8 @@ int FUNC(struct kexec_info *info,
 
 	*buf = bufp;
 	*size = sz;
+	if (max_phnum >= PN_XNUM)
+		shdr = (SHDR *)(bufp + sizeof(EHDR) + max_phnum * sizeof(PHDR));
 
 	/* Setup ELF Header*/
 	elf = (EHDR *) bufp;
@@ -128,25 +152,17 @@ int FUNC(struct kexec_info *info,
 	elf->e_shnum    = 0;
 	elf->e_shstrndx = 0;
 
-	/* Default way to get crash notes is by get_crash_notes_per_cpu() */
-
-	get_note_info = elf_info->get_note_info;
-	if (!get_note_info)
-		get_note_info = get_crash_notes_per_cpu;
-
-	if (xen_present())
-		get_note_info = xen_get_note;
-
 	/* PT_NOTE program headers. One per cpu */
 
-	count_cpu = nr_cpus;
-	for (i = 0; count_cpu > 0; i++) {
+	for (i = 0; i < nr_cpus; i++) {
 		int ret;
 
 		ret = get_note_info(i, &notes_addr, &notes_len);
-		count_cpu--;
 		if (ret < 0) /* This cpu is not present. Skip it. */
 			continue;
+		/* No more than there is room for */
+		if (nr_notes-- == 0)
+			break;
 
 		phdr = (PHDR *) bufp;
 		bufp += sizeof(PHDR);
@@ -159,7 +175,7 @@ int FUNC(struct kexec_info *info,
 		phdr->p_align	= 0;
 
 		/* Increment number of program headers. */
-		(elf->e_phnum)++;
+		phnum++;
 		dbgprintf_phdr("Elf header", phdr);
 	}
 
@@ -174,7 +190,7 @@ int FUNC(struct kexec_info *info,
 		/* Do we need any alignment of segments? */
 		phdr->p_align	= 0;
 
-		(elf->e_phnum)++;
+		phnum++;
 		dbgprintf_phdr("vmcoreinfo header", phdr);
 	}
 
@@ -191,12 +207,14 @@ int FUNC(struct kexec_info *info,
 		phdr->p_vaddr	= elf_info->kern_vaddr_start;
 		phdr->p_filesz	= phdr->p_memsz	= elf_info->kern_size;
 		phdr->p_align	= 0;
-		(elf->e_phnum)++;
+		phnum++;
 		dbgprintf_phdr("Kernel text Elf header", phdr);
 	}
 
-	/* Setup PT_LOAD type program header for every system RAM chunk.
+	/* Setup PT_LOAD type program header for every system RAM chunk,
+	 * or run of contiguous chunks.
 	 * A seprate program header for Backup Region*/
+	phdr = NULL;
 	for (i = 0; i < ranges; i++, range++) {
 		unsigned long long mstart, mend;
 		if (range->type != RANGE_RAM)
@@ -205,14 +223,23 @@ int FUNC(struct kexec_info *info,
 		mend = range->end;
 		if (!mstart && !mend)
 			continue;
+		if (phdr && crash_ram_continues(info, elf_info, pstart, pend,
+						mstart, mend)) {
+			pend = mend;
+			phdr->p_filesz = phdr->p_memsz = pend - pstart + 1;
+			continue;
+		}
+		if (phdr)
+			dbgprintf_phdr("Elf header", phdr);
+		pstart = mstart;
+		pend = mend;
 		phdr = (PHDR *) bufp;
 		bufp += sizeof(PHDR);
 		phdr->p_type	= PT_LOAD;
 		phdr->p_flags	= PF_R|PF_W|PF_X;
 		phdr->p_offset	= mstart;
 
-		if (mstart == info->backup_src_start
-		    && (mend - mstart + 1) == info->backup_src_size)
+		if (is_backup_range(info, mstart, mend))
 			phdr->p_offset	= info->backup_start;
 
 		/* We already prepared the header for kernel text. Map
@@ -232,8 +259,20 @@ int FUNC(struct kexec_info *info,
 			phdr->p_vaddr = -1;
 
 		/* Increment number of program headers. */
-		(elf->e_phnum)++;
+		phnum++;
+	}
+	if (phdr)
 		dbgprintf_phdr("Elf header", phdr);
+
+	if (phnum >= PN_XNUM) {
+		elf->e_phnum = PN_XNUM;
+		elf->e_shoff = (char *)shdr - (char *)elf;
+		elf->e_shentsize = sizeof(SHDR);
+		elf->e_shnum = 1;
+		shdr->sh_type = SHT_NULL;
+		shdr->sh_info = phnum;
+	} else {
+		elf->e_phnum = phnum;
 	}
 	return 0;
 }
@@ -19,26 +19,92 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <errno.h>
 #include <limits.h>
 #include <linux/limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
 #include <elf.h>
 #include "kexec.h"
 #include "crashdump.h"
 #include "kexec-syscall.h"
 
+static int is_backup_range(struct kexec_info *info,
+			   unsigned long long start, unsigned long long end)
+{
+	return start == info->backup_src_start &&
+		end - start + 1 == info->backup_src_size;
+}
+
+/*
+ * Whether the RAM range [start, end] can be covered by the same PT_LOAD
+ * as the range [pstart, pend] before it: the two have to be contiguous
+ * both physically and in the kernel's linear mapping.
+ */
+static int crash_ram_continues(struct kexec_info *info,
+			       struct crash_elf_info *elf_info,
+			       unsigned long long pstart,
+			       unsigned long long pend,
+			       unsigned long long start,
+			       unsigned long long end)
+{
+	if (start != pend + 1)
+		return 0;
+	if (is_backup_range(info, pstart, pend) ||
+	    is_backup_range(info, start, end))
+		return 0;
+	/* HIGHMEM has no virtual address, so never mix it with lowmem */
+	if (elf_info->lowmem_limit) {
+		if ((pend > elf_info->lowmem_limit - 1) !=
+		    (end > elf_info->lowmem_limit - 1))
+			return 0;
+		if (pend > elf_info->lowmem_limit - 1)
+			return 1;
+	}
+	return phys_to_virt(elf_info, start) ==
+		phys_to_virt(elf_info, pstart) + (start - pstart);
+}
+
+/* How many PT_LOAD headers the RAM in range needs */
+static int crash_ram_headers(struct kexec_info *info,
+			     struct crash_elf_info *elf_info,
+			     struct memory_range *range, int ranges)
+{
+	unsigned long long pstart = 0, pend = 0;
+	int i, count = 0;
+
+	for (i = 0; i < ranges; i++, range++) {
+		if (range->type != RANGE_RAM)
+			continue;
+		if (!range->start && !range->end)
+			continue;
+		if (!count || !crash_ram_continues(info, elf_info, pstart,
+						   pend, range->start,
+						   range->end)) {
+			count++;
+			pstart = range->start;
+		}
+		pend = range->end;
+	}
+	return count;
+}
+
 /* include "crashdump-elf.c" twice to create two functions from one */
 
 #define ELF_WIDTH 64
 #define FUNC crash_create_elf64_headers
 #define EHDR Elf64_Ehdr
 #define PHDR Elf64_Phdr
+#define SHDR Elf64_Shdr
 #include "crashdump-elf.c"
 #undef ELF_WIDTH
+#undef SHDR
 #undef PHDR
 #undef EHDR
 #undef FUNC
@@ -47,8 +113,10 @@
 #define FUNC crash_create_elf32_headers
 #define EHDR Elf32_Ehdr
 #define PHDR Elf32_Phdr
+#define SHDR Elf32_Shdr
 #include "crashdump-elf.c"
 #undef ELF_WIDTH
+#undef SHDR
 #undef PHDR
 #undef EHDR
 #undef FUNC
@@ -61,64 +129,128 @@ unsigned long crash_architecture(struct crash_elf_info *elf_info)
 		return elf_info->machine;
 }
 
-/* Returns the physical address of start of crash notes buffer for a cpu. */
-int get_crash_notes_per_cpu(int cpu, uint64_t *addr, uint64_t *len)
+/*
+ * The crash notes of every cpu, read in one pass over the cpu directory
+ * of sysfs the first time they are asked for.
+ */
+static struct {
+	int read;
+	int nr_cpus;		/* one more than the highest cpu number */
+	int nr_notes;		/* cpus that have notes */
+	uint64_t *addr;		/* 0 where a cpu has no notes */
+	uint64_t len;		/* the same for every cpu */
+} crash_notes;
+
+#define CPU_SYSFS	"/sys/devices/system/cpu"
+
+/* Read a sysfs attribute relative to dir_fd, -1 if it does not exist */
+static int read_attr(int dir_fd, const char *name, char *buf, size_t size)
 {
-	char crash_notes[PATH_MAX];
-	char crash_notes_size[PATH_MAX];
-	char line[MAX_LINE];
-	FILE *fp;
-	struct stat cpu_stat;
-	int count;
+	ssize_t len;
+	int fd;
+
+	fd = openat(dir_fd, name, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			die("Could not open \"%s/%s\": %s\n", CPU_SYSFS, name,
+			    strerror(errno));
+		return -1;
+	}
+	len = read(fd, buf, size - 1);
+	if (len < 0)
+		die("Cannot read %s/%s: %s\n", CPU_SYSFS, name,
+		    strerror(errno));
+	buf[len] = '\0';
+	close(fd);
+	return 0;
+}
+
+static void read_crash_notes(void)
+{
+	struct dirent *dent;
+	char name[sizeof(dent->d_name) + sizeof("/crash_notes_size")];
+	char line[MAX_LINE], *end;
 	unsigned long long temp;
-	int fopen_errno;
-	int stat_errno;
+	DIR *dir;
+	int cpu, fd, size_read = 0;
+
+	crash_notes.read = 1;
+	crash_notes.len = MAX_NOTE_BYTES;
+	dir = opendir(CPU_SYSFS);
+	if (!dir) {
+		if (errno != ENOENT)
+			die("Could not open \"%s\": %s\n", CPU_SYSFS,
+			    strerror(errno));
+		if (access("/sys/devices", F_OK) != 0)
+			die("\"/sys/devices\" does not exist. "
+			    "Sysfs does not seem to be mounted. "
+			    "Try mounting sysfs.\n");
+		return;
+	}
+	fd = dirfd(dir);
+	while ((dent = readdir(dir))) {
+		if (strncmp(dent->d_name, "cpu", 3) != 0 ||
+		    !isdigit((unsigned char)dent->d_name[3]))
+			continue;
+		cpu = strtol(dent->d_name + 3, &end, 10);
+		if (*end)
+			continue;
+		snprintf(name, sizeof(name), "%s/crash_notes", dent->d_name);
+		if (read_attr(fd, name, line, sizeof(line)) < 0)
+			continue;
+		if (sscanf(line, "%llx", &temp) != 1)
+			die("Cannot parse %s/%s\n", CPU_SYSFS, name);
+		if (cpu >= crash_notes.nr_cpus) {
+			crash_notes.addr = xrealloc(crash_notes.addr,
+					(cpu + 1) * sizeof(*crash_notes.addr));
+			memset(crash_notes.addr + crash_notes.nr_cpus, 0,
+			       (cpu + 1 - crash_notes.nr_cpus) *
+			       sizeof(*crash_notes.addr));
+			crash_notes.nr_cpus = cpu + 1;
+		}
+		crash_notes.addr[cpu] = temp;
+		crash_notes.nr_notes++;
+
+		/* The kernel gives every cpu a note buffer of the same size */
+		if (size_read)
+			continue;
+		size_read = 1;
+		snprintf(name, sizeof(name), "%s/crash_notes_size",
+			 dent->d_name);
+		if (read_attr(fd, name, line, sizeof(line)) < 0)
+			continue;
+		if (sscanf(line, "%llu", &temp) != 1)
+			die("Cannot parse %s/%s\n", CPU_SYSFS, name);
+		crash_notes.len = temp;
+	}
+	closedir(dir);
+}
+
+/*
+ * How many cpus get_crash_notes_per_cpu() needs to be asked about, and in
+ * nr_notes how many of them have notes.
+ */
+int get_crash_notes_cpus(int *nr_notes)
+{
+	if (!crash_notes.read)
+		read_crash_notes();
+	*nr_notes = crash_notes.nr_notes;
+	return crash_notes.nr_cpus;
+}
 
+/* Returns the physical address of start of crash notes buffer for a cpu. */
+int get_crash_notes_per_cpu(int cpu, uint64_t *addr, uint64_t *len)
+{
 	*addr = 0;
 	*len = 0;
 
-	sprintf(crash_notes, "/sys/devices/system/cpu/cpu%d/crash_notes", cpu);
-	fp = fopen(crash_notes, "r");
-	if (!fp) {
-		fopen_errno = errno;
-		if (fopen_errno != ENOENT)
-			die("Could not open \"%s\": %s\n", crash_notes,
-			    strerror(fopen_errno));
-		if (stat("/sys/devices", &cpu_stat)) {
-			stat_errno = errno;
-			if (stat_errno == ENOENT)
-				die("\"/sys/devices\" does not exist. "
-				    "Sysfs does not seem to be mounted. "
-				    "Try mounting sysfs.\n");
-			die("Could not open \"/sys/devices\": %s\n",
-			    strerror(stat_errno));
-		}
-		/* CPU is not physically present.*/
+	if (!crash_notes.read)
+		read_crash_notes();
+	/* CPU is not physically present.*/
+	if (cpu < 0 || cpu >= crash_notes.nr_cpus || !crash_notes.addr[cpu])
 		return -1;
-	}
-	if (!fgets(line, sizeof(line), fp))
-		die("Cannot parse %s: %s\n", crash_notes, strerror(errno));
-	count = sscanf(line, "%llx", &temp);
-	if (count != 1)
-		die("Cannot parse %s: %s\n", crash_notes, strerror(errno));
-	*addr = (uint64_t) temp;
-	fclose(fp);
-
-	*len = MAX_NOTE_BYTES;
-	sprintf(crash_notes_size,
-		"/sys/devices/system/cpu/cpu%d/crash_notes_size", cpu);
-	fp = fopen(crash_notes_size, "r");
-	if (fp) {
-		if (!fgets(line, sizeof(line), fp))
-			die("Cannot parse %s: %s\n",
-			    crash_notes_size, strerror(errno));
-		count = sscanf(line, "%llu", &temp);
-		if (count != 1)
-			die("Cannot parse %s: %s\n",
-			    crash_notes_size, strerror(errno));
-		*len = (uint64_t) temp;
-		fclose(fp);
-	}
+	*addr = crash_notes.addr[cpu];
+	*len = crash_notes.len;
 
 	dbgprintf("%s: crash_notes addr = %llx, size = %llu\n", __FUNCTION__,
 		  (unsigned long long)*addr, (unsigned long long)*len);
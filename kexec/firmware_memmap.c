@@ -17,7 +17,7 @@
  * along with this program; if not, write to the Free Software
  * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
-#define _GNU_SOURCE /* for ULLONG_MAX without C99 */
+#define _GNU_SOURCE /* for O_DIRECTORY */
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -25,23 +25,13 @@
 #include <unistd.h>
 #include <limits.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
 #include "firmware_memmap.h"
 #include "kexec.h"
-
-/*
- * If the system is too old for ULLONG_MAX or LLONG_MAX, define it here.
- */
-#ifndef ULLONG_MAX
-#    define ULLONG_MAX (~0ULL)
-#endif /* ULLONG_MAX */
-
-#ifndef LLONG_MAX
-#    define LLONG_MAX (~0ULL >> 1)
-#endif /* LLONG_MAX */
-
+#include "mem_regions.h"
 
 /**
  * The full path to the sysfs interface that provides the memory map.
@@ -49,141 +39,130 @@
 #define FIRMWARE_MEMMAP_DIR  "/sys/firmware/memmap"
 
 /**
- * Parses a file that only contains one number. Typical for sysfs files.
+ * Reads a one-line sysfs attribute of a memmap entry into a buffer the
+ * caller reuses for every attribute, without the trailing newline(s).
  *
- * @param[in] filename the name of the file that should be parsed
- * @return the value that has been read or ULLONG_MAX on error.
+ * @param[in] entry_fd open directory of the entry
+ * @param[in] entry name of the entry, for error messages
+ * @param[in] name name of the attribute
+ * @param[out] buf buffer to read into
+ * @param[in] size size of @p buf
+ * @return 0 on success, -1 on failure.
  */
-static unsigned long long parse_numeric_sysfs(const char *filename)
+static int read_memmap_attr(int entry_fd, const char *entry, const char *name,
+			    char *buf, size_t size)
 {
-	FILE *fp;
-	char linebuffer[BUFSIZ];
-	unsigned long long retval = ULLONG_MAX;
+	ssize_t len;
+	int fd;
 
-	fp = fopen(filename, "r");
-	if (!fp) {
-		fprintf(stderr, "Opening \"%s\" failed: %s\n",
-			filename, strerror(errno));
-		return ULLONG_MAX;
+	fd = openat(entry_fd, name, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Opening \"%s/%s/%s\" failed: %s\n",
+			FIRMWARE_MEMMAP_DIR, entry, name, strerror(errno));
+		return -1;
+	}
+	len = pread(fd, buf, size - 1, 0);
+	close(fd);
+	if (len < 0) {
+		fprintf(stderr, "Reading \"%s/%s/%s\" failed: %s\n",
+			FIRMWARE_MEMMAP_DIR, entry, name, strerror(errno));
+		return -1;
 	}
 
-	if (!fgets(linebuffer, BUFSIZ, fp))
-		goto err;
-
-	linebuffer[BUFSIZ-1] = 0;
-
-	/* let strtoll() detect the base */
-	retval = strtoll(linebuffer, NULL, 0);
-
-err:
-	fclose(fp);
+	/* truncate trailing newline(s) */
+	while (len > 0 && buf[len - 1] == '\n')
+		len--;
+	buf[len] = 0;
 
-	return retval;
+	return 0;
 }
 
 /**
- * Reads the contents of a one-line sysfs file to buffer. (This function is
- * not threadsafe.)
- *
- * @param[in] filename the name of the file that should be read
+ * Parses a sysfs attribute that only contains one number.
  *
- * @return NULL on failure, a pointer to a static buffer (that should be copied
- *         with strdup() if the caller plans to use it after next function call)
+ * @return 0 on success, -1 on failure.
  */
-static char *parse_string_sysfs(const char *filename)
+static int read_memmap_number(int entry_fd, const char *entry,
+			      const char *name, char *buf, size_t size,
+			      unsigned long long *value)
 {
-	FILE *fp;
-	static char linebuffer[BUFSIZ];
 	char *end;
 
-	fp = fopen(filename, "r");
-	if (!fp) {
-		fprintf(stderr, "Opening \"%s\" failed: %s\n",
-			filename, strerror(errno));
-		return NULL;
-	}
+	if (read_memmap_attr(entry_fd, entry, name, buf, size) < 0)
+		return -1;
 
-	if (!fgets(linebuffer, BUFSIZ, fp)) {
-		fclose(fp);
-		return NULL;
+	/* let strtoull() detect the base */
+	errno = 0;
+	*value = strtoull(buf, &end, 0);
+	if (errno || end == buf || *end) {
+		fprintf(stderr, "Bad number \"%s\" in \"%s/%s/%s\"\n",
+			buf, FIRMWARE_MEMMAP_DIR, entry, name);
+		return -1;
 	}
 
-	linebuffer[BUFSIZ-1] = 0;
-
-	/* truncate trailing newline(s) */
-	end = linebuffer + strlen(linebuffer) - 1;
-	while (*end == '\n')
-		*end-- = 0;
-
-	fclose(fp);
-
-	return linebuffer;
-
+	return 0;
 }
 
-static int parse_memmap_entry(const char *entry, struct memory_range *range)
+static int memmap_type(const char *type, const char *entry)
 {
-	char filename[PATH_MAX];
-	char *type;
-
-	/*
-	 * entry/start
-	 */
-	snprintf(filename, PATH_MAX, "%s/%s", entry, "start");
-	filename[PATH_MAX-1] = 0;
-
-	range->start = parse_numeric_sysfs(filename);
-	if (range->start == ULLONG_MAX)
-		return -1;
-
-	/*
-	 * entry/end
-	 */
-	snprintf(filename, PATH_MAX, "%s/%s", entry, "end");
-	filename[PATH_MAX-1] = 0;
-
-	range->end = parse_numeric_sysfs(filename);
-	if (range->end == ULLONG_MAX)
-		return -1;
-
-	/*
-	 * entry/type
-	 */
-	snprintf(filename, PATH_MAX, "%s/%s", entry, "type");
-	filename[PATH_MAX-1] = 0;
-
-	type = parse_string_sysfs(filename);
-	if (!type)
-		return -1;
-
 	if (strcmp(type, "System RAM") == 0)
-		range->type = RANGE_RAM;
+		return RANGE_RAM;
 	else if (strcmp(type, "ACPI Tables") == 0)
-		range->type = RANGE_ACPI;
+		return RANGE_ACPI;
 	else if (strcmp(type, "Unusable memory") == 0)
-		range->type = RANGE_RESERVED;
+		return RANGE_RESERVED;
 	else if (strcmp(type, "reserved") == 0)
-		range->type = RANGE_RESERVED;
+		return RANGE_RESERVED;
 	else if (strcmp(type, "Reserved") == 0)
-		range->type = RANGE_RESERVED;
+		return RANGE_RESERVED;
 	else if (strcmp(type, "Unknown E820 type") == 0)
-		range->type = RANGE_RESERVED;
+		return RANGE_RESERVED;
 	else if (strcmp(type, "ACPI Non-volatile Storage") == 0)
-		range->type = RANGE_ACPI_NVS;
+		return RANGE_ACPI_NVS;
 	else if (strcmp(type, "Uncached RAM") == 0)
-		range->type = RANGE_UNCACHED;
+		return RANGE_UNCACHED;
 	else if (strcmp(type, "Persistent Memory (legacy)") == 0)
-		range->type = RANGE_PRAM;
+		return RANGE_PRAM;
 	else if (strcmp(type, "Persistent Memory") == 0)
-		range->type = RANGE_PMEM;
-	else {
-		fprintf(stderr, "Unknown type (%s) while parsing %s. Please "
-			"report this as bug. Using RANGE_RESERVED now.\n",
-			type, filename);
-		range->type = RANGE_RESERVED;
+		return RANGE_PMEM;
+
+	fprintf(stderr, "Unknown type (%s) while parsing %s/%s/type. Please "
+		"report this as bug. Using RANGE_RESERVED now.\n",
+		type, FIRMWARE_MEMMAP_DIR, entry);
+	return RANGE_RESERVED;
+}
+
+static int parse_memmap_entry(int dir_fd, const char *entry,
+			      char *buf, size_t size,
+			      struct memory_ranges *ranges)
+{
+	unsigned long long start, end;
+	int entry_fd, type, ret = -1;
+
+	entry_fd = openat(dir_fd, entry, O_RDONLY | O_DIRECTORY);
+	if (entry_fd < 0) {
+		fprintf(stderr, "Opening \"%s/%s\" failed: %s\n",
+			FIRMWARE_MEMMAP_DIR, entry, strerror(errno));
+		return -1;
 	}
 
-	return 0;
+	if (read_memmap_number(entry_fd, entry, "start", buf, size, &start) < 0)
+		goto out;
+	if (read_memmap_number(entry_fd, entry, "end", buf, size, &end) < 0)
+		goto out;
+	if (read_memmap_attr(entry_fd, entry, "type", buf, size) < 0)
+		goto out;
+	type = memmap_type(buf, entry);
+
+	if (mem_regions_alloc_and_add(ranges, start, end - start + 1,
+				      type) < 0) {
+		fprintf(stderr, "Cannot allocate memory for memory ranges\n");
+		goto out;
+	}
+	ret = 0;
+out:
+	close(entry_fd);
+	return ret;
 }
 
 /* documentation: firmware_memmap.h */
@@ -218,69 +197,44 @@ int have_sys_firmware_memmap(void)
 }
 
 /* documentation: firmware_memmap.h */
-int get_firmware_memmap_ranges(struct memory_range *range, size_t *ranges)
+int get_firmware_memmap_ranges(struct memory_ranges *ranges)
 {
-	DIR *firmware_memmap_dir = NULL;
+	char buf[BUFSIZ];
 	struct dirent *dirent;
-	int i = 0;
+	DIR *dir;
+	int ret = 0;
 
 	/* argument checking */
-	if (!range || !ranges) {
+	if (!ranges) {
 		fprintf(stderr, "%s: Invalid arguments.\n", __FUNCTION__);
 		return -1;
 	}
+	ranges->size = 0;
 
 	/* open the directory */
-	firmware_memmap_dir = opendir(FIRMWARE_MEMMAP_DIR);
-	if (!firmware_memmap_dir) {
+	dir = opendir(FIRMWARE_MEMMAP_DIR);
+	if (!dir) {
 		perror("Could not open \"" FIRMWARE_MEMMAP_DIR "\"");
-		goto error;
+		return -1;
 	}
 
 	/* parse the entries */
-	while ((dirent = readdir(firmware_memmap_dir)) != NULL) {
-		int ret;
-		char full_path[PATH_MAX];
-
-		/* array overflow check */
-		if ((size_t)i >= *ranges) {
-			fprintf(stderr, "The firmware provides more entries "
-				"allowed (%zd). Please report that as bug.\n",
-				*ranges);
-			goto error;
-		}
-
+	while ((dirent = readdir(dir)) != NULL) {
 		/* exclude '.' and '..' */
-		if (dirent->d_name[0] && dirent->d_name[0] == '.') {
+		if (dirent->d_name[0] == '.')
 			continue;
-		}
 
-		snprintf(full_path, PATH_MAX, "%s/%s", FIRMWARE_MEMMAP_DIR,
-			dirent->d_name);
-		full_path[PATH_MAX-1] = 0;
-		ret = parse_memmap_entry(full_path, &range[i]);
-		if (ret < 0) {
-			goto error;
-		}
-
-		i++;
+		ret = parse_memmap_entry(dirfd(dir), dirent->d_name,
+					 buf, sizeof(buf), ranges);
+		if (ret < 0)
+			break;
 	}
+	closedir(dir);
+	if (ret < 0)
+		return -1;
 
-	/* close the dir as we don't need it any more */
-	closedir(firmware_memmap_dir);
-
-	/* update the number of ranges for the caller */
-	*ranges = i;
-
-	/* and finally sort the entries with qsort */
-	qsort(range, *ranges, sizeof(struct memory_range), compare_ranges);
+	/* and finally sort the entries */
+	mem_regions_sort(ranges);
 
 	return 0;
-
-error:
-	if (firmware_memmap_dir) {
-		closedir(firmware_memmap_dir);
-	}
-	return -1;
 }
-
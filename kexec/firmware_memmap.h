@@ -63,14 +63,12 @@ int have_sys_firmware_memmap(void);
 /**
  * Parses the /sys/firmware/memmap memory map.
  *
- * @param[out] range a pointer to an array of type struct memory_range with
- *             at least *range entries
- * @param[in,out] ranges a pointer to an integer that holds the number of
- *        	  entries which range contains (at least). After successful
- *        	  return, the number of actual entries will be written.
+ * @param[out] ranges the ranges to fill, grown as needed. Whatever they
+ *             held before is replaced. After successful return they are
+ *             sorted by start address.
  * @return 0 on success, -1 on failure.
  */
-int get_firmware_memmap_ranges(struct memory_range *range, size_t *ranges);
+int get_firmware_memmap_ranges(struct memory_ranges *ranges);
 
 
 #endif /* FIRMWARE_MEMMAP_H */
@@ -0,0 +1,529 @@
+#include <stdlib.h>
+
+#include "kexec.h"
+#include "free_ranges.h"
+
+/*
+ * An AVL tree of free ranges ordered by start address.  Every node also
+ * knows the largest range and the highest end address below it, which
+ * is enough to skip whole subtrees that cannot hold a hole or do not
+ * reach the part of memory being searched.
+ */
+struct free_range {
+	unsigned long long start;
+	unsigned long long end;		/* inclusive */
+	unsigned long long max_span;	/* largest end - start in the subtree */
+	unsigned long long max_end;
+	struct free_range *left, *right;
+	int height;
+};
+
+struct hole_query {
+	unsigned long long size;
+	unsigned long long align;
+	unsigned long long min;
+	unsigned long long max;
+	unsigned long long min_span;
+	int top_down;
+};
+
+static int height(const struct free_range *node)
+{
+	return node ? node->height : 0;
+}
+
+static void update(struct free_range *node)
+{
+	struct free_range *child[2] = { node->left, node->right };
+	int i;
+
+	node->height = 1;
+	node->max_span = node->end - node->start;
+	node->max_end = node->end;
+	for (i = 0; i < 2; i++) {
+		if (!child[i])
+			continue;
+		if (child[i]->height + 1 > node->height)
+			node->height = child[i]->height + 1;
+		if (child[i]->max_span > node->max_span)
+			node->max_span = child[i]->max_span;
+		if (child[i]->max_end > node->max_end)
+			node->max_end = child[i]->max_end;
+	}
+}
+
+static struct free_range *rotate_right(struct free_range *node)
+{
+	struct free_range *left = node->left;
+
+	node->left = left->right;
+	left->right = node;
+	update(node);
+	update(left);
+	return left;
+}
+
+static struct free_range *rotate_left(struct free_range *node)
+{
+	struct free_range *right = node->right;
+
+	node->right = right->left;
+	right->left = node;
+	update(node);
+	update(right);
+	return right;
+}
+
+static struct free_range *balance(struct free_range *node)
+{
+	int diff;
+
+	update(node);
+	diff = height(node->left) - height(node->right);
+	if (diff > 1) {
+		if (height(node->left->left) < height(node->left->right))
+			node->left = rotate_left(node->left);
+		return rotate_right(node);
+	}
+	if (diff < -1) {
+		if (height(node->right->right) < height(node->right->left))
+			node->right = rotate_right(node->right);
+		return rotate_left(node);
+	}
+	return node;
+}
+
+static int range_cmp(unsigned long long start, unsigned long long end,
+		     const struct free_range *node)
+{
+	if (start != node->start)
+		return start < node->start ? -1 : 1;
+	if (end != node->end)
+		return end < node->end ? -1 : 1;
+	return 0;
+}
+
+static struct free_range *insert_range(struct free_range *node,
+				       struct free_range *range)
+{
+	if (!node)
+		return range;
+	if (range_cmp(range->start, range->end, node) < 0)
+		node->left = insert_range(node->left, range);
+	else
+		node->right = insert_range(node->right, range);
+	return balance(node);
+}
+
+static struct free_range *remove_min(struct free_range *node,
+				     struct free_range **min)
+{
+	if (!node->left) {
+		*min = node;
+		return node->right;
+	}
+	node->left = remove_min(node->left, min);
+	return balance(node);
+}
+
+static struct free_range *remove_range(struct free_range *node,
+				       unsigned long long start,
+				       unsigned long long end)
+{
+	struct free_range *min;
+	int cmp;
+
+	if (!node)
+		return NULL;
+	cmp = range_cmp(start, end, node);
+	if (cmp < 0) {
+		node->left = remove_range(node->left, start, end);
+	} else if (cmp > 0) {
+		node->right = remove_range(node->right, start, end);
+	} else {
+		struct free_range *left = node->left, *right = node->right;
+
+		free(node);
+		if (!right)
+			return left;
+		right = remove_min(right, &min);
+		min->left = left;
+		min->right = right;
+		node = min;
+	}
+	return balance(node);
+}
+
+static void add_range(struct free_ranges *ranges,
+		      unsigned long long start, unsigned long long end)
+{
+	struct free_range *range;
+
+	range = xmalloc(sizeof(*range));
+	range->start = start;
+	range->end = end;
+	range->left = range->right = NULL;
+	update(range);
+	ranges->root = insert_range(ranges->root, range);
+}
+
+static void free_tree(struct free_range *node)
+{
+	if (!node)
+		return;
+	free_tree(node->left);
+	free_tree(node->right);
+	free(node);
+}
+
+/**
+ * free_ranges_init() - start over from a list of memory ranges
+ * @ranges: free ranges to (re)initialise
+ * @range: memory ranges, of which only the RAM is used
+ * @nr_ranges: number of memory ranges
+ */
+void free_ranges_init(struct free_ranges *ranges,
+		      const struct memory_range *range, int nr_ranges)
+{
+	int i;
+
+	free_ranges_release(ranges);
+	ranges->memory_range = range;
+	ranges->memory_ranges = nr_ranges;
+	for (i = 0; i < nr_ranges; i++) {
+		if (range[i].type != RANGE_RAM)
+			continue;
+		if (range[i].start < range[i].end)
+			add_range(ranges, range[i].start, range[i].end);
+	}
+}
+
+void free_ranges_release(struct free_ranges *ranges)
+{
+	free_tree(ranges->root);
+	ranges->root = NULL;
+	ranges->memory_range = NULL;
+	ranges->memory_ranges = 0;
+	ranges->nr_segments = 0;
+}
+
+static struct free_range *find_overlap(struct free_range *node,
+				       unsigned long long start,
+				       unsigned long long end)
+{
+	while (node) {
+		if (node->start <= end && node->end >= start)
+			return node;
+		if (node->left && node->left->max_end >= start)
+			node = node->left;
+		else
+			node = node->right;
+	}
+	return NULL;
+}
+
+/**
+ * free_ranges_exclude() - take [start, end] out of the free ranges
+ * @ranges: free ranges to update
+ * @start: first byte that is no longer free
+ * @end: last byte that is no longer free
+ */
+void free_ranges_exclude(struct free_ranges *ranges,
+			 unsigned long long start, unsigned long long end)
+{
+	struct free_range *node;
+	unsigned long long rstart, rend;
+
+	while ((node = find_overlap(ranges->root, start, end))) {
+		rstart = node->start;
+		rend = node->end;
+		ranges->root = remove_range(ranges->root, rstart, rend);
+		if (rstart < start)
+			add_range(ranges, rstart, start - 1);
+		if (rend > end)
+			add_range(ranges, end + 1, rend);
+	}
+}
+
+/* Where in this free range a hole would go, if it fits */
+static int hole_fits(const struct free_range *node,
+		     const struct hole_query *q, unsigned long long *base)
+{
+	unsigned long long start, end;
+
+	start = node->start;
+	if (start < q->min)
+		start = q->min;
+	start = _ALIGN(start, q->align);
+	end = node->end;
+	if (end > q->max)
+		end = q->max;
+	if (start >= end)
+		return 0;
+	if (q->size && end - start < q->size - 1)
+		return 0;
+	if (q->top_down)
+		*base = _ALIGN_DOWN(end - q->size + 1, q->align);
+	else
+		*base = start;
+	return 1;
+}
+
+static int find_first(const struct free_range *node,
+		      const struct hole_query *q, unsigned long long *base)
+{
+	if (!node || node->max_span < q->min_span || node->max_end < q->min)
+		return 0;
+	if (find_first(node->left, q, base))
+		return 1;
+	if (node->start > q->max)
+		return 0;
+	if (hole_fits(node, q, base))
+		return 1;
+	return find_first(node->right, q, base);
+}
+
+static int find_last(const struct free_range *node,
+		     const struct hole_query *q, unsigned long long *base)
+{
+	if (!node || node->max_span < q->min_span || node->max_end < q->min)
+		return 0;
+	if (node->start <= q->max) {
+		if (find_last(node->right, q, base))
+			return 1;
+		if (hole_fits(node, q, base))
+			return 1;
+	}
+	return find_last(node->left, q, base);
+}
+
+/**
+ * free_ranges_find() - find a hole in the free ranges
+ * @ranges: free ranges to search
+ * @size: size of the hole, or 0 for any free range
+ * @align: alignment of the hole, a power of two
+ * @min: lowest address the hole may start at
+ * @max: highest address the hole may end at
+ * @top_down: take the highest hole rather than the lowest
+ * @base: where the hole starts, if there is one
+ *
+ * Returns %1 if a hole was found, %0 otherwise.
+ */
+int free_ranges_find(const struct free_ranges *ranges,
+		     unsigned long long size, unsigned long long align,
+		     unsigned long long min, unsigned long long max,
+		     int top_down, unsigned long long *base)
+{
+	struct hole_query q;
+
+	q.size = size;
+	q.align = align;
+	q.min = min;
+	q.max = max;
+	q.min_span = size ? size - 1 : 0;
+	q.top_down = top_down;
+	if (top_down)
+		return find_last(ranges->root, &q, base);
+	return find_first(ranges->root, &q, base);
+}
+
+#ifdef BENCH
+/*
+ * "make free-ranges-bench" builds kexec/free-ranges-bench, which places
+ * -n buffers (4000 by default) of 4KiB to 64KiB over -r fragmented RAM
+ * ranges (4096 by default), once with the tree and once the way
+ * locate_hole() used to, rebuilding the free list from the memory
+ * ranges and the sorted segments on every call.  Both have to pick the
+ * same holes.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+void *xmalloc(size_t size)
+{
+	void *buf = malloc(size);
+
+	if (!buf) {
+		fprintf(stderr, "Cannot malloc %zu bytes\n", size);
+		exit(1);
+	}
+	return buf;
+}
+
+struct bench_query {
+	unsigned long long size, align, min, max;
+	int top_down;
+};
+
+static unsigned long long bench_seed = 1;
+
+static unsigned long long bench_rand(void)
+{
+	bench_seed = bench_seed * 6364136223846793005ULL + 1442695040888963407ULL;
+	return bench_seed >> 33;
+}
+
+static double bench_ms(const struct timespec *t0)
+{
+	struct timespec t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) * 1e3 +
+		(t1.tv_nsec - t0->tv_nsec) / 1e6;
+}
+
+/* The free list merge and scan of the old locate_hole() */
+static int bench_ref_find(const struct memory_range *range, int nr_ranges,
+			  const struct memory_range *seg, int nr_segs,
+			  struct memory_range *free_range,
+			  const struct bench_query *q, unsigned long long *base)
+{
+	int i, j, nr_free = 0, found = 0;
+
+	for (j = 0, i = 0; i < nr_ranges; i++) {
+		unsigned long long mstart = range[i].start, mend = range[i].end;
+
+		if (range[i].type != RANGE_RAM)
+			continue;
+		while (j < nr_segs && seg[j].start <= mend) {
+			if (mstart < seg[j].start) {
+				free_range[nr_free].start = mstart;
+				free_range[nr_free].end = seg[j].start - 1;
+				nr_free++;
+			}
+			mstart = seg[j].end + 1;
+			j++;
+		}
+		if (mstart < mend) {
+			free_range[nr_free].start = mstart;
+			free_range[nr_free].end = mend;
+			nr_free++;
+		}
+	}
+	for (i = 0; i < nr_free; i++) {
+		unsigned long long start, end;
+
+		start = free_range[i].start;
+		if (start < q->min)
+			start = q->min;
+		start = _ALIGN(start, q->align);
+		end = free_range[i].end;
+		if (end > q->max)
+			end = q->max;
+		if (start >= end || end - start < q->size - 1)
+			continue;
+		found = 1;
+		if (!q->top_down) {
+			*base = start;
+			break;
+		}
+		*base = _ALIGN_DOWN(end - q->size + 1, q->align);
+	}
+	return found;
+}
+
+int main(int argc, char **argv)
+{
+	struct free_ranges ranges;
+	struct memory_range *range, *seg, *free_range;
+	struct bench_query *query;
+	unsigned long long *tree_base, *ref_base, addr = 0;
+	int nr_ranges = 4096, nr_bufs = 4000, nr_segs = 0;
+	int opt, i, j, placed = 0;
+	struct timespec t0;
+	double tree_ms, ref_ms;
+
+	while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+		switch (opt) {
+		case 'n':
+			nr_bufs = atoi(optarg);
+			break;
+		case 'r':
+			nr_ranges = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n buffers] [-r ranges]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (nr_bufs < 1 || nr_ranges < 1) {
+		fprintf(stderr, "Bad number of buffers or ranges\n");
+		return 1;
+	}
+
+	/* RAM in 64KiB to 1MiB pieces, with holes of reserved memory */
+	range = xmalloc(nr_ranges * sizeof(*range));
+	for (i = 0; i < nr_ranges; i++) {
+		addr += (bench_rand() % 16 + 1) << 12;
+		range[i].start = addr;
+		addr += (bench_rand() % 16 + 1) << 16;
+		range[i].end = addr - 1;
+		range[i].type = i % 8 == 7 ? RANGE_RESERVED : RANGE_RAM;
+	}
+	query = xmalloc(nr_bufs * sizeof(*query));
+	for (i = 0; i < nr_bufs; i++) {
+		query[i].size = (bench_rand() % 16 + 1) << 12;
+		query[i].align = 1ULL << (12 + bench_rand() % 6);
+		query[i].min = bench_rand() % 4 ? 0 : bench_rand() % addr;
+		query[i].max = bench_rand() % 4 ? ~0ULL :
+			query[i].min + bench_rand() % (addr - query[i].min);
+		query[i].top_down = bench_rand() % 2;
+	}
+	tree_base = xmalloc(nr_bufs * sizeof(*tree_base));
+	ref_base = xmalloc(nr_bufs * sizeof(*ref_base));
+	seg = xmalloc(nr_bufs * sizeof(*seg));
+	free_range = xmalloc((nr_ranges + nr_bufs) * sizeof(*free_range));
+
+	memset(&ranges, 0, sizeof(ranges));
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	free_ranges_init(&ranges, range, nr_ranges);
+	for (i = 0; i < nr_bufs; i++) {
+		const struct bench_query *q = &query[i];
+
+		tree_base[i] = ~0ULL;
+		if (!free_ranges_find(&ranges, q->size, q->align, q->min,
+				      q->max, q->top_down, &tree_base[i]))
+			continue;
+		free_ranges_exclude(&ranges, tree_base[i],
+				    tree_base[i] + q->size - 1);
+		placed++;
+	}
+	tree_ms = bench_ms(&t0);
+	free_ranges_release(&ranges);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < nr_bufs; i++) {
+		const struct bench_query *q = &query[i];
+		unsigned long long base;
+
+		ref_base[i] = ~0ULL;
+		if (!bench_ref_find(range, nr_ranges, seg, nr_segs, free_range,
+				    q, &base))
+			continue;
+		ref_base[i] = base;
+		/* Keep the segments sorted, as sort_segments() did */
+		for (j = nr_segs; j > 0 && seg[j - 1].start > base; j--)
+			seg[j] = seg[j - 1];
+		seg[j].start = base;
+		seg[j].end = base + q->size - 1;
+		nr_segs++;
+	}
+	ref_ms = bench_ms(&t0);
+
+	for (i = 0; i < nr_bufs; i++) {
+		if (tree_base[i] != ref_base[i]) {
+			fprintf(stderr, "buffer %d: tree placed it at 0x%llx, "
+				"the old code at 0x%llx\n", i, tree_base[i],
+				ref_base[i]);
+			return 1;
+		}
+	}
+	printf("%d buffers (%d placed) over %d ranges: tree %.1f ms, "
+	       "rebuilt free list %.1f ms\n", nr_bufs, placed, nr_ranges,
+	       tree_ms, ref_ms);
+	return 0;
+}
+#endif
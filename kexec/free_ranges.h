@@ -0,0 +1,33 @@
+#ifndef FREE_RANGES_H
+#define FREE_RANGES_H
+
+struct free_range;
+struct memory_range;
+
+/*
+ * The RAM that no segment has been placed in yet, kept in an interval
+ * tree so that locate_hole() does not have to work it out again from
+ * the memory ranges and segments on every call.
+ */
+struct free_ranges {
+	struct free_range *root;
+	/* The memory ranges the tree was built from */
+	const struct memory_range *memory_range;
+	int memory_ranges;
+	/* How many segments have been taken out of it */
+	int nr_segments;
+};
+
+void free_ranges_init(struct free_ranges *ranges,
+		      const struct memory_range *range, int nr_ranges);
+void free_ranges_release(struct free_ranges *ranges);
+
+void free_ranges_exclude(struct free_ranges *ranges,
+			 unsigned long long start, unsigned long long end);
+
+int free_ranges_find(const struct free_ranges *ranges,
+		     unsigned long long size, unsigned long long align,
+		     unsigned long long min, unsigned long long max,
+		     int top_down, unsigned long long *base);
+
+#endif
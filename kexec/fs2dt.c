@@ -30,6 +30,7 @@
 #include <string.h>
 #include <errno.h>
 #include <stdio.h>
+#include <libfdt.h>
 #include "kexec.h"
 #include "fs2dt.h"
 
@@ -38,6 +39,7 @@
 #define INIT_TREE_WORDS 65536	/* Initial num words for prop values */
 #define MEMRESERVE 256		/* max number of reserved memory blocks */
 #define MEM_RANGE_CHUNK_SZ 2048 /* Initial num dwords for mem ranges */
+#define SYSFS_FDT "/sys/firmware/fdt"
 
 static char pathname[MAXPATH];
 static char propnames[NAMESPACE] = { 0 };
@@ -54,6 +56,7 @@ extern unsigned char reuse_initrd;
  * Only has implemented for PPC64 */
 int my_debug;
 int dt_no_old_root;
+int dt_snapshot;
 
 /* This provides the behaviour of hte existing ppc64 implementation */
 static void pad_structure_block(size_t len) {
@@ -106,7 +109,7 @@ void reserve(unsigned long long where, unsigned long long length)
 }
 
 /* look for properties we need to reserve memory space for */
-static void checkprop(char *name, unsigned *data, int len)
+static void checkprop(const char *name, unsigned *data, int len)
 {
 	static unsigned long long base, size, end;
 
@@ -170,16 +173,56 @@ static unsigned propnum(const char *name)
 }
 
 #ifdef HAVE_DYNAMIC_MEMORY
-static void add_dyn_reconf_usable_mem_property__(int fd)
+static int compare_usable(const void *a, const void *b)
+{
+	const struct memory_range *r1 = a, *r2 = b;
+
+	if (r1->start != r2->start)
+		return r1->start < r2->start ? -1 : 1;
+	return 0;
+}
+
+/*
+ * usablemem_rgns sorted by address, with ranges that overlap merged,
+ * so that each LMB only has to look at the ranges from the first one
+ * that ends above it.
+ */
+static struct memory_range *sorted_usable_mem(size_t *nr)
+{
+	struct memory_range *usable;
+	size_t i, n;
+
+	usable = xmalloc(usablemem_rgns.size * sizeof(*usable));
+	memcpy(usable, usablemem_rgns.ranges,
+	       usablemem_rgns.size * sizeof(*usable));
+	qsort(usable, usablemem_rgns.size, sizeof(*usable), compare_usable);
+
+	n = 0;
+	for (i = 0; i < usablemem_rgns.size; i++) {
+		if (n && usable[i].start < usable[n - 1].end) {
+			if (usable[i].end > usable[n - 1].end)
+				usable[n - 1].end = usable[i].end;
+			continue;
+		}
+		usable[n++] = usable[i];
+	}
+	*nr = n;
+	return usable;
+}
+
+static void dt_put64(uint64_t value)
+{
+	value = cpu_to_be64(value);
+	memcpy(dt, &value, sizeof(value));
+	dt += 2;
+}
+
+static void add_dyn_reconf_usable_mem_property__(const char *data, size_t len)
 {
 	char fname[MAXPATH], *bname;
-	uint64_t buf[32];
-	uint64_t *ranges;
-	int ranges_size = MEM_RANGE_CHUNK_SZ;
-	uint64_t base, end, loc_base, loc_end;
-	size_t i, rngs_cnt, range;
-	int rlen = 0;
-	int tmp_indx;
+	struct memory_range *usable;
+	uint64_t base, prev_base, end, loc_base, loc_end;
+	size_t i, rngs_cnt, range, first, nr_usable, lenp, start;
 
 	strcpy(fname, pathname);
 	bname = strrchr(fname, '/');
@@ -188,107 +231,80 @@ static void add_dyn_reconf_usable_mem_property__(int fd)
 	if (strncmp(bname, "/ibm,dynamic-reconfiguration-memory", 36))
 		return;
 
-	if (lseek(fd, 4, SEEK_SET) < 0)
-		die("unrecoverable error: error seeking in \"%s\": %s\n",
-			pathname, strerror(errno));
+	/* a count, then 24 bytes for each LMB starting with its address */
+	if (len < 4 + (size_t)num_of_lmbs * 24)
+		die("unrecoverable error: not enough data for mem property\n");
 
-	ranges = malloc(ranges_size*8);
-	if (!ranges)
-		die("unrecoverable error: can't alloc %d bytes for ranges.\n",
-		    ranges_size*8);
+	usable = sorted_usable_mem(&nr_usable);
 
-	rlen = 0;
-	for (i = 0; i < num_of_lmbs; i++) {
-		if (read(fd, buf, 24) < 0)
-			die("unrecoverable error: error reading \"%s\": %s\n",
-				pathname, strerror(errno));
+	/*
+	 * Add linux,drconf-usable-memory property, straight into dt.  Its
+	 * length is only known at the end.
+	 */
+	dt_reserve(&dt, 4);
+	*dt++ = cpu_to_be32(3);
+	lenp = dt++ - dt_base;
+	*dt++ = cpu_to_be32(propnum("linux,drconf-usable-memory"));
+	pad_structure_block(num_of_lmbs ? 8 : 0);
+	start = dt - dt_base;
 
-		base = be64_to_cpu((uint64_t) buf[0]);
+	first = 0;
+	prev_base = 0;
+	for (i = 0; i < num_of_lmbs; i++) {
+		memcpy(&base, data + 4 + i * 24, sizeof(base));
+		base = be64_to_cpu(base);
 		end = base + lmb_size;
 		if (~0ULL - base < end)
 			die("unrecoverable error: mem property overflow\n");
 
-		tmp_indx = rlen++;
+		/* LMBs normally come in address order; start over if not */
+		if (base < prev_base)
+			first = 0;
+		prev_base = base;
+		while (first < nr_usable && usable[first].end <= base)
+			first++;
 
 		rngs_cnt = 0;
-		for (range = 0; range < usablemem_rgns.size; range++) {
-			int add = 0;
-			loc_base = usablemem_rgns.ranges[range].start;
-			loc_end = usablemem_rgns.ranges[range].end;
-			if (loc_base >= base && loc_end <= end) {
-				add = 1;
-			} else if (base < loc_end && end > loc_base) {
-				if (loc_base < base)
-					loc_base = base;
-				if (loc_end > end)
-					loc_end = end;
-				add = 1;
-			}
-
-			if (add) {
-				if (rlen >= (ranges_size-2)) {
-					ranges_size += MEM_RANGE_CHUNK_SZ;
-					ranges = realloc(ranges, ranges_size*8);
-					if (!ranges)
-						die("unrecoverable error: can't"
-						    " realloc %d bytes for"
-						    " ranges.\n",
-						    ranges_size*8);
-				}
-				ranges[rlen++] = cpu_to_be64(loc_base);
-				ranges[rlen++] = cpu_to_be64(loc_end - loc_base);
-				rngs_cnt++;
-			}
+		for (range = first; range < nr_usable; range++) {
+			if (usable[range].start >= end)
+				break;
+			rngs_cnt++;
 		}
-		if (rngs_cnt == 0) {
-			/* We still need to add a counter for every LMB because
-			 * the kernel parsing code is dumb.  We just have
-			 * a zero in this case, with no following base/len.
-			 */
-			ranges[tmp_indx] = 0;
-			/* rlen is already just tmp_indx+1 as we didn't write
-			 * anything.  Check array size here, as we'll probably
-			 * go on for a while writing zeros now.
-			 */
-			if (rlen >= (ranges_size-1)) {
-				ranges_size += MEM_RANGE_CHUNK_SZ;
-				ranges = realloc(ranges, ranges_size*8);
-				if (!ranges)
-					die("unrecoverable error: can't"
-					    " realloc %d bytes for"
-					    " ranges.\n",
-					    ranges_size*8);
-			}
-		} else {
-			/* Store the count of (base, size) duple */
-			ranges[tmp_indx] = cpu_to_be64((uint64_t) rngs_cnt);
+
+		/* We still need to add a counter for every LMB because
+		 * the kernel parsing code is dumb.  We just have
+		 * a zero in this case, with no following base/len.
+		 */
+		dt_reserve(&dt, 2 + 4 * rngs_cnt);
+		dt_put64(rngs_cnt);
+		for (range = first; range < first + rngs_cnt; range++) {
+			loc_base = usable[range].start;
+			loc_end = usable[range].end;
+			if (loc_base < base)
+				loc_base = base;
+			if (loc_end > end)
+				loc_end = end;
+			dt_put64(loc_base);
+			dt_put64(loc_end - loc_base);
 		}
 	}
-		
-	rlen = rlen * sizeof(uint64_t);
-	/*
-	 * Add linux,drconf-usable-memory property.
-	 */
-	dt_reserve(&dt, 4+((rlen + 3)/4));
-	*dt++ = cpu_to_be32(3);
-	*dt++ = cpu_to_be32(rlen);
-	*dt++ = cpu_to_be32(propnum("linux,drconf-usable-memory"));
-	pad_structure_block(rlen);
-	memcpy(dt, ranges, rlen);
-	free(ranges);
-	dt += (rlen + 3)/4;
+	free(usable);
+
+	dt_base[lenp] = cpu_to_be32((dt - dt_base - start) * 4);
 }
 
-static void add_dyn_reconf_usable_mem_property(struct dirent *dp, int fd)
+static void add_dyn_reconf_usable_mem_property(const char *name,
+					       const void *data, size_t len)
 {
-	if (!strcmp(dp->d_name, "ibm,dynamic-memory") && usablemem_rgns.size)
-		add_dyn_reconf_usable_mem_property__(fd);
+	if (!strcmp(name, "ibm,dynamic-memory") && usablemem_rgns.size)
+		add_dyn_reconf_usable_mem_property__(data, len);
 }
 #else
-static void add_dyn_reconf_usable_mem_property(struct dirent *dp, int fd) {}
+static void add_dyn_reconf_usable_mem_property(const char *name,
+					       const void *data, size_t len) {}
 #endif
 
-static void add_usable_mem_property(int fd, size_t len)
+static void add_usable_mem_property(const void *data, size_t len)
 {
 	char fname[MAXPATH], *bname;
 	uint64_t buf[2];
@@ -308,12 +324,7 @@ static void add_usable_mem_property(int fd, size_t len)
 	if (len < sizeof(buf))
 		die("unrecoverable error: not enough data for mem property\n");
 
-	if (lseek(fd, 0, SEEK_SET) < 0)
-		die("unrecoverable error: error seeking in \"%s\": %s\n",
-		    pathname, strerror(errno));
-	if (read(fd, buf, sizeof(buf)) != sizeof(buf))
-		die("unrecoverable error: error reading \"%s\": %s\n",
-		    pathname, strerror(errno));
+	memcpy(buf, data, sizeof(buf));
 
 	base = be64_to_cpu(buf[0]);
 	end = be64_to_cpu(buf[1]);
@@ -378,98 +389,111 @@ static void add_usable_mem_property(int fd, size_t len)
 	dt += (rlen + 3)/4;
 }
 
+/* properties that are not copied, or are only recreated later */
+static int skipprop(const char *name)
+{
+	/* Empirically, this seems to need to be ecluded.
+	 * Observed on ARM with 3.6-rc2 kernel
+	 */
+	if (!strcmp(name, "name"))
+		return 1;
+
+	if (!crash_param && !strcmp(name, "linux,crashkernel-base"))
+		return 1;
+
+	if (!crash_param && !strcmp(name, "linux,crashkernel-size"))
+		return 1;
+
+	/*
+	 * This property will be created for each node during kexec
+	 * boot. So, ignore it.
+	 */
+	if (!strcmp(name, "linux,pci-domain") ||
+		!strcmp(name, "linux,htab-base") ||
+		!strcmp(name, "linux,htab-size") ||
+		!strcmp(name, "linux,kernel-end"))
+			return 1;
+
+	/* This property will be created/modified later in putnode()
+	 * So ignore it, unless we are reusing the initrd.
+	 */
+	if ((!strcmp(name, "linux,initrd-start") ||
+	     !strcmp(name, "linux,initrd-end")) &&
+	    !reuse_initrd)
+			return 1;
+
+	/* This property will be created later in putnode() So
+	 * ignore it now.
+	 */
+	if (!strcmp(name, "bootargs"))
+		return 1;
+
+	return 0;
+}
+
+/*
+ * put one property in the property structure, with the usable memory
+ * properties that go with it.  pathname already names the property.
+ */
+static void putprop(const char *name, const void *data, int len)
+{
+	dt_reserve(&dt, 4+((len + 3)/4));
+	*dt++ = cpu_to_be32(3);
+	*dt++ = cpu_to_be32(len);
+	*dt++ = cpu_to_be32(propnum(name));
+	pad_structure_block(len);
+
+	if (len)
+		memcpy(dt, data, len);
+
+	checkprop(name, dt, len);
+
+	dt += (len + 3)/4;
+
+	if (!strcmp(name, "reg") && usablemem_rgns.size)
+		add_usable_mem_property(data, len);
+	add_dyn_reconf_usable_mem_property(name, data, len);
+}
+
 /* put all properties (files) in the property structure */
 static void putprops(char *fn, struct dirent **nlist, int numlist)
 {
 	struct dirent *dp;
-	int i = 0, fd;
+	int i = 0;
 	off_t len;
 	off_t slen;
 	struct stat statbuf;
 
 	for (i = 0; i < numlist; i++) {
+		char *buf = NULL;
+
 		dp = nlist[i];
 		strcpy(fn, dp->d_name);
 
 		if (!strcmp(dp->d_name, ".") || !strcmp(dp->d_name, ".."))
                         continue;
 
-		/* Empirically, this seems to need to be ecluded.
-		 * Observed on ARM with 3.6-rc2 kernel
-		 */
-		if (!strcmp(dp->d_name, "name"))
-                        continue;
+		if (skipprop(fn))
+			continue;
 
 		if (lstat(pathname, &statbuf))
 			die("unrecoverable error: could not stat \"%s\": %s\n",
 			    pathname, strerror(errno));
 
-		if (!crash_param && !strcmp(fn,"linux,crashkernel-base"))
-			continue;
-
-		if (!crash_param && !strcmp(fn,"linux,crashkernel-size"))
-			continue;
-
-		/*
-		 * This property will be created for each node during kexec
-		 * boot. So, ignore it.
-		 */
-		if (!strcmp(dp->d_name, "linux,pci-domain") ||
-			!strcmp(dp->d_name, "linux,htab-base") ||
-			!strcmp(dp->d_name, "linux,htab-size") ||
-			!strcmp(dp->d_name, "linux,kernel-end"))
-				continue;
-
-		/* This property will be created/modified later in putnode()
-		 * So ignore it, unless we are reusing the initrd.
-		 */
-		if ((!strcmp(dp->d_name, "linux,initrd-start") ||
-		     !strcmp(dp->d_name, "linux,initrd-end")) &&
-		    !reuse_initrd)
-				continue;
-
-		/* This property will be created later in putnode() So
-		 * ignore it now.
-		 */
-		if (!strcmp(dp->d_name, "bootargs"))
-			continue;
-
 		if (! S_ISREG(statbuf.st_mode))
 			continue;
 
 		len = statbuf.st_size;
 
-		dt_reserve(&dt, 4+((len + 3)/4));
-		*dt++ = cpu_to_be32(3);
-		*dt++ = cpu_to_be32(len);
-		*dt++ = cpu_to_be32(propnum(fn));
-		pad_structure_block(len);
-
 		if (len) {
-			char *buf;
-
 			buf = slurp_file_len(pathname, len, &slen);
 			if (slen != len)
 				die("unrecoverable error: short read from\"%s\"\n",
 				    pathname);
-
-			memcpy(dt, buf, slen);
-			free(buf);
 		}
 
-		checkprop(fn, dt, len);
-
-		dt += (len + 3)/4;
-
-		fd = open(pathname, O_RDONLY);
-		if (fd == -1)
-			die("unrecoverable error: could not open \"%s\": %s\n",
-			    pathname, strerror(errno));
-
-		if (!strcmp(dp->d_name, "reg") && usablemem_rgns.size)
-			add_usable_mem_property(fd, len);
-		add_dyn_reconf_usable_mem_property(dp, fd);
-		close(fd);
+		putprop(fn, buf, len);
+		free(buf);
 	}
 
 	fn[0] = '\0';
@@ -545,48 +569,19 @@ static void dt_copy_old_root_param(void)
 	fclose(fp);
 }
 
-/*
- * put a node (directory) in the property structure.  first properties
- * then children.
- */
-static void putnode(void)
+/* properties of /chosen that are made up for the second kernel */
+static void putchosen(void)
 {
-	char *dn;
-	struct dirent *dp;
-	char *basename;
-	struct dirent **namelist;
-	int numlist, i;
+	size_t result;
+	size_t cmd_len = 0;
+	char *param = NULL;
+	char filename[MAXPATH + 32];
+	char *buff;
+	int fd;
 	struct stat statbuf;
-	int plen;
-
-	numlist = scandir(pathname, &namelist, 0, comparefunc);
-	if (numlist < 0)
-		die("unrecoverable error: could not scan \"%s\": %s\n",
-		    pathname, strerror(errno));
-	if (numlist == 0)
-		die("unrecoverable error: no directory entries in \"%s\"",
-		    pathname);
-
-	basename = strrchr(pathname,'/') + 1;
-
-	plen = *basename ? strlen(basename) : 0;
-	/* Reserve space for string packed to words; e.g. string length 10
-	 * occupies 3 words, length 12 occupies 4 (for terminating \0s).
-	 * So round up & include the \0:
-	 */
-	dt_reserve(&dt, 1+((plen + 4)/4));
-	*dt++ = cpu_to_be32(1);
-	strcpy((void *)dt, *basename ? basename : "");
-	dt += ((plen + 4)/4);
-
-	if (*basename)
-		strcat(pathname, "/");
-	dn = pathname + strlen(pathname);
-
-	putprops(dn, namelist, numlist);
 
 	/* Add initrd entries to the second kernel */
-	if (initrd_base && initrd_size && !strcmp(basename,"chosen/")) {
+	if (initrd_base && initrd_size) {
 		int len = 8;
 		uint64_t bevalue;
 
@@ -619,106 +614,159 @@ static void putnode(void)
 	 * is no root= in the new command line and there's no --dt-no-old-root
 	 * option being used.
 	 */
-	if (!strcmp(basename,"chosen/")) {
-		size_t result;
-		size_t cmd_len = 0;
-		char *param = NULL;
-		char filename[MAXPATH];
-		char *buff;
-		int fd;
-
-		cmd_len = strlen(local_cmdline);
-		if (cmd_len != 0) {
-			param = strstr(local_cmdline, "crashkernel=");
-			if (param)
-				crash_param = 1;
-			/* does the new cmdline have a root= ? ... */
-			param = strstr(local_cmdline, "root=");
-		}
+	cmd_len = strlen(local_cmdline);
+	if (cmd_len != 0) {
+		param = strstr(local_cmdline, "crashkernel=");
+		if (param)
+			crash_param = 1;
+		/* does the new cmdline have a root= ? ... */
+		param = strstr(local_cmdline, "root=");
+	}
 
-		if (!param && !dt_no_old_root)
-			dt_copy_old_root_param();
+	if (!param && !dt_no_old_root)
+		dt_copy_old_root_param();
 
-		strcat(local_cmdline, " ");
-		cmd_len = strlen(local_cmdline);
-		cmd_len = cmd_len + 1;
+	strcat(local_cmdline, " ");
+	cmd_len = strlen(local_cmdline);
+	cmd_len = cmd_len + 1;
 
-		/* add new bootargs */
-		dt_reserve(&dt, 4+((cmd_len+3)/4));
-		*dt++ = cpu_to_be32(3);
-		*dt++ = cpu_to_be32(cmd_len);
-		*dt++ = cpu_to_be32(propnum("bootargs"));
-		pad_structure_block(cmd_len);
-		memcpy(dt, local_cmdline,cmd_len);
-		dt += (cmd_len + 3)/4;
+	/* add new bootargs */
+	dt_reserve(&dt, 4+((cmd_len+3)/4));
+	*dt++ = cpu_to_be32(3);
+	*dt++ = cpu_to_be32(cmd_len);
+	*dt++ = cpu_to_be32(propnum("bootargs"));
+	pad_structure_block(cmd_len);
+	memcpy(dt, local_cmdline,cmd_len);
+	dt += (cmd_len + 3)/4;
 
-		fprintf(stderr, "Modified cmdline:%s\n", local_cmdline);
+	fprintf(stderr, "Modified cmdline:%s\n", local_cmdline);
 
-		/*
-		 * Determine the platform type/stdout type, so that purgatory
-		 * code can print 'I'm in purgatory' message. Currently only
-		 * pseries/hvcterminal is supported.
-		 */
-		snprintf(filename, MAXPATH, "%sstdout-path", pathname);
+	/*
+	 * Determine the platform type/stdout type, so that purgatory
+	 * code can print 'I'm in purgatory' message. Currently only
+	 * pseries/hvcterminal is supported.
+	 */
+	snprintf(filename, sizeof(filename), "%sstdout-path", pathname);
+	fd = open(filename, O_RDONLY);
+	if (fd == -1) {
+		snprintf(filename, sizeof(filename), "%slinux,stdout-path", pathname);
 		fd = open(filename, O_RDONLY);
 		if (fd == -1) {
-			snprintf(filename, MAXPATH, "%slinux,stdout-path", pathname);
-			fd = open(filename, O_RDONLY);
-			if (fd == -1) {
-				printf("Unable to find %s[linux,]stdout-path, printing from purgatory is disabled\n",
-														pathname);
-				goto no_debug;
-			}
+			printf("Unable to find %s[linux,]stdout-path, printing from purgatory is disabled\n",
+													pathname);
+			return;
 		}
-		if (fstat(fd, &statbuf)) {
-			printf("Unable to stat %s, printing from purgatory is disabled\n",
-														filename);
-			close(fd);
-			goto no_debug;
+	}
+	if (fstat(fd, &statbuf)) {
+		printf("Unable to stat %s, printing from purgatory is disabled\n",
+													filename);
+		close(fd);
+		return;
 
-		}
+	}
 
-		buff = malloc(statbuf.st_size);
-		if (!buff) {
-			printf("Can not allocate memory for buff\n");
-			close(fd);
-			goto no_debug;
-		}
-		result = read(fd, buff, statbuf.st_size);
+	buff = malloc(statbuf.st_size);
+	if (!buff) {
+		printf("Can not allocate memory for buff\n");
 		close(fd);
-		if (result <= 0) {
-			printf("Unable to read %s, printing from purgatory is disabled\n",
-														filename);
-			goto no_debug;
-		}
-		snprintf(filename, MAXPATH, "/proc/device-tree/%s/compatible", buff);
-		fd = open(filename, O_RDONLY);
-		if (fd == -1) {
-			printf("Unable to find %s printing from purgatory is disabled\n",
-														filename);
-			goto no_debug;
-		}
-		if (fstat(fd, &statbuf)) {
-			printf("Unable to stat %s printing from purgatory is disabled\n",
-														filename);
-			close(fd);
-			goto no_debug;
-		}
-		buff = realloc(buff, statbuf.st_size);
-		if (!buff) {
-			printf("Can not allocate memory for buff\n");
-			close(fd);
-			goto no_debug;
-		}
-		result = read(fd, buff, statbuf.st_size);
-		if (result && (!strcmp(buff, "hvterm1")
-			|| !strcmp(buff, "hvterm-protocol")))
-			my_debug = 1;
+		return;
+	}
+	result = read(fd, buff, statbuf.st_size);
+	close(fd);
+	if (result <= 0) {
+		printf("Unable to read %s, printing from purgatory is disabled\n",
+													filename);
+		return;
+	}
+	snprintf(filename, sizeof(filename), "/proc/device-tree/%s/compatible", buff);
+	fd = open(filename, O_RDONLY);
+	if (fd == -1) {
+		printf("Unable to find %s printing from purgatory is disabled\n",
+													filename);
+		return;
+	}
+	if (fstat(fd, &statbuf)) {
+		printf("Unable to stat %s printing from purgatory is disabled\n",
+													filename);
 		close(fd);
-		free(buff);
+		return;
 	}
+	buff = realloc(buff, statbuf.st_size);
+	if (!buff) {
+		printf("Can not allocate memory for buff\n");
+		close(fd);
+		return;
+	}
+	result = read(fd, buff, statbuf.st_size);
+	if (result && (!strcmp(buff, "hvterm1")
+		|| !strcmp(buff, "hvterm-protocol")))
+		my_debug = 1;
+	close(fd);
+	free(buff);
+}
+
+/*
+ * Start the node named by the last component of pathname, and add a '/'
+ * to pathname.  Returns where the names of its entries go in pathname.
+ */
+static char *putnode_begin(void)
+{
+	char *basename;
+	int plen;
+
+	basename = strrchr(pathname,'/') + 1;
+
+	plen = *basename ? strlen(basename) : 0;
+	/* Reserve space for string packed to words; e.g. string length 10
+	 * occupies 3 words, length 12 occupies 4 (for terminating \0s).
+	 * So round up & include the \0:
+	 */
+	dt_reserve(&dt, 1+((plen + 4)/4));
+	*dt++ = cpu_to_be32(1);
+	strcpy((void *)dt, *basename ? basename : "");
+	dt += ((plen + 4)/4);
+
+	if (*basename)
+		strcat(pathname, "/");
+	return pathname + strlen(pathname);
+}
+
+static void putnode_end(char *dn)
+{
+	dt_reserve(&dt, 1);
+	*dt++ = cpu_to_be32(2);
+	dn[-1] = '\0';
+}
+
+/*
+ * put a node (directory) in the property structure.  first properties
+ * then children.
+ */
+static void putnode(void)
+{
+	char *dn;
+	struct dirent *dp;
+	char *basename;
+	struct dirent **namelist;
+	int numlist, i;
+	struct stat statbuf;
+
+	numlist = scandir(pathname, &namelist, 0, comparefunc);
+	if (numlist < 0)
+		die("unrecoverable error: could not scan \"%s\": %s\n",
+		    pathname, strerror(errno));
+	if (numlist == 0)
+		die("unrecoverable error: no directory entries in \"%s\"",
+		    pathname);
+
+	basename = strrchr(pathname,'/') + 1;
+	dn = putnode_begin();
+
+	putprops(dn, namelist, numlist);
+
+	if (!strcmp(basename,"chosen/"))
+		putchosen();
 
-no_debug:
 	for (i=0; i < numlist; i++) {
 		dp = namelist[i];
 		strcpy(dn, dp->d_name);
@@ -735,12 +783,224 @@ no_debug:
 			putnode();
 	}
 
-	dt_reserve(&dt, 1);
-	*dt++ = cpu_to_be32(2);
-	dn[-1] = '\0';
+	putnode_end(dn);
 	free(namelist);
 }
 
+/*
+ * Top level nodes that are always read from /proc/device-tree, because
+ * the kernel changes them after boot: /chosen, and the LMB flags of
+ * dynamic reconfiguration memory.
+ */
+static int live_node(const char *name)
+{
+	return !strcmp(name, "chosen") ||
+		!strcmp(name, "ibm,dynamic-reconfiguration-memory");
+}
+
+static int fdt_skip_node(const void *fdt, int offset)
+{
+	int depth = 0;
+	uint32_t tag;
+
+	do {
+		tag = fdt_next_tag(fdt, offset, &offset);
+		if (tag == FDT_BEGIN_NODE)
+			depth++;
+		else if (tag == FDT_END_NODE)
+			depth--;
+		else if (tag == FDT_END)
+			die("unrecoverable error: bad structure in %s\n",
+			    SYSFS_FDT);
+	} while (depth);
+
+	return offset;
+}
+
+/*
+ * putnode() for the node at offset in the firmware FDT.  pathname
+ * names the node in /proc/device-tree as for putnode().  Returns the
+ * offset after the node.
+ */
+static int putnode_fdt(const void *fdt, int offset)
+{
+	const struct fdt_property *prop;
+	const char *name;
+	char *dn;
+	int nextoffset, len, root;
+	uint32_t tag;
+
+	root = !*(strrchr(pathname,'/') + 1);
+	dn = putnode_begin();
+
+	fdt_next_tag(fdt, offset, &nextoffset);
+	for (;;) {
+		offset = nextoffset;
+		tag = fdt_next_tag(fdt, offset, &nextoffset);
+		if (tag == FDT_NOP)
+			continue;
+		if (tag != FDT_PROP)
+			break;
+
+		prop = fdt_offset_ptr(fdt, offset, sizeof(*prop));
+		len = prop ? fdt32_to_cpu(prop->len) : -1;
+		if (len < 0 || !fdt_offset_ptr(fdt, offset + sizeof(*prop), len))
+			die("unrecoverable error: bad property in %s\n",
+			    SYSFS_FDT);
+		name = fdt_string(fdt, fdt32_to_cpu(prop->nameoff));
+		if (!name || strlen(name) >= MAXPATH - (dn - pathname))
+			die("unrecoverable error: bad property name in %s\n",
+			    SYSFS_FDT);
+
+		strcpy(dn, name);
+		if (!skipprop(name))
+			putprop(name, prop->data, len);
+	}
+	dn[0] = '\0';
+	checkprop(pathname, NULL, 0);
+
+	while (tag == FDT_BEGIN_NODE || tag == FDT_NOP) {
+		if (tag == FDT_BEGIN_NODE) {
+			name = fdt_get_name(fdt, offset, &len);
+			if (!name || len >= MAXPATH - (dn - pathname))
+				die("unrecoverable error: bad node name in %s\n",
+				    SYSFS_FDT);
+			strcpy(dn, name);
+			if (root && live_node(name)) {
+				putnode();
+				nextoffset = fdt_skip_node(fdt, offset);
+			} else {
+				nextoffset = putnode_fdt(fdt, offset);
+			}
+		}
+		offset = nextoffset;
+		tag = fdt_next_tag(fdt, offset, &nextoffset);
+	}
+	if (tag != FDT_END_NODE)
+		die("unrecoverable error: bad structure in %s\n", SYSFS_FDT);
+
+	putnode_end(dn);
+	return nextoffset;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+	return strcmp(*(const char * const *)a, *(const char * const *)b);
+}
+
+/*
+ * Whether the subnodes of path in the firmware FDT are the same as the
+ * subdirectories of path in /proc/device-tree.
+ */
+static int fdt_subnodes_match(const void *fdt, const char *path)
+{
+	char dirname[MAXPATH];
+	const char **fdt_names = NULL, **live_names = NULL;
+	int nr_fdt = 0, nr_live = 0, max_fdt = 0, max_live = 0;
+	int node, offset, depth, i, match = 0;
+	struct dirent *dp;
+	struct stat statbuf;
+	DIR *dir;
+
+	snprintf(dirname, sizeof(dirname), "/proc/device-tree%s", path);
+	node = fdt_path_offset(fdt, path);
+	dir = opendir(dirname);
+	if (node < 0 || !dir) {
+		/* missing from both is fine */
+		match = node < 0 && !dir && errno == ENOENT;
+		if (dir)
+			closedir(dir);
+		return match;
+	}
+
+	depth = 0;
+	offset = node;
+	while ((offset = fdt_next_node(fdt, offset, &depth)) >= 0 &&
+	       depth > 0) {
+		if (depth != 1)
+			continue;
+		if (nr_fdt == max_fdt) {
+			max_fdt = max_fdt ? 2 * max_fdt : 64;
+			fdt_names = xrealloc(fdt_names,
+					     max_fdt * sizeof(*fdt_names));
+		}
+		fdt_names[nr_fdt++] = fdt_get_name(fdt, offset, NULL);
+	}
+
+	while ((dp = readdir(dir)) != NULL) {
+		if (!strcmp(dp->d_name, ".") || !strcmp(dp->d_name, ".."))
+			continue;
+		if (dp->d_type == DT_UNKNOWN) {
+			if (fstatat(dirfd(dir), dp->d_name, &statbuf,
+				    AT_SYMLINK_NOFOLLOW))
+				goto out;
+			if (!S_ISDIR(statbuf.st_mode))
+				continue;
+		} else if (dp->d_type != DT_DIR) {
+			continue;
+		}
+		if (nr_live == max_live) {
+			max_live = max_live ? 2 * max_live : 64;
+			live_names = xrealloc(live_names,
+					      max_live * sizeof(*live_names));
+		}
+		live_names[nr_live] = strdup(dp->d_name);
+		if (!live_names[nr_live++])
+			die("Can't allocate memory for %s\n", dirname);
+	}
+	if (nr_fdt != nr_live)
+		goto out;
+
+	qsort(fdt_names, nr_fdt, sizeof(*fdt_names), compare_names);
+	qsort(live_names, nr_live, sizeof(*live_names), compare_names);
+	for (i = 0; i < nr_fdt; i++) {
+		if (!fdt_names[i] || strcmp(fdt_names[i], live_names[i]))
+			goto out;
+	}
+	match = 1;
+out:
+	for (i = 0; i < nr_live; i++)
+		free((char *)live_names[i]);
+	free(live_names);
+	free(fdt_names);
+	closedir(dir);
+	return match;
+}
+
+/*
+ * The FDT the running kernel was booted with, to stand in for walking
+ * /proc/device-tree with --dt-snapshot.  It is what firmware passed at
+ * boot, so nothing changed since then is in it: properties rewritten in
+ * place (partition migration updates ibm,associativity and
+ * ibm,pa-features), and nodes added or removed by DLPAR or PCI hotplug.
+ * The kernel keeps no generation count to tell, so the only check is
+ * that the nodes at the top level and under /cpus, which memory and cpu
+ * hotplug change, still match the live tree.
+ */
+static void *read_fdt_snapshot(void)
+{
+	char *fdt;
+	off_t size;
+
+	if (access(SYSFS_FDT, R_OK))
+		return NULL;
+
+	fdt = slurp_file(SYSFS_FDT, &size);
+	if (size < (off_t)sizeof(struct fdt_header) || fdt_check_header(fdt) ||
+	    fdt_totalsize(fdt) > size || fdt_version(fdt) < 0x10) {
+		dbgprintf("%s: not a usable FDT\n", SYSFS_FDT);
+		goto out;
+	}
+	if (!fdt_subnodes_match(fdt, "/") || !fdt_subnodes_match(fdt, "/cpus")) {
+		dbgprintf("%s: out of date\n", SYSFS_FDT);
+		goto out;
+	}
+	return fdt;
+out:
+	free(fdt);
+	return NULL;
+}
+
 struct bootblock bb[1];
 
 static void add_boot_block(char **bufp, off_t *sizep)
@@ -807,6 +1067,8 @@ static void add_boot_block(char **bufp, off_t *sizep)
 
 void create_flatten_tree(char **bufp, off_t *sizep, const char *cmdline)
 {
+	void *fdt;
+
 	strcpy(pathname, "/proc/device-tree/");
 
 	dt_cur_size = INIT_TREE_WORDS;
@@ -821,7 +1083,13 @@ void create_flatten_tree(char **bufp, off_t *sizep, const char *cmdline)
 	if (cmdline)
 		strcpy(local_cmdline, cmdline);
 
-	putnode();
+	fdt = dt_snapshot ? read_fdt_snapshot() : NULL;
+	if (fdt) {
+		putnode_fdt(fdt, 0);
+		free(fdt);
+	} else {
+		putnode();
+	}
 	dt_reserve(&dt, 1);
 	*dt++ = cpu_to_be32(9);
 
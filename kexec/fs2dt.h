@@ -32,6 +32,7 @@ extern struct bootblock bb[1];
  * Only has implemented for PPC64 */
 int my_debug;
 extern int dt_no_old_root;
+extern int dt_snapshot;
 
 void reserve(unsigned long long where, unsigned long long length);
 void create_flatten_tree(char **, off_t *, const char *);
@@ -135,6 +135,103 @@ static struct mem_rela elf_rela(struct mem_ehdr *ehdr, const unsigned char *ptr)
 	return rela;
 }
 
+/*
+ * The global symbols of an ET_REL object by name.  The arch purgatory
+ * setup looks up dozens of symbols per load, so hash them once rather
+ * than walking every symbol table on each lookup.
+ */
+struct elf_sym_index {
+	unsigned int size;		/* a power of two */
+	struct elf_sym_slot {
+		const char *name;	/* NULL for an empty slot */
+		unsigned int hash;
+		struct mem_sym sym;
+	} slot[];
+};
+
+static unsigned int elf_sym_hash(const char *name)
+{
+	unsigned int hash = 2166136261U;
+
+	while (*name)
+		hash = (hash ^ (unsigned char)*name++) * 16777619U;
+	return hash;
+}
+
+static int elf_sym_index_lookup(const struct elf_sym_index *idx,
+	const char *name, struct mem_sym *ret_sym)
+{
+	unsigned int hash = elf_sym_hash(name);
+	unsigned int i;
+
+	for (i = hash & (idx->size - 1); idx->slot[i].name;
+	     i = (i + 1) & (idx->size - 1)) {
+		if (idx->slot[i].hash == hash &&
+		    strcmp(idx->slot[i].name, name) == 0) {
+			*ret_sym = idx->slot[i].sym;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static void build_elf_sym_index(struct mem_ehdr *ehdr)
+{
+	struct mem_shdr *shdr, *shdr_end;
+	struct elf_sym_index *idx;
+	size_t sym_size = elf_sym_size(ehdr);
+	unsigned int nr_syms = 0, nr_global = 0, size = 16;
+
+	shdr_end = &ehdr->e_shdr[ehdr->e_shnum];
+	for (shdr = ehdr->e_shdr; shdr != shdr_end; shdr++) {
+		if (shdr->sh_type == SHT_SYMTAB && sym_size)
+			nr_syms += shdr->sh_size / sym_size;
+	}
+	/* Keep the table at most half full */
+	while (size < 2 * nr_syms)
+		size *= 2;
+	idx = xmalloc(sizeof(*idx) + size * sizeof(idx->slot[0]));
+	memset(idx, 0, sizeof(*idx) + size * sizeof(idx->slot[0]));
+	idx->size = size;
+
+	/* The first definition wins, as it did with the linear search */
+	for (shdr = ehdr->e_shdr; shdr != shdr_end; shdr++) {
+		const char *strtab;
+		const unsigned char *ptr, *sym_end;
+
+		if (shdr->sh_type != SHT_SYMTAB || !sym_size)
+			continue;
+		if (shdr->sh_link > ehdr->e_shnum)
+			continue;
+		strtab = (char *)ehdr->e_shdr[shdr->sh_link].sh_data;
+		sym_end = shdr->sh_data + shdr->sh_size;
+		for (ptr = shdr->sh_data; ptr < sym_end; ptr += sym_size) {
+			struct mem_sym sym = elf_sym(ehdr, ptr);
+			const char *name;
+			unsigned int hash, i;
+
+			if (ELF32_ST_BIND(sym.st_info) != STB_GLOBAL)
+				continue;
+			name = strtab + sym.st_name;
+			hash = elf_sym_hash(name);
+			for (i = hash & (size - 1); idx->slot[i].name;
+			     i = (i + 1) & (size - 1)) {
+				if (idx->slot[i].hash == hash &&
+				    strcmp(idx->slot[i].name, name) == 0)
+					break;
+			}
+			if (idx->slot[i].name)
+				continue;
+			idx->slot[i].name = name;
+			idx->slot[i].hash = hash;
+			idx->slot[i].sym = sym;
+			nr_global++;
+		}
+	}
+	dbgprintf("%s: %u global symbols\n", __func__, nr_global);
+	ehdr->e_symidx = idx;
+}
+
 int build_elf_rel_info(const char *buf, off_t len, struct mem_ehdr *ehdr,
 				uint32_t flags)
 {
@@ -165,6 +262,7 @@ int build_elf_rel_info(const char *buf, off_t len, struct mem_ehdr *ehdr,
 		}
 		return -1;
 	}
+	build_elf_sym_index(ehdr);
 	return 0;
 }
 
@@ -435,7 +533,7 @@ void elf_rel_build_load(struct kexec_info *info, struct mem_ehdr *ehdr,
 	}
 }
 
-int elf_rel_find_symbol(struct mem_ehdr *ehdr,
+static int elf_rel_scan_symbol(struct mem_ehdr *ehdr,
 	const char *name, struct mem_sym *ret_sym)
 {
 	struct mem_shdr *shdr, *shdr_end;
@@ -470,12 +568,6 @@ int elf_rel_find_symbol(struct mem_ehdr *ehdr,
 			if (strcmp(strtab + sym.st_name, name) != 0) {
 				continue;
 			}
-			if ((sym.st_shndx == STN_UNDEF) ||
-				(sym.st_shndx > ehdr->e_shnum))
-			{
-				die("Symbol: %s has Bad section index %d\n",
-					name, sym.st_shndx);
-			}
 			*ret_sym = sym;
 			return 0;
 		}
@@ -485,6 +577,28 @@ int elf_rel_find_symbol(struct mem_ehdr *ehdr,
 
 }
 
+int elf_rel_find_symbol(struct mem_ehdr *ehdr,
+	const char *name, struct mem_sym *ret_sym)
+{
+	struct mem_sym sym;
+	int result;
+
+	if (ehdr->e_symidx)
+		result = elf_sym_index_lookup(ehdr->e_symidx, name, &sym);
+	else
+		result = elf_rel_scan_symbol(ehdr, name, &sym);
+	if (result < 0)
+		return result;
+	if ((sym.st_shndx == STN_UNDEF) ||
+		(sym.st_shndx > ehdr->e_shnum))
+	{
+		die("Symbol: %s has Bad section index %d\n",
+			name, sym.st_shndx);
+	}
+	*ret_sym = sym;
+	return 0;
+}
+
 unsigned long elf_rel_get_addr(struct mem_ehdr *ehdr, const char *name)
 {
 	struct mem_shdr *shdr;
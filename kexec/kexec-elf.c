@@ -752,6 +752,7 @@ void free_elf_info(struct mem_ehdr *ehdr)
 {
 	free(ehdr->e_phdr);
 	free(ehdr->e_shdr);
+	free(ehdr->e_symidx);
 	memset(ehdr, 0, sizeof(*ehdr));
 }
 
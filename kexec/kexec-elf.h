@@ -5,6 +5,7 @@
 #include <sys/types.h>
 
 struct kexec_info;
+struct elf_sym_index;
 
 struct mem_ehdr {
 	unsigned ei_class;
@@ -24,6 +25,7 @@ struct mem_ehdr {
 	struct mem_shdr *e_shdr;
 	struct mem_note *e_note;
 	unsigned long rel_addr, rel_size;
+	struct elf_sym_index *e_symidx;	/* global symbols by name, ET_REL only */
 };
 
 struct mem_phdr {
@@ -12,6 +12,216 @@
 #include "kexec.h"
 #include "crashdump.h"
 
+/*
+ * /proc/iomem is read once and kept as a tree of resources, in the order
+ * the kernel lists them, which is address order among siblings.
+ */
+static struct iomem_cache {
+	const char *path;
+	struct iomem_resource *res;	/* in file order */
+	int nr;
+	struct iomem_resource root;	/* parent of the top level */
+	struct iomem_resource **hash;	/* first resource of each name */
+	unsigned int hash_size;
+} iomem;
+
+static unsigned int iomem_hash(const char *name)
+{
+	unsigned int hash = 2166136261U;
+
+	while (*name)
+		hash = (hash ^ (unsigned char)*name++) * 16777619U;
+	return hash;
+}
+
+static void iomem_link(void)
+{
+	struct iomem_resource *res, *parent, **children;
+	unsigned int bucket;
+	int i;
+
+	/* Give every resource a slice of one array for its children */
+	children = xmalloc(sizeof(*children) * (iomem.nr ? iomem.nr : 1));
+	for (i = 0; i < iomem.nr; i++)
+		iomem.res[i].parent->nr_children++;
+	iomem.root.children = children;
+	children += iomem.root.nr_children;
+	iomem.root.nr_children = 0;
+	for (i = 0; i < iomem.nr; i++) {
+		res = &iomem.res[i];
+		res->children = children;
+		children += res->nr_children;
+		res->nr_children = 0;
+	}
+	for (i = 0; i < iomem.nr; i++) {
+		parent = iomem.res[i].parent;
+		parent->children[parent->nr_children++] = &iomem.res[i];
+	}
+
+	iomem.hash_size = 64;
+	while (iomem.hash_size < (unsigned int)iomem.nr)
+		iomem.hash_size *= 2;
+	iomem.hash = xmalloc(sizeof(*iomem.hash) * iomem.hash_size);
+	memset(iomem.hash, 0, sizeof(*iomem.hash) * iomem.hash_size);
+	/* Backwards, so that every chain comes out in file order */
+	for (i = iomem.nr - 1; i >= 0; i--) {
+		res = &iomem.res[i];
+		bucket = iomem_hash(res->name) & (iomem.hash_size - 1);
+		res->next_name = iomem.hash[bucket];
+		iomem.hash[bucket] = res;
+	}
+}
+
+static int iomem_load(const char *path)
+{
+	struct iomem_resource *res;
+	unsigned long long start, end;
+	char *line = NULL;
+	size_t line_size = 0;
+	int *parent, max = 0, last = -1;
+	int consumed, count, depth, i;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+
+	/* Forget what another file said */
+	for (i = 0; i < iomem.nr; i++)
+		free(iomem.res[i].name);
+	free(iomem.res);
+	free(iomem.root.children);
+	free(iomem.hash);
+	memset(&iomem, 0, sizeof(iomem));
+
+	parent = NULL;
+	while (getline(&line, &line_size, fp) != -1) {
+		count = sscanf(line, "%llx-%llx : %n", &start, &end, &consumed);
+		if (count != 2)
+			continue;
+		if (iomem.nr == max) {
+			max = max ? max * 2 : 256;
+			iomem.res = xrealloc(iomem.res,
+					     sizeof(*iomem.res) * max);
+			parent = xrealloc(parent, sizeof(*parent) * max);
+		}
+		/* Every level of nesting is indented by two more spaces */
+		for (depth = 0; line[depth] == ' '; depth++)
+			;
+		depth /= 2;
+
+		res = &iomem.res[iomem.nr];
+		memset(res, 0, sizeof(*res));
+		res->start = start;
+		res->end = end;
+		res->depth = depth;
+		res->name = strdup(line + consumed);
+		if (!res->name)
+			die("Cannot allocate the iomem name: %s\n",
+			    strerror(errno));
+
+		/* The parent is the closest earlier line indented less */
+		for (i = last; i >= 0 && iomem.res[i].depth >= depth;
+		     i = parent[i])
+			;
+		parent[iomem.nr] = i;
+		last = iomem.nr++;
+	}
+	free(line);
+	fclose(fp);
+
+	iomem.root.depth = -1;
+	for (i = 0; i < iomem.nr; i++)
+		iomem.res[i].parent = parent[i] < 0 ?
+			&iomem.root : &iomem.res[parent[i]];
+	free(parent);
+	iomem_link();
+	iomem.path = path;
+	return 0;
+}
+
+/*
+ * kexec_iomem_resources()
+ *
+ * Return every resource in the file returned by proc_iomem(), in file
+ * order, and their number in nr.  The file is only parsed on the first
+ * call.  Returns NULL if it cannot be read.
+ */
+const struct iomem_resource *kexec_iomem_resources(int *nr)
+{
+	const char *path = proc_iomem();
+
+	if (!iomem.path || strcmp(iomem.path, path) != 0) {
+		if (iomem_load(path) < 0)
+			return NULL;
+	}
+	*nr = iomem.nr;
+	return iomem.res;
+}
+
+/*
+ * kexec_iomem_find()
+ *
+ * Return the first resource called name, which like the names in the
+ * file ends in a newline, or NULL.  The others follow in next_name.
+ */
+const struct iomem_resource *kexec_iomem_find(const char *name)
+{
+	const struct iomem_resource *res;
+	int nr;
+
+	if (!kexec_iomem_resources(&nr))
+		return NULL;
+	res = iomem.hash[iomem_hash(name) & (iomem.hash_size - 1)];
+	while (res && strcmp(res->name, name) != 0)
+		res = res->next_name;
+	return res;
+}
+
+/* Like kexec_iomem_find(), but for the next resource with that name */
+const struct iomem_resource *kexec_iomem_find_next(
+	const struct iomem_resource *res)
+{
+	const char *name = res->name;
+
+	for (res = res->next_name; res; res = res->next_name) {
+		if (strcmp(res->name, name) == 0)
+			break;
+	}
+	return res;
+}
+
+/*
+ * kexec_iomem_lookup()
+ *
+ * Return the innermost resource that contains addr, or NULL.
+ */
+const struct iomem_resource *kexec_iomem_lookup(unsigned long long addr)
+{
+	const struct iomem_resource *res, *found = NULL;
+	int nr, lo, hi, mid;
+
+	if (!kexec_iomem_resources(&nr))
+		return NULL;
+	res = &iomem.root;
+	while (res->nr_children) {
+		/* The last child that starts at or below addr */
+		lo = 0;
+		hi = res->nr_children;
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (res->children[mid]->start <= addr)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo == 0 || res->children[lo - 1]->end < addr)
+			break;
+		res = found = res->children[lo - 1];
+	}
+	return found;
+}
+
 /*
  * kexec_iomem_for_each_line()
  *
@@ -33,38 +243,35 @@ int kexec_iomem_for_each_line(char *match,
 					      unsigned long long length),
 			      void *data)
 {
-	const char *iomem = proc_iomem();
-	char line[MAX_LINE];
-	FILE *fp;
-	unsigned long long start, end, size;
-	char *str;
-	int consumed;
-	int count;
+	const struct iomem_resource *res;
+	int count, i, exact = 0;
 	int nr = 0, ret;
+	size_t len = 0;
 
-	fp = fopen(iomem, "r");
-	if (!fp)
-		die("Cannot open %s\n", iomem);
+	res = kexec_iomem_resources(&count);
+	if (!res)
+		die("Cannot open %s\n", proc_iomem());
 
-	while(fgets(line, sizeof(line), fp) != 0) {
-		count = sscanf(line, "%llx-%llx : %n", &start, &end, &consumed);
-		if (count != 2)
-			continue;
-		str = line + consumed;
-		size = end - start + 1;
-		if (!match || memcmp(str, match, strlen(match)) == 0) {
+	/* A match ending in a newline is a whole name, so use the index */
+	if (match) {
+		len = strlen(match);
+		exact = len && match[len - 1] == '\n';
+		res = exact ? kexec_iomem_find(match) : res;
+	}
+	for (i = 0; res && i < count; i++) {
+		if (!match || strncmp(res->name, match, len) == 0) {
 			if (callback) {
-				ret = callback(data, nr, str, start, size);
+				ret = callback(data, nr, res->name, res->start,
+					       res->end - res->start + 1);
 				if (ret < 0)
 					break;
 				else if (ret == 0)
 					nr++;
 			}
 		}
+		res = exact ? kexec_iomem_find_next(res) : res + 1;
 	}
 
-	fclose(fp);
-
 	return nr;
 }
 
@@ -3,6 +3,8 @@
 
 #include <sys/types.h>
 
+int is_lzma_buffer(const char *buf, off_t size);
+char *lzma_decompress_buffer(const char *in, off_t in_size, off_t *r_size);
 char *lzma_decompress_file(const char *filename, off_t *r_size);
 
 #endif /* __KEXEC_LZMA_H */
@@ -0,0 +1,461 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sha256.h>
+#include <crc32c.h>
+#include "kexec.h"
+#include "kexec-plan.h"
+
+/*
+ * On disk a plan is a header, a segment table and then the contents of
+ * each segment at a page aligned offset, so that loading it is an mmap()
+ * of the file.  Plans are only ever read back on the machine (and boot)
+ * that wrote them, so everything is in host byte order.
+ */
+#define PLAN_MAGIC	"KEXECPLN"
+#define PLAN_VERSION	3
+
+struct plan_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t nr_segments;
+	uint64_t kexec_flags;
+	uint64_t entry;
+	uint8_t fingerprint[32];
+	uint32_t data_crc;		/* crc32c of all the segment contents */
+	uint32_t pad;
+};
+
+struct plan_segment {
+	uint64_t mem;
+	uint64_t memsz;
+	uint64_t offset;		/* of the contents in the file */
+	uint64_t bufsz;
+	uint32_t flags;
+	uint32_t run;			/* segments the digest covers */
+	uint8_t digest[32];		/* SHA-256 of their contents */
+};
+
+#define PLAN_SEG_DIGEST	1		/* digest is valid */
+
+struct kexec_plan {
+	const char *path;
+	const char *map;
+	size_t size;
+	const struct plan_header *hdr;
+	const struct plan_segment *seg;
+};
+
+/* Region digests update_purgatory() worked out for plan_save() */
+static struct noted_digest {
+	const void *mem;
+	size_t bufsz;
+	int run;
+	sha256_digest_t digest;
+} *noted;
+static int nr_noted;
+
+/*
+ * Things the segments are built from that are not named on the command
+ * line.  A memory or cpu hotplug, a different crashkernel= size or a
+ * reboot all change at least one of them.  fs2dt builds the dtb from the
+ * live device tree, which DLPAR and partition migration rewrite in place,
+ * so that is hashed whole; it does not exist where it is not used.
+ */
+static const char *plan_sources[] = {
+	"/proc/sys/kernel/random/boot_id",
+	"/proc/iomem",
+	"/proc/cmdline",
+	"/sys/kernel/kexec_crash_size",
+	"/sys/kernel/vmcoreinfo",
+	"/sys/kernel/boot_params/data",
+	"/sys/devices/system/cpu/possible",
+	"/sys/devices/system/cpu/present",
+	"/sys/devices/system/cpu/online",
+	"/sys/firmware/memmap",
+	"/proc/device-tree",
+};
+
+static void hash_str(sha256_context *ctx, const char *str)
+{
+	/* Include the terminator so that "ab" "c" differs from "a" "bc" */
+	sha256_update(ctx, (const uint8_t *)str, strlen(str) + 1);
+}
+
+static void hash_contents(sha256_context *ctx, const char *path)
+{
+	uint8_t buf[4096];
+	ssize_t len;
+	int fd;
+
+	hash_str(ctx, path);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return;
+	while ((len = read(fd, buf, sizeof(buf))) > 0)
+		sha256_update(ctx, buf, len);
+	close(fd);
+}
+
+/* Every file below path, in name order */
+static void hash_tree(sha256_context *ctx, const char *path)
+{
+	struct dirent **names;
+	char *child;
+	struct stat st;
+	int i, n;
+
+	if (stat(path, &st) < 0)
+		return;
+	if (!S_ISDIR(st.st_mode)) {
+		hash_contents(ctx, path);
+		return;
+	}
+	n = scandir(path, &names, NULL, alphasort);
+	for (i = 0; i < n; i++) {
+		if (names[i]->d_name[0] != '.') {
+			if (asprintf(&child, "%s/%s", path,
+				     names[i]->d_name) < 0)
+				die("Out of memory\n");
+			hash_tree(ctx, child);
+			free(child);
+		}
+		free(names[i]);
+	}
+	if (n >= 0)
+		free(names);
+}
+
+/* Which file it is and which version of it, rather than what is in it */
+static void hash_file_id(sha256_context *ctx, const char *path)
+{
+	struct stat st;
+	uint64_t id[5];
+
+	if (stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+		return;
+	id[0] = st.st_dev;
+	id[1] = st.st_ino;
+	id[2] = st.st_size;
+	id[3] = st.st_mtim.tv_sec;
+	id[4] = st.st_mtim.tv_nsec;
+	hash_str(ctx, path);
+	sha256_update(ctx, (const uint8_t *)id, sizeof(id));
+}
+
+/**
+ * plan_fingerprint() - summarise what a load depends on
+ * @argc: argument count
+ * @argv: the kexec command line
+ * @kexec_flags: flags the load is made with
+ * @digest: the fingerprint
+ *
+ * Covers the command line, bar the plan options themselves, the identity
+ * of kexec and of every file it names (kernel, initrd, dtb, ...), and
+ * the system state listed in plan_sources[].
+ */
+void plan_fingerprint(int argc, char **argv, unsigned long kexec_flags,
+		      sha256_digest_t digest)
+{
+	sha256_context ctx;
+	uint64_t flags = kexec_flags;
+	const char *arg;
+	size_t i;
+	int n;
+
+	sha256_starts(&ctx);
+	sha256_update(&ctx, (const uint8_t *)&flags, sizeof(flags));
+	hash_file_id(&ctx, "/proc/self/exe");
+	for (n = 1; n < argc; n++) {
+		arg = argv[n];
+		if (strcmp(arg, "--save-plan") == 0 ||
+		    strcmp(arg, "--load-plan") == 0) {
+			n++;
+			continue;
+		}
+		if (strncmp(arg, "--save-plan=", 12) == 0 ||
+		    strncmp(arg, "--load-plan=", 12) == 0)
+			continue;
+		hash_str(&ctx, arg);
+		if (arg[0] == '-' && strchr(arg, '='))
+			arg = strchr(arg, '=') + 1;
+		hash_file_id(&ctx, arg);
+	}
+	for (i = 0; i < sizeof(plan_sources) / sizeof(plan_sources[0]); i++)
+		hash_tree(&ctx, plan_sources[i]);
+	sha256_finish(&ctx, digest);
+}
+
+/**
+ * plan_open() - map a saved plan
+ * @path: the plan file
+ *
+ * Returns %NULL if there is no plan at @path.
+ */
+struct kexec_plan *plan_open(const char *path)
+{
+	struct kexec_plan *plan;
+	const struct plan_header *hdr;
+	const struct plan_segment *seg;
+	const char *map;
+	struct stat st;
+	uint64_t table_end;
+	unsigned int i;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		dbgprintf("%s: %s: %s\n", __func__, path, strerror(errno));
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*hdr)) {
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	hdr = (const struct plan_header *)map;
+	seg = (const struct plan_segment *)(hdr + 1);
+	table_end = sizeof(*hdr) + (uint64_t)hdr->nr_segments * sizeof(*seg);
+	if (memcmp(hdr->magic, PLAN_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    hdr->version != PLAN_VERSION ||
+	    table_end > (uint64_t)st.st_size) {
+		fprintf(stderr, "%s is not a kexec load plan\n", path);
+		goto fail;
+	}
+	for (i = 0; i < hdr->nr_segments; i++) {
+		if (seg[i].offset > (uint64_t)st.st_size ||
+		    seg[i].bufsz > (uint64_t)st.st_size - seg[i].offset ||
+		    seg[i].bufsz > seg[i].memsz) {
+			fprintf(stderr, "%s: bad segment %u\n", path, i);
+			goto fail;
+		}
+	}
+
+	plan = xmalloc(sizeof(*plan));
+	plan->path = path;
+	plan->map = map;
+	plan->size = st.st_size;
+	plan->hdr = hdr;
+	plan->seg = seg;
+	return plan;
+fail:
+	munmap((void *)map, st.st_size);
+	return NULL;
+}
+
+/**
+ * plan_load() - fill in a load from a saved plan
+ * @plan: the plan
+ * @digest: fingerprint of the load being asked for
+ * @info: where the segments, entry point and flags go
+ *
+ * The segment contents stay mapped from the file, so @info must not
+ * outlive the process.  Returns %0 on success, or %-1 if @plan is not
+ * for this load, in which case @info is untouched.
+ */
+int plan_load(const struct kexec_plan *plan, const sha256_digest_t digest,
+	      struct kexec_info *info)
+{
+	const struct plan_header *hdr = plan->hdr;
+	const struct plan_segment *seg = plan->seg;
+	struct kexec_segment *segment;
+	uint32_t crc = 0;
+	unsigned int i;
+
+	if (memcmp(hdr->fingerprint, digest, sizeof(hdr->fingerprint)) != 0) {
+		dbgprintf("%s: %s is out of date\n", __func__, plan->path);
+		return -1;
+	}
+	for (i = 0; i < hdr->nr_segments; i++)
+		crc = crc32c(crc, plan->map + seg[i].offset, seg[i].bufsz);
+	if (crc != hdr->data_crc) {
+		fprintf(stderr, "%s: segment contents are corrupt\n",
+			plan->path);
+		return -1;
+	}
+
+	segment = xmalloc(hdr->nr_segments * sizeof(*segment));
+	for (i = 0; i < hdr->nr_segments; i++) {
+		segment[i].buf = seg[i].bufsz ? plan->map + seg[i].offset : NULL;
+		segment[i].bufsz = seg[i].bufsz;
+		segment[i].mem = (const void *)(unsigned long)seg[i].mem;
+		segment[i].memsz = seg[i].memsz;
+	}
+	info->segment = segment;
+	info->nr_segments = hdr->nr_segments;
+	info->entry = (void *)(unsigned long)hdr->entry;
+	info->kexec_flags = hdr->kexec_flags;
+	return 0;
+}
+
+/**
+ * plan_region_digest() - SHA-256 of a region, if a plan already has it
+ * @plan: the plan, which may be out of date
+ * @seg: the segments the region is made of
+ * @run: how many of them there are
+ * @digest: its digest
+ *
+ * Comparing the contents with the plan's copy is several times cheaper
+ * than hashing them again, which is what makes reloading after a memory
+ * hotplug, when only a few small segments change, quick.  Returns %0 if
+ * the plan has the same region, %-1 otherwise.
+ */
+int plan_region_digest(const struct kexec_plan *plan,
+		       const struct kexec_segment *seg, int run,
+		       sha256_digest_t digest)
+{
+	const struct plan_segment *pseg;
+	unsigned int i;
+	int j;
+
+	if (!plan)
+		return -1;
+	for (i = 0; i < plan->hdr->nr_segments; i++) {
+		pseg = &plan->seg[i];
+		if (pseg->mem == (unsigned long)seg->mem &&
+		    (pseg->flags & PLAN_SEG_DIGEST) && pseg->run == (uint32_t)run)
+			break;
+	}
+	if (i + run > plan->hdr->nr_segments)
+		return -1;
+	for (j = 0, pseg = &plan->seg[i]; j < run; j++, pseg++) {
+		if (pseg->mem != (unsigned long)seg[j].mem ||
+		    pseg->memsz != seg[j].memsz ||
+		    pseg->bufsz != seg[j].bufsz ||
+		    memcmp(plan->map + pseg->offset, seg[j].buf,
+			   seg[j].bufsz))
+			return -1;
+	}
+	memcpy(digest, plan->seg[i].digest, sizeof(sha256_digest_t));
+	return 0;
+}
+
+/**
+ * plan_note_digest() - remember the SHA-256 of a region for plan_save()
+ * @seg: the first segment of the region
+ * @run: how many segments it is made of
+ * @digest: its digest
+ */
+void plan_note_digest(const struct kexec_segment *seg, int run,
+		      const sha256_digest_t digest)
+{
+	noted = xrealloc(noted, (nr_noted + 1) * sizeof(*noted));
+	noted[nr_noted].mem = seg->mem;
+	noted[nr_noted].bufsz = seg->bufsz;
+	noted[nr_noted].run = run;
+	memcpy(noted[nr_noted].digest, digest, sizeof(sha256_digest_t));
+	nr_noted++;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, p, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/**
+ * plan_save() - save a fully laid out load as a plan
+ * @path: the plan file, replaced atomically
+ * @digest: fingerprint of the load
+ * @info: the load, as it is about to be passed to kexec_load()
+ *
+ * Returns %0 on success, %-1 on failure.
+ */
+int plan_save(const char *path, const sha256_digest_t digest,
+	      const struct kexec_info *info)
+{
+	struct plan_header hdr;
+	struct plan_segment *seg;
+	uint64_t offset;
+	long page_size = getpagesize();
+	char *tmp;
+	int i, j, fd;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, PLAN_MAGIC, sizeof(hdr.magic));
+	hdr.version = PLAN_VERSION;
+	hdr.nr_segments = info->nr_segments;
+	hdr.kexec_flags = info->kexec_flags;
+	hdr.entry = (unsigned long)info->entry;
+	memcpy(hdr.fingerprint, digest, sizeof(hdr.fingerprint));
+
+	seg = xmalloc(info->nr_segments * sizeof(*seg) + 1);
+	offset = sizeof(hdr) + info->nr_segments * sizeof(*seg);
+	for (i = 0; i < info->nr_segments; i++) {
+		offset = _ALIGN(offset, page_size);
+		seg[i].mem = (unsigned long)info->segment[i].mem;
+		seg[i].memsz = info->segment[i].memsz;
+		seg[i].offset = offset;
+		seg[i].bufsz = info->segment[i].bufsz;
+		seg[i].flags = 0;
+		seg[i].run = 0;
+		memset(seg[i].digest, 0, sizeof(seg[i].digest));
+		for (j = 0; j < nr_noted; j++) {
+			if (noted[j].mem == info->segment[i].mem &&
+			    noted[j].bufsz == info->segment[i].bufsz) {
+				seg[i].flags |= PLAN_SEG_DIGEST;
+				seg[i].run = noted[j].run;
+				memcpy(seg[i].digest, noted[j].digest,
+				       sizeof(seg[i].digest));
+			}
+		}
+		hdr.data_crc = crc32c(hdr.data_crc, info->segment[i].buf,
+				      info->segment[i].bufsz);
+		offset += seg[i].bufsz;
+	}
+
+	if (asprintf(&tmp, "%s.tmp", path) < 0)
+		die("Out of memory\n");
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		goto fail;
+	if (write_all(fd, &hdr, sizeof(hdr)) < 0 ||
+	    write_all(fd, seg, info->nr_segments * sizeof(*seg)) < 0)
+		goto fail_close;
+	for (i = 0; i < info->nr_segments; i++) {
+		/* The padding up to each segment is left as a hole */
+		if (lseek(fd, seg[i].offset, SEEK_SET) < 0 ||
+		    write_all(fd, info->segment[i].buf, seg[i].bufsz) < 0)
+			goto fail_close;
+	}
+	if (fsync(fd) < 0 || close(fd) < 0)
+		goto fail;
+	if (rename(tmp, path) < 0)
+		goto fail;
+	free(tmp);
+	free(seg);
+	return 0;
+fail_close:
+	close(fd);
+fail:
+	fprintf(stderr, "Cannot save load plan %s: %s\n", path,
+		strerror(errno));
+	unlink(tmp);
+	free(tmp);
+	free(seg);
+	return -1;
+}
@@ -0,0 +1,30 @@
+#ifndef KEXEC_PLAN_H
+#define KEXEC_PLAN_H
+
+#include <sha256.h>
+
+struct kexec_info;
+struct kexec_segment;
+struct kexec_plan;
+
+/*
+ * A load plan is the segment list and entry point my_load() hands to
+ * kexec_load(), saved together with a fingerprint of everything it was
+ * built from, so that the same load can be repeated without redoing it.
+ * A plan that is out of date still saves rehashing the regions that
+ * have not changed.
+ */
+void plan_fingerprint(int argc, char **argv, unsigned long kexec_flags,
+		      sha256_digest_t digest);
+struct kexec_plan *plan_open(const char *path);
+int plan_load(const struct kexec_plan *plan, const sha256_digest_t digest,
+	      struct kexec_info *info);
+int plan_region_digest(const struct kexec_plan *plan,
+		       const struct kexec_segment *seg, int run,
+		       sha256_digest_t digest);
+void plan_note_digest(const struct kexec_segment *seg, int run,
+		      const sha256_digest_t digest);
+int plan_save(const char *path, const sha256_digest_t digest,
+	      const struct kexec_info *info);
+
+#endif /* KEXEC_PLAN_H */
@@ -1,11 +1,25 @@
 #ifndef KEXEC_SHA256_H
 #define KEXEC_SHA256_H
 
+/*
+ * Purgatory finds a table of these at sha256_regions, one for each run of
+ * segments that follow on from each other, other than its own.  The
+ * table is placed in a segment of its own, which is not in the table.
+ */
 struct sha256_region {
 	uint64_t start;
 	uint64_t len;
+	/* How many bytes at the end of the region are zero fill.  They
+	 * are checked to be zero rather than hashed. */
+	uint64_t zero_len;
+	/* CRC-32C of the rest, with VERIFY_CRC32C */
+	uint32_t crc;
+	uint32_t pad;
 };
 
-#define SHA256_REGIONS 16
+/* How purgatory checks the loaded image (verify_mode) */
+#define VERIFY_SHA256	0	/* a SHA-256 digest of each region's SHA-256 */
+#define VERIFY_CRC32C	1	/* a CRC-32C per region */
+#define VERIFY_NONE	2
 
 #endif /* KEXEC_SHA256_H */
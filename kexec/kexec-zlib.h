@@ -7,5 +7,7 @@
 #include "config.h"
 
 int is_zlib_file(const char *filename, off_t *r_size);
+int is_gzip_buffer(const char *buf, off_t size);
+char *zlib_decompress_buffer(const char *in, off_t in_size, off_t *r_size);
 char *zlib_decompress_file(const char *filename, off_t *r_size);
 #endif /* __KEXEC_ZLIB_H */
@@ -47,8 +47,10 @@
 #include "kexec-syscall.h"
 #include "kexec-elf.h"
 #include "kexec-sha256.h"
+#include <crc32c.h>
 #include "kexec-zlib.h"
 #include "kexec-lzma.h"
+#include "kexec-plan.h"
 #include <arch/options.h>
 
 #define KEXEC_LOADED_PATH "/sys/kernel/kexec_loaded"
@@ -59,6 +61,11 @@ unsigned long long mem_max = ULONG_MAX;
 static unsigned long kexec_flags = 0;
 /* Flags for kexec file (fd) based syscall */
 static unsigned long kexec_file_flags = 0;
+/* How purgatory checks the image, see kexec-sha256.h */
+static uint32_t purgatory_verify = VERIFY_SHA256;
+/* --save-plan and --load-plan, see kexec-plan.h */
+static const char *save_plan;
+static const char *load_plan;
 int kexec_debug = 0;
 
 void dbgprint_mem_range(const char *prefix, struct memory_range *mr, int nr_mr)
@@ -172,48 +179,112 @@ void print_segments(FILE *f, struct kexec_info *info)
 	}
 }
 
-int sort_segments(struct kexec_info *info)
+static int segment_cmp(const void *a1, const void *a2)
+{
+	const struct kexec_segment *s1 = a1;
+	const struct kexec_segment *s2 = a2;
+
+	if (s1->mem > s2->mem)
+		return 1;
+	if (s1->mem < s2->mem)
+		return -1;
+	return 0;
+}
+
+static int segments_overlap(struct kexec_info *info, int i)
 {
-	int i, j;
 	void *end;
 
-	/* Do a stupid insertion sort... */
-	for (i = 0; i < info->nr_segments; i++) {
-		int tidx;
-		struct kexec_segment temp;
-		tidx = i;
-		for (j = i +1; j < info->nr_segments; j++) {
-			if (info->segment[j].mem < info->segment[tidx].mem) {
-				tidx = j;
-			}
-		}
-		if (tidx != i) {
-			temp = info->segment[tidx];
-			info->segment[tidx] = info->segment[i];
-			info->segment[i] = temp;
-		}
+	end = ((char *)info->segment[i - 1].mem) + info->segment[i - 1].memsz;
+	if (end > info->segment[i].mem) {
+		fprintf(stderr, "Overlapping memory segments at %p\n", end);
+		return 1;
 	}
+	return 0;
+}
+
+int sort_segments(struct kexec_info *info)
+{
+	int i;
+
+	qsort(info->segment, info->nr_segments, sizeof(info->segment[0]),
+	      segment_cmp);
+	info->sorted_segments = info->nr_segments;
+
 	/* Now see if any of the segments overlap */
-	end = 0;
-	for (i = 0; i < info->nr_segments; i++) {
-		if (end > info->segment[i].mem) {
-			fprintf(stderr, "Overlapping memory segments at %p\n",
-				end);
+	for (i = 1; i < info->nr_segments; i++) {
+		if (segments_overlap(info, i))
 			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Sort the segments added since the last sort in among the ones that
+ * already are, checking each only against its new neighbours.
+ */
+static int sort_new_segments(struct kexec_info *info)
+{
+	struct kexec_segment temp;
+	int lo, hi, mid, n;
+
+	if (info->sorted_segments > info->nr_segments)
+		return sort_segments(info);
+
+	for (n = info->sorted_segments; n < info->nr_segments; n++) {
+		temp = info->segment[n];
+		lo = 0;
+		hi = n;
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (info->segment[mid].mem <= temp.mem)
+				lo = mid + 1;
+			else
+				hi = mid;
 		}
-		end = ((char *)info->segment[i].mem) + info->segment[i].memsz;
+		memmove(&info->segment[lo + 1], &info->segment[lo],
+			(n - lo) * sizeof(info->segment[0]));
+		info->segment[lo] = temp;
+		info->sorted_segments = n + 1;
+		if ((lo > 0 && segments_overlap(info, lo)) ||
+		    (lo < n && segments_overlap(info, lo + 1)))
+			return -1;
 	}
 	return 0;
 }
 
+/*
+ * Bring the free ranges up to date with the memory ranges and segments.
+ * Segments only ever get added, so normally that is just taking the new
+ * ones out; anything else means starting over.
+ */
+static void update_free_ranges(struct kexec_info *info)
+{
+	struct free_ranges *ranges = &info->free_ranges;
+	int i;
+
+	if (ranges->memory_range != info->memory_range ||
+	    ranges->memory_ranges != info->memory_ranges ||
+	    ranges->nr_segments > info->nr_segments)
+		free_ranges_init(ranges, info->memory_range,
+				 info->memory_ranges);
+
+	for (i = ranges->nr_segments; i < info->nr_segments; i++) {
+		unsigned long sstart, send;
+
+		sstart = (unsigned long)info->segment[i].mem;
+		send = sstart + info->segment[i].memsz - 1;
+		free_ranges_exclude(ranges, sstart, send);
+	}
+	ranges->nr_segments = info->nr_segments;
+}
+
 unsigned long locate_hole(struct kexec_info *info,
 	unsigned long hole_size, unsigned long hole_align, 
 	unsigned long hole_min, unsigned long hole_max, 
 	int hole_end)
 {
-	int i, j;
-	struct memory_range *mem_range;
-	int max_mem_ranges, mem_ranges;
+	unsigned long long min, max, base;
 	unsigned long hole_base;
 
 	if (hole_end == 0) {
@@ -229,76 +300,15 @@ unsigned long locate_hole(struct kexec_info *info,
 	}
 
 	/* Compute the free memory ranges */
-	max_mem_ranges = info->memory_ranges + info->nr_segments;
-	mem_range = xmalloc(max_mem_ranges *sizeof(struct memory_range));
-	mem_ranges = 0;
-		
-	/* Perform a merge on the 2 sorted lists of memory ranges  */
-	for (j = 0, i = 0; i < info->memory_ranges; i++) {
-		unsigned long long sstart, send;
-		unsigned long long mstart, mend;
-		mstart = info->memory_range[i].start;
-		mend = info->memory_range[i].end;
-		if (info->memory_range[i].type != RANGE_RAM)
-			continue;
-		while ((j < info->nr_segments) &&
-		       (((unsigned long)info->segment[j].mem) <= mend)) {
-			sstart = (unsigned long)info->segment[j].mem;
-			send = sstart + info->segment[j].memsz -1;
-			if (mstart < sstart) {
-				mem_range[mem_ranges].start = mstart;
-				mem_range[mem_ranges].end = sstart -1;
-				mem_range[mem_ranges].type = RANGE_RAM;
-				mem_ranges++;
-			}
-			mstart = send +1;
-			j++;
-		}
-		if (mstart < mend) {
-			mem_range[mem_ranges].start = mstart;
-			mem_range[mem_ranges].end = mend;
-			mem_range[mem_ranges].type = RANGE_RAM;
-			mem_ranges++;
-		}
-	}
-	/* Now find the end of the last memory_range I can use */
-	for (i = 0; i < mem_ranges; i++) {
-		unsigned long long start, end, size;
-		start = mem_range[i].start;
-		end   = mem_range[i].end;
-		/* First filter the range start and end values
-		 * through the lens of mem_min, mem_max and hole_align.
-		 */
-		if (start < mem_min) {
-			start = mem_min;
-		}
-		if (start < hole_min) {
-			start = hole_min;
-		}
-		start = _ALIGN(start, hole_align);
-		if (end > mem_max) {
-			end = mem_max;
-		}
-		if (end > hole_max) {
-			end = hole_max;
-		}
-		/* Is this still a valid memory range? */
-		if ((start >= end) || (start >= mem_max) || (end <= mem_min)) {
-			continue;
-		}
-		/* Is there enough space left so we can use it? */
-		size = end - start;
-		if (!hole_size || size >= hole_size - 1) {
-			if (hole_end > 0) {
-				hole_base = start;
-				break;
-			} else {
-				hole_base = _ALIGN_DOWN(end - hole_size + 1,
-					hole_align);
-			}
-		}
-	}
-	free(mem_range);
+	update_free_ranges(info);
+
+	/* Look only where mem_min, mem_max, hole_min and hole_max allow */
+	min = mem_min > hole_min ? mem_min : hole_min;
+	max = mem_max < hole_max ? mem_max : hole_max;
+	if (free_ranges_find(&info->free_ranges, hole_size, hole_align,
+			     min, max, hole_end < 0, &base))
+		hole_base = base;
+
 	if (hole_base == ULONG_MAX) {
 		fprintf(stderr, "Could not find a free area of memory of "
 			"0x%lx bytes...\n", hole_size);
@@ -358,6 +368,9 @@ void add_segment_phys_virt(struct kexec_info *info,
 	info->segment[info->nr_segments].mem   = (void *)base;
 	info->segment[info->nr_segments].memsz = memsz;
 	info->nr_segments++;
+	/* Keep the free ranges in step, once locate_hole() has built them */
+	if (info->free_ranges.memory_range)
+		update_free_ranges(info);
 	if (info->nr_segments > KEXEC_MAX_SEGMENTS) {
 		fprintf(stderr, "Warning: kernel segment limit reached. "
 			"This will likely fail\n");
@@ -373,7 +386,7 @@ unsigned long add_buffer_phys_virt(struct kexec_info *info,
 	int result;
 	int pagesize;
 
-	result = sort_segments(info);
+	result = sort_new_segments(info);
 	if (result < 0) {
 		die("sort_segments failed\n");
 	}
@@ -521,13 +534,14 @@ static char *slurp_fd(int fd, const char *filename, off_t size, off_t *nread)
 }
 
 static char *slurp_file_generic(const char *filename, off_t *r_size,
-				int use_mmap)
+				int use_mmap, int *mapped)
 {
 	int fd;
 	char *buf;
 	off_t size, err, nread;
 	ssize_t result;
 	struct stat stats;
+	int map = 0;
 
 	if (!filename) {
 		*r_size = 0;
@@ -568,20 +582,25 @@ static char *slurp_file_generic(const char *filename, off_t *r_size,
 		buf = slurp_fd(fd, filename, size, &nread);
 	} else {
 		size = stats.st_size;
-		if (use_mmap) {
+		/* There is nothing to map in an empty file */
+		map = use_mmap && size != 0;
+		if (map) {
 			buf = mmap(NULL, size, PROT_READ|PROT_WRITE,
 				   MAP_PRIVATE, fd, 0);
 			nread = size;
+			close(fd);
 		} else {
 			buf = slurp_fd(fd, filename, size, &nread);
 		}
 	}
-	if ((use_mmap && (buf == MAP_FAILED)) || (!use_mmap && (buf == NULL)))
+	if ((map && (buf == MAP_FAILED)) || (!map && (buf == NULL)))
 		die("Cannot read %s", filename);
 
 	if (nread != size)
 		die("Read on %s ended before stat said it should\n", filename);
 
+	if (mapped)
+		*mapped = map;
 	*r_size = size;
 	return buf;
 }
@@ -591,7 +610,7 @@ static char *slurp_file_generic(const char *filename, off_t *r_size,
  */
 char *slurp_file(const char *filename, off_t *r_size)
 {
-	return slurp_file_generic(filename, r_size, 0);
+	return slurp_file_generic(filename, r_size, 0, NULL);
 }
 
 /*
@@ -600,7 +619,24 @@ char *slurp_file(const char *filename, off_t *r_size)
  */
 char *slurp_file_mmap(const char *filename, off_t *r_size)
 {
-	return slurp_file_generic(filename, r_size, 1);
+	return slurp_file_generic(filename, r_size, 1, NULL);
+}
+
+/*
+ * Like slurp_file_mmap(), but also say whether the buffer was mapped, so
+ * that slurp_file_release() can give it back.
+ */
+char *slurp_file_map(const char *filename, off_t *r_size, int *mapped)
+{
+	return slurp_file_generic(filename, r_size, 1, mapped);
+}
+
+void slurp_file_release(char *buf, off_t size, int mapped)
+{
+	if (mapped)
+		munmap(buf, size);
+	else
+		free(buf);
 }
 
 /* This functions reads either specified number of bytes from the file or
@@ -622,64 +658,197 @@ char *slurp_file_len(const char *filename, off_t size, off_t *nread)
 	return slurp_fd(fd, filename, size, nread);
 }
 
-char *slurp_decompress_file(const char *filename, off_t *r_size)
+/* Deflate never gets better than this, and xz on a kernel nowhere near */
+#define DECOMPRESS_HINT_RATIO	1032
+#define DECOMPRESS_HINT_MAX	(UINT64_C(1) << 30)
+
+/*
+ * Allocate the first output buffer of a decompressor.  hint is the
+ * uncompressed size the compressed header claims, 0 if it has none.
+ * It comes from the image, which may not even be compressed, so it is
+ * only taken up to what in_size bytes could plausibly expand to and a
+ * fixed ceiling, and a failed allocation drops back to a small buffer
+ * the caller grows as before.
+ */
+char *decompress_alloc(uint64_t hint, off_t in_size, off_t *allocated)
 {
-	char *kernel_buf;
+	char *buf;
+
+	if (hint > (uint64_t)in_size * DECOMPRESS_HINT_RATIO)
+		hint = (uint64_t)in_size * DECOMPRESS_HINT_RATIO;
+	if (hint > DECOMPRESS_HINT_MAX)
+		hint = DECOMPRESS_HINT_MAX;
+	if (hint > 65536) {
+		buf = malloc(hint);
+		if (buf) {
+			*allocated = hint;
+			return buf;
+		}
+		dbgprintf("Cannot malloc %llu bytes for decompression, "
+			  "growing the buffer instead\n",
+			  (unsigned long long)hint);
+	} else if (hint) {
+		*allocated = hint;
+		return xmalloc(hint);
+	}
+	*allocated = 65536;
+	return xmalloc(*allocated);
+}
+
+/*
+ * Read a kernel or initrd, decompressing it if need be.  The file is
+ * mapped once and its format told from its first bytes, so it is only
+ * ever handed to the one decoder that can take it.  Compressed files come
+ * back in a malloced buffer; anything else is returned as the private
+ * mapping of the file itself, in which case *mapped is set and the buffer
+ * must be given back with slurp_file_release().
+ */
+char *slurp_decompress_file_map(const char *filename, off_t *r_size,
+				int *mapped)
+{
+	char *in, *kernel_buf = NULL;
+	off_t in_size;
+	int in_mapped;
 
-	kernel_buf = zlib_decompress_file(filename, r_size);
+	*mapped = 0;
+	if (!filename) {
+		*r_size = 0;
+		return NULL;
+	}
+	in = slurp_file_map(filename, &in_size, &in_mapped);
+	if (is_gzip_buffer(in, in_size))
+		kernel_buf = zlib_decompress_buffer(in, in_size, r_size);
+	else if (is_lzma_buffer(in, in_size))
+		kernel_buf = lzma_decompress_buffer(in, in_size, r_size);
 	if (!kernel_buf) {
-		kernel_buf = lzma_decompress_file(filename, r_size);
-		if (!kernel_buf)
-			return slurp_file(filename, r_size);
+		/* Not compressed, or not in a way we could undo */
+		*r_size = in_size;
+		*mapped = in_mapped;
+		return in;
 	}
+	slurp_file_release(in, in_size, in_mapped);
 	return kernel_buf;
 }
 
-static void update_purgatory(struct kexec_info *info)
+/*
+ * Like slurp_decompress_file_map(), but always return a malloced buffer.
+ */
+char *slurp_decompress_file(const char *filename, off_t *r_size)
+{
+	char *buf, *copy;
+	int mapped;
+
+	buf = slurp_decompress_file_map(filename, r_size, &mapped);
+	if (!mapped)
+		return buf;
+	copy = xmalloc(*r_size);
+	memcpy(copy, buf, *r_size);
+	slurp_file_release(buf, *r_size, mapped);
+	return copy;
+}
+
+/* SHA-256 of the segments that make up a region, as purgatory sees it */
+static void region_digest(const struct kexec_segment *seg, int run,
+			  const struct kexec_plan *plan,
+			  sha256_digest_t digest)
+{
+	sha256_context ctx;
+	int i;
+
+	if (plan_region_digest(plan, seg, run, digest) < 0) {
+		sha256_starts(&ctx);
+		for (i = 0; i < run; i++)
+			sha256_update(&ctx, seg[i].buf, seg[i].bufsz);
+		sha256_finish(&ctx, digest);
+	}
+	plan_note_digest(seg, run, digest);
+}
+
+static void update_purgatory(struct kexec_info *info,
+			     const struct kexec_plan *plan)
 {
-	static const uint8_t null_buf[256];
 	sha256_context ctx;
-	sha256_digest_t digest;
-	struct sha256_region region[SHA256_REGIONS];
-	int i, j;
+	sha256_digest_t digest, seg_digest;
+	struct sha256_region *region, *r = NULL;
+	uint64_t table = 0, nr_regions = 0;
+	uint32_t mode = purgatory_verify;
+	unsigned long start, end, max = 0, size;
+	int i, first = 0, run = 0;
 	/* Don't do anything if we are not using purgatory */
 	if (!info->rhdr.e_shdr) {
 		return;
 	}
 	arch_update_purgatory(info);
-	memset(region, 0, sizeof(region));
+	region = xmalloc(info->nr_segments * sizeof(*region));
+	memset(digest, 0, sizeof(digest));
+	/* Compute a hash of the loaded kernel, as a hash of the hashes of
+	 * each region so that those of the regions that did not change
+	 * since the last load can be taken from its plan.  The segments
+	 * are sorted, so each one either follows on from the last region
+	 * or starts a new one. */
 	sha256_starts(&ctx);
-	/* Compute a hash of the loaded kernel */
-	for(j = i = 0; i < info->nr_segments; i++) {
-		unsigned long nullsz;
+	for(i = 0; i < info->nr_segments; i++) {
+		struct kexec_segment *seg = &info->segment[i];
+
 		/* Don't include purgatory in the checksum.  The stack
 		 * in the bss will definitely change, and the .data section
 		 * will also change when we poke the sha256_digest in there.
 		 * A very clever/careful person could probably improve this.
 		 */
-		if (info->segment[i].mem == (void *)info->rhdr.rel_addr) {
+		if (seg->mem == (void *)info->rhdr.rel_addr) {
 			continue;
 		}
-		sha256_update(&ctx, info->segment[i].buf,
-			      info->segment[i].bufsz);
-		nullsz = info->segment[i].memsz - info->segment[i].bufsz;
-		while(nullsz) {
-			unsigned long bytes = nullsz;
-			if (bytes > sizeof(null_buf)) {
-				bytes = sizeof(null_buf);
+		start = (unsigned long)seg->mem;
+		if (!r || r->zero_len || r->start + r->len != start ||
+		    first + run != i) {
+			/* Purgatory checks that the zero fill is still
+			 * zero rather than hashing it. */
+			if (r && mode == VERIFY_SHA256) {
+				region_digest(&info->segment[first], run,
+					      plan, seg_digest);
+				sha256_update(&ctx, seg_digest,
+					      sizeof(seg_digest));
 			}
-			sha256_update(&ctx, null_buf, bytes);
-			nullsz -= bytes;
+			r = &region[nr_regions++];
+			memset(r, 0, sizeof(*r));
+			r->start = start;
+			first = i;
+			run = 0;
 		}
-		region[j].start = (unsigned long) info->segment[i].mem;
-		region[j].len   = info->segment[i].memsz;
-		j++;
-	}
-	sha256_finish(&ctx, digest);
-	elf_rel_set_symbol(&info->rhdr, "sha256_regions", &region,
-			   sizeof(region));
+		run++;
+		r->len += seg->memsz;
+		r->zero_len = seg->memsz - seg->bufsz;
+		if (mode == VERIFY_CRC32C)
+			r->crc = crc32c(r->crc, seg->buf, seg->bufsz);
+		end = start + seg->memsz - 1;
+		if (end > max)
+			max = end;
+	}
+	if (mode == VERIFY_SHA256) {
+		if (r) {
+			region_digest(&info->segment[first], run, plan,
+				      seg_digest);
+			sha256_update(&ctx, seg_digest, sizeof(seg_digest));
+		}
+		sha256_finish(&ctx, digest);
+	}
+
+	/* Somewhere purgatory can reach, since it can reach the rest */
+	if (nr_regions) {
+		size = nr_regions * sizeof(*region);
+		table = add_buffer(info, region, size, size,
+				   sizeof(uint64_t), 0, max, -1);
+		dbgprintf("%llu regions to verify, table at 0x%llx\n",
+			  (unsigned long long)nr_regions,
+			  (unsigned long long)table);
+	}
+	elf_rel_set_symbol(&info->rhdr, "sha256_regions", &table,
+			   sizeof(table));
+	elf_rel_set_symbol(&info->rhdr, "sha256_nr_regions", &nr_regions,
+			   sizeof(nr_regions));
 	elf_rel_set_symbol(&info->rhdr, "sha256_digest", &digest,
 			   sizeof(digest));
+	elf_rel_set_symbol(&info->rhdr, "verify_mode", &mode, sizeof(mode));
 }
 
 /*
@@ -696,6 +865,10 @@ static int my_load(const char *type, int fileind, int argc, char **argv,
 	struct kexec_info info;
 	long native_arch;
 	int guess_only = 0;
+	int mapped;
+	sha256_digest_t plan_digest;
+	struct kexec_plan *plan = NULL;
+	int from_plan = 0;
 
 	memset(&info, 0, sizeof(info));
 	info.kexec_flags = kexec_flags;
@@ -706,9 +879,21 @@ static int my_load(const char *type, int fileind, int argc, char **argv,
 		usage();
 		return -1;
 	}
+	if (save_plan || load_plan)
+		plan_fingerprint(argc, argv, kexec_flags, plan_digest);
+	if (load_plan)
+		plan = plan_open(load_plan);
+	if (plan && plan_load(plan, plan_digest, &info) == 0) {
+		dbgprintf("Loading the plan in %s\n", load_plan);
+		from_plan = 1;
+		goto load;
+	}
 	kernel = argv[fileind];
-	/* slurp in the input kernel */
-	kernel_buf = slurp_decompress_file(kernel, &kernel_size);
+	/*
+	 * slurp in the input kernel.  Segments may point into it, so it is
+	 * never given back.
+	 */
+	kernel_buf = slurp_decompress_file_map(kernel, &kernel_size, &mapped);
 
 	dbgprintf("kernel: %p kernel_size: %#llx\n",
 		  kernel_buf, (unsigned long long)kernel_size);
@@ -794,11 +979,13 @@ static int my_load(const char *type, int fileind, int argc, char **argv,
 	if (sort_segments(&info) < 0) {
 		return -1;
 	}
+	free_ranges_release(&info.free_ranges);
 	/* if purgatory is loaded update it */
-	update_purgatory(&info);
+	update_purgatory(&info, plan);
 	if (entry)
 		info.entry = entry;
 
+ load:
 	dbgprintf("kexec_load: entry = %p flags = 0x%lx\n",
 		  info.entry, info.kexec_flags);
 	if (kexec_debug)
@@ -817,6 +1004,9 @@ static int my_load(const char *type, int fileind, int argc, char **argv,
 		fprintf(stderr, "entry       = %p flags = 0x%lx\n", 
 			info.entry, info.kexec_flags);
 		print_segments(stderr, &info);
+	} else if (save_plan && !from_plan) {
+		/* Only a plan the kernel accepted is worth repeating */
+		plan_save(save_plan, plan_digest, &info);
 	}
 	return result;
 }
@@ -1005,6 +1195,14 @@ void usage(void)
 	       "                      preserve context)\n"
 	       "                      to original kernel.\n"
 		   "     --load-hardboot  Load the new kernel and hard boot it.\n"
+	       "     --purgatory-verify=sha256|crc32c|none\n"
+	       "                      How purgatory checks the loaded image\n"
+	       "                      before jumping to it (default sha256).\n"
+	       "     --save-plan=FILE Save the laid out load to FILE.\n"
+	       "     --load-plan=FILE Load what FILE saved if nothing it was\n"
+	       "                      built from has changed, otherwise do\n"
+	       "                      the full load, reusing the hashes of\n"
+	       "                      the segments that did not change.\n"
 	       " -s, --kexec-file-syscall Use file based syscall for kexec operation\n"
 	       " -d, --debug          Enable debugging to help spot a failure.\n"
 	       " -S, --status         Return 0 if the type (by default crash) is loaded.\n"
@@ -1145,6 +1343,62 @@ char *concat_cmdline(const char *base, const char *append)
 }
 
 /* New file based kexec system call related code */
+/* kexec_file_load probes see at most this much of an uncompressed kernel */
+#define KERNEL_PROBE_WINDOW (64*1024)
+
+static int probe_file_type(const char *buf, off_t size)
+{
+	int i;
+
+	for (i = 0; i < file_types; i++) {
+		if (file_type[i].probe(buf, size) >= 0)
+			return i;
+	}
+	return -1;
+}
+
+/*
+ * The kernel cannot take a compressed image, so hand it a deleted
+ * temporary file holding the decompressed one instead.
+ */
+static int kernel_tmpfile(const char *buf, off_t size)
+{
+	char fname[] = "/tmp/kexecXXXXXX";
+	ssize_t result;
+	off_t done;
+	int fd;
+
+	fd = mkstemp(fname);
+	if (fd < 0) {
+		fprintf(stderr, "Cannot create %s: %s\n", fname,
+			strerror(errno));
+		return -1;
+	}
+	for (done = 0; done < size; done += result) {
+		result = write(fd, buf + done, size - done);
+		if (result < 0 && errno == EINTR) {
+			result = 0;
+			continue;
+		}
+		if (result <= 0) {
+			fprintf(stderr, "Cannot write %s: %s\n", fname,
+				strerror(errno));
+			close(fd);
+			unlink(fname);
+			return -1;
+		}
+	}
+	close(fd);
+
+	/* Reopen read only, the kernel refuses a file open for writing */
+	fd = open(fname, O_RDONLY);
+	if (fd < 0)
+		fprintf(stderr, "Cannot open %s: %s\n", fname,
+			strerror(errno));
+	unlink(fname);
+	return fd;
+}
+
 static int do_kexec_file_load(int fileind, int argc, char **argv,
 			unsigned long flags) {
 
@@ -1154,6 +1408,9 @@ static int do_kexec_file_load(int fileind, int argc, char **argv,
 	int ret = 0;
 	char *kernel_buf;
 	off_t kernel_size;
+	char *window;
+	ssize_t window_size;
+	int mapped = 0;
 
 	memset(&info, 0, sizeof(info));
 	info.segment = NULL;
@@ -1185,36 +1442,59 @@ static int do_kexec_file_load(int fileind, int argc, char **argv,
 		return -1;
 	}
 
-	/* slurp in the input kernel */
-	kernel_buf = slurp_decompress_file(kernel, &kernel_size);
+	/*
+	 * The kernel reads the image itself, we only need to know what it
+	 * is.  Probe the first few KiB, which is where every format keeps
+	 * its headers, and only decompress when the image is compressed.
+	 */
+	window = xmalloc(KERNEL_PROBE_WINDOW);
+	do {
+		window_size = pread(kernel_fd, window, KERNEL_PROBE_WINDOW, 0);
+	} while (window_size < 0 && errno == EINTR);
+	if (window_size < 0) {
+		fprintf(stderr, "Cannot read %s: %s\n", kernel,
+				strerror(errno));
+		free(window);
+		close(kernel_fd);
+		return -1;
+	}
 
-	for (i = 0; i < file_types; i++) {
-#ifdef __aarch64__
-		/* handle Image.gz like cases */
-		if (is_zlib_file(kernel, &kernel_size)) {
-			if ((ret = file_type[i].probe(kernel, kernel_size)) >= 0) {
-				kernel_fd = ret;
-				break;
+	if (is_gzip_buffer(window, window_size) ||
+	    is_lzma_buffer(window, window_size)) {
+		free(window);
+		kernel_buf = slurp_decompress_file(kernel, &kernel_size);
+		i = probe_file_type(kernel_buf, kernel_size);
+		if (i >= 0) {
+			close(kernel_fd);
+			kernel_fd = kernel_tmpfile(kernel_buf, kernel_size);
+			if (kernel_fd < 0) {
+				ret = -1;
+				goto out;
 			}
-		} else
-			if (file_type[i].probe(kernel_buf, kernel_size) >= 0)
-				break;
-#else
-		if (file_type[i].probe(kernel_buf, kernel_size) >= 0)
-			break;
-#endif
+		}
+	} else {
+		i = probe_file_type(window, window_size);
+		free(window);
+		/*
+		 * Loaders get the whole image, but in file mode they only
+		 * look at its headers, so a mapping costs no reads.
+		 */
+		kernel_buf = slurp_file_map(kernel, &kernel_size, &mapped);
+		if (i < 0 && kernel_size > window_size)
+			i = probe_file_type(kernel_buf, kernel_size);
 	}
 
-	if (i == file_types) {
+	if (i < 0) {
 		fprintf(stderr, "Cannot determine the file type " "of %s\n",
 				kernel);
-		return -1;
+		ret = -1;
+		goto out;
 	}
 
 	ret = file_type[i].load(argc, argv, kernel_buf, kernel_size, &info);
 	if (ret < 0) {
 		fprintf(stderr, "Cannot load %s\n", kernel);
-		return ret;
+		goto out;
 	}
 
 	/*
@@ -1229,6 +1509,11 @@ static int do_kexec_file_load(int fileind, int argc, char **argv,
 	if (ret != 0)
 		fprintf(stderr, "kexec_file_load failed: %s\n",
 					strerror(errno));
+out:
+	/* The kernel reads the image from kernel_fd, not from here */
+	slurp_file_release(kernel_buf, kernel_size, mapped);
+	if (kernel_fd >= 0)
+		close(kernel_fd);
 	return ret;
 }
 
@@ -1410,6 +1695,27 @@ int main(int argc, char *argv[])
 			do_shutdown = 0;
 			kexec_flags = KEXEC_HARDBOOT;
 			break;
+		case OPT_PURGATORY_VERIFY:
+			if (strcmp(optarg, "sha256") == 0)
+				purgatory_verify = VERIFY_SHA256;
+			else if (strcmp(optarg, "crc32c") == 0)
+				purgatory_verify = VERIFY_CRC32C;
+			else if (strcmp(optarg, "none") == 0)
+				purgatory_verify = VERIFY_NONE;
+			else {
+				fprintf(stderr,
+					"Bad option value in --purgatory-verify=%s\n",
+					optarg);
+				usage();
+				return 1;
+			}
+			break;
+		case OPT_SAVE_PLAN:
+			save_plan = optarg;
+			break;
+		case OPT_LOAD_PLAN:
+			load_plan = optarg;
+			break;
 		default:
 			break;
 		}
@@ -13,6 +13,7 @@
 #define _GNU_SOURCE
 
 #include "kexec-elf.h"
+#include "free_ranges.h"
 #include "unused.h"
 
 #ifndef BYTE_ORDER
@@ -166,6 +167,11 @@ struct kexec_info {
 	int initrd_fd;
 	char *command_line;
 	int command_line_len;
+
+	/* RAM still free for locate_hole() */
+	struct free_ranges free_ranges;
+	/* segment[0 .. sorted_segments - 1] are in address order */
+	int sorted_segments;
 };
 
 struct arch_map_entry {
@@ -228,7 +234,10 @@ extern int file_types;
 #define OPT_ENTRY		261
 #define OPT_PRINT_CKR_SIZE	262
 #define OPT_LOAD_HARDBOOT	263
-#define OPT_MAX			264
+#define OPT_PURGATORY_VERIFY	264
+#define OPT_SAVE_PLAN		265
+#define OPT_LOAD_PLAN		266
+#define OPT_MAX			267
 #define KEXEC_OPTIONS \
 	{ "help",		0, 0, OPT_HELP }, \
 	{ "version",		0, 0, OPT_VERSION }, \
@@ -251,6 +260,9 @@ extern int file_types;
 	{ "status",		0, 0, OPT_STATUS }, \
 	{ "print-ckr-size",     0, 0, OPT_PRINT_CKR_SIZE }, \
 	{ "load-hardboot",		0, 0, OPT_LOAD_HARDBOOT}, \
+	{ "purgatory-verify",	1, 0, OPT_PURGATORY_VERIFY }, \
+	{ "save-plan",		1, 0, OPT_SAVE_PLAN }, \
+	{ "load-plan",		1, 0, OPT_LOAD_PLAN }, \
 
 #define KEXEC_OPT_STR "h?vdfxyluet:psS"
 
@@ -261,8 +273,13 @@ extern void *xmalloc(size_t size);
 extern void *xrealloc(void *ptr, size_t size);
 extern char *slurp_file(const char *filename, off_t *r_size);
 extern char *slurp_file_mmap(const char *filename, off_t *r_size);
+extern char *slurp_file_map(const char *filename, off_t *r_size, int *mapped);
+extern void slurp_file_release(char *buf, off_t size, int mapped);
 extern char *slurp_file_len(const char *filename, off_t size, off_t *nread);
 extern char *slurp_decompress_file(const char *filename, off_t *r_size);
+extern char *slurp_decompress_file_map(const char *filename, off_t *r_size,
+				       int *mapped);
+extern char *decompress_alloc(uint64_t hint, off_t in_size, off_t *allocated);
 extern unsigned long virt_to_phys(unsigned long addr);
 extern void add_segment(struct kexec_info *info,
 	const void *buf, size_t bufsz, unsigned long base, size_t memsz);
@@ -309,6 +326,24 @@ int kexec_iomem_for_each_line(char *match,
 int parse_iomem_single(char *str, uint64_t *start, uint64_t *end);
 const char * proc_iomem(void);
 
+/* A line of /proc/iomem, in the tree the indentation describes */
+struct iomem_resource {
+	unsigned long long start;
+	unsigned long long end;		/* inclusive */
+	char *name;			/* as in the file, newline included */
+	int depth;
+	struct iomem_resource *parent;
+	struct iomem_resource **children;	/* in address order */
+	int nr_children;
+	struct iomem_resource *next_name;
+};
+
+const struct iomem_resource *kexec_iomem_resources(int *nr);
+const struct iomem_resource *kexec_iomem_find(const char *name);
+const struct iomem_resource *kexec_iomem_find_next(
+	const struct iomem_resource *res);
+const struct iomem_resource *kexec_iomem_lookup(unsigned long long addr);
+
 #define MAX_LINE	160
 
 char *concat_cmdline(const char *base, const char *append);
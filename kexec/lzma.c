@@ -17,196 +17,177 @@
 #include <ctype.h>
 #include <lzma.h>
 
-#define kBufferSize (1 << 15)
+/* The same limit the decoder has always been given */
+#define LZMA_MEMLIMIT (UINT64_C(64) * 1024 * 1024)
 
-typedef struct lzfile {
-	uint8_t buf[kBufferSize];
-	lzma_stream strm;
-	FILE *file;
-	int encoding;
-	int eof;
-} LZFILE;
-
-LZFILE *lzopen(const char *path, const char *mode);
-int lzclose(LZFILE *lzfile);
-ssize_t lzread(LZFILE *lzfile, void *buf, size_t len);
-
-static LZFILE *lzopen_internal(const char *path, const char *mode, int fd)
+static uint64_t get_le(const unsigned char *p, int bytes)
 {
-	int level = 5;
-	int encoding = 0;
-	FILE *fp;
-	LZFILE *lzfile;
-	lzma_ret ret;
-	lzma_stream lzma_strm_tmp = LZMA_STREAM_INIT;
-
-	for (; *mode; mode++) {
-		if (*mode == 'w')
-			encoding = 1;
-		else if (*mode == 'r')
-			encoding = 0;
-		else if (*mode >= '1' && *mode <= '9')
-			level = *mode - '0';
-	}
-	if (fd != -1)
-		fp = fdopen(fd, encoding ? "w" : "r");
-	else
-		fp = fopen(path, encoding ? "w" : "r");
-	if (!fp)
-		return NULL;
-
-	lzfile = calloc(1, sizeof(*lzfile));
+	uint64_t val = 0;
 
-	if (!lzfile) {
-		fclose(fp);
-		return NULL;
-	}
-
-	lzfile->file = fp;
-	lzfile->encoding = encoding;
-	lzfile->eof = 0;
-	lzfile->strm = lzma_strm_tmp;
-	if (encoding) {
-		lzma_options_lzma opt_lzma;
-		if (lzma_lzma_preset(&opt_lzma, level - 1))
-			return NULL;
-		ret = lzma_alone_encoder(&lzfile->strm, &opt_lzma);
-	} else {
-		ret = lzma_auto_decoder(&lzfile->strm,
-					UINT64_C(64) * 1024 * 1024, 0);
-	}
-	if (ret != LZMA_OK) {
-		fclose(fp);
-		free(lzfile);
-		return NULL;
-	}
-	return lzfile;
-}
-
-LZFILE *lzopen(const char *path, const char *mode)
-{
-	return lzopen_internal(path, mode, -1);
+	while (bytes--)
+		val = (val << 8) | p[bytes];
+	return val;
 }
 
-int lzclose(LZFILE *lzfile)
+/*
+ * The uncompressed size of a single .xz stream, from the index at its
+ * end, or 0 if it cannot be found.
+ */
+static uint64_t xz_uncompressed_size(const char *in, off_t in_size)
 {
-	lzma_ret ret;
-	size_t n;
-
-	if (!lzfile)
-		return -1;
-
-	if (lzfile->encoding) {
-		for (;;) {
-			lzfile->strm.avail_out = kBufferSize;
-			lzfile->strm.next_out = lzfile->buf;
-			ret = lzma_code(&lzfile->strm, LZMA_FINISH);
-			if (ret != LZMA_OK && ret != LZMA_STREAM_END)
-				return -1;
-			n = kBufferSize - lzfile->strm.avail_out;
-			if (n && fwrite(lzfile->buf, 1, n, lzfile->file) != n)
-				return -1;
-			if (ret == LZMA_STREAM_END)
-				break;
-		}
-	}
-	lzma_end(&lzfile->strm);
-
-	return fclose(lzfile->file);
-	free(lzfile);
+	const uint8_t *end = (const uint8_t *)in + in_size;
+	lzma_stream_flags flags;
+	lzma_index *index = NULL;
+	uint64_t memlimit = LZMA_MEMLIMIT, size;
+	size_t pos = 0;
+
+	/* Skip the stream padding */
+	while (end - (const uint8_t *)in >= 4 && get_le(end - 4, 4) == 0)
+		end -= 4;
+	if (end - (const uint8_t *)in < 2 * LZMA_STREAM_HEADER_SIZE)
+		return 0;
+	if (lzma_stream_footer_decode(&flags, end - LZMA_STREAM_HEADER_SIZE)
+	    != LZMA_OK)
+		return 0;
+	if (flags.backward_size > (uint64_t)(end - (const uint8_t *)in) -
+	    2 * LZMA_STREAM_HEADER_SIZE)
+		return 0;
+	if (lzma_index_buffer_decode(&index, &memlimit, NULL,
+			end - LZMA_STREAM_HEADER_SIZE - flags.backward_size,
+			&pos, flags.backward_size) != LZMA_OK)
+		return 0;
+	size = lzma_index_uncompressed_size(index);
+	lzma_index_end(index, NULL);
+	return size;
 }
 
-ssize_t lzread(LZFILE *lzfile, void *buf, size_t len)
+/*
+ * Tell .xz and .lzma files from anything else.  The .lzma format has no
+ * magic, so check its header the way liblzma's own decoder would.
+ */
+int is_lzma_buffer(const char *buf, off_t size)
 {
-	lzma_ret ret;
-	int eof = 0;
-
-	if (!lzfile || lzfile->encoding)
-		return -1;
-
-	if (lzfile->eof)
+	static const unsigned char xz_magic[6] = {
+		0xfd, '7', 'z', 'X', 'Z', 0x00
+	};
+	const unsigned char *p = (const unsigned char *)buf;
+	uint32_t dict_size;
+	uint64_t usize;
+
+	if (size >= (off_t)sizeof(xz_magic) &&
+	    memcmp(p, xz_magic, sizeof(xz_magic)) == 0)
+		return 1;
+
+	/* The range coder always starts with a zero byte */
+	if (size < 14 || p[0] > (4 * 5 + 4) * 9 + 8 || p[13] != 0)
 		return 0;
-
-	lzfile->strm.next_out = buf;
-	lzfile->strm.avail_out = len;
-
-	for (;;) {
-		if (!lzfile->strm.avail_in) {
-			lzfile->strm.next_in = lzfile->buf;
-			lzfile->strm.avail_in = fread(lzfile->buf, 1, kBufferSize, lzfile->file);
-			if (!lzfile->strm.avail_in)
-				eof = 1;
-		}
-
-		ret = lzma_code(&lzfile->strm, LZMA_RUN);
-		if (ret == LZMA_STREAM_END) {
-			lzfile->eof = 1;
-			return len - lzfile->strm.avail_out;
-		}
-
-		if (ret != LZMA_OK)
-			return -1;
-
-		if (!lzfile->strm.avail_out)
-			return len;
-
-		if (eof)
-			return -1;
+	/* The dictionary size is 2^n or 2^n + 2^(n-1) */
+	dict_size = get_le(p + 1, 4);
+	if (dict_size == 0)
+		return 0;
+	if (dict_size != UINT32_MAX) {
+		uint32_t d = dict_size - 1;
+		d |= d >> 2;
+		d |= d >> 3;
+		d |= d >> 4;
+		d |= d >> 8;
+		d |= d >> 16;
+		if (++d != dict_size)
+			return 0;
 	}
+	/* and the size is unknown or below 256GiB */
+	usize = get_le(p + 5, 8);
+	return usize == UINT64_MAX || usize < (UINT64_C(1) << 38);
 }
 
-char *lzma_decompress_file(const char *filename, off_t *r_size)
+/*
+ * Decompress the .xz or .lzma file in buf.  Both formats record their
+ * uncompressed size, which sizes the first allocation.
+ */
+char *lzma_decompress_buffer(const char *in, off_t in_size, off_t *r_size)
 {
-	LZFILE *fp;
+	lzma_stream strm = LZMA_STREAM_INIT;
+	const unsigned char *p = (const unsigned char *)in;
 	char *buf;
 	off_t size, allocated;
-	ssize_t result;
+	uint64_t hint;
+	lzma_ret ret;
 
 	dbgprintf("Try LZMA decompression.\n");
 
 	*r_size = 0;
-	if (!filename)
+	if (!is_lzma_buffer(in, in_size))
 		return NULL;
 
-	fp = lzopen(filename, "rb");
-	if (fp == 0) {
-		dbgprintf("Cannot open `%s'\n", filename);
+	if (p[0] == 0xfd)
+		hint = xz_uncompressed_size(in, in_size);
+	else
+		hint = get_le(p + 5, 8);
+	if (hint == UINT64_MAX)
+		hint = 0;
+
+	if (lzma_auto_decoder(&strm, LZMA_MEMLIMIT, 0) != LZMA_OK)
 		return NULL;
-	}
+	buf = decompress_alloc(hint, in_size, &allocated);
+	strm.next_in = (const uint8_t *)in;
+	strm.avail_in = in_size;
 	size = 0;
-	allocated = 65536;
-	buf = xmalloc(allocated);
-	do {
+	for (;;) {
 		if (size == allocated) {
 			allocated <<= 1;
 			buf = xrealloc(buf, allocated);
 		}
-		result = lzread(fp, buf + size, allocated - size);
-		if (result < 0) {
-			if ((errno == EINTR) || (errno == EAGAIN))
-				continue;
-
-			dbgprintf("%s: read on %s of %ld bytes failed\n",
-				__func__, filename, (allocated - size) + 0UL);
+		strm.next_out = (uint8_t *)buf + size;
+		strm.avail_out = allocated - size;
+		ret = lzma_code(&strm, LZMA_FINISH);
+		size = (char *)strm.next_out - buf;
+		if (ret == LZMA_STREAM_END)
 			break;
-		}
-		size += result;
-	} while (result > 0);
+		if ((ret == LZMA_OK || ret == LZMA_BUF_ERROR) &&
+		    size == allocated)
+			continue;
+		dbgprintf("%s: LZMA decompression failed: %d\n",
+			  __func__, ret);
+		size = 0;
+		break;
+	}
+	lzma_end(&strm);
 
-	if (lzclose(fp) != LZMA_OK) {
-		dbgprintf("%s: Close of %s failed\n", __func__, filename);
-		goto fail;
+	if (size > 0) {
+		*r_size = size;
+	} else {
+		free(buf);
+		buf = NULL;
 	}
-	if (result < 0)
-		goto fail;
+	return buf;
+}
+
+char *lzma_decompress_file(const char *filename, off_t *r_size)
+{
+	char *in, *buf;
+	off_t in_size;
+	int mapped;
 
-	*r_size =  size;
+	*r_size = 0;
+	if (!filename)
+		return NULL;
+	in = slurp_file_map(filename, &in_size, &mapped);
+	buf = lzma_decompress_buffer(in, in_size, r_size);
+	slurp_file_release(in, in_size, mapped);
 	return buf;
-fail:
-	free(buf);
-	return NULL;
 }
 #else
+int is_lzma_buffer(const char *UNUSED(buf), off_t UNUSED(size))
+{
+	return 0;
+}
+
+char *lzma_decompress_buffer(const char *UNUSED(in), off_t UNUSED(in_size),
+			     off_t *UNUSED(r_size))
+{
+	return NULL;
+}
+
 char *lzma_decompress_file(const char *UNUSED(filename), off_t *UNUSED(r_size))
 {
 	return NULL;
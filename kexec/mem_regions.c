@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "kexec.h"
 #include "mem_regions.h"
@@ -125,3 +126,171 @@ int mem_regions_exclude(struct memory_ranges *ranges,
 	}
 	return 0;
 }
+
+/*
+ * The functions below grow ranges->ranges with realloc() as needed, so
+ * it must either be NULL or come from malloc().  The ones that search
+ * expect the ranges to be sorted and not to overlap.
+ */
+static int mem_regions_grow(struct memory_ranges *ranges, unsigned int extra)
+{
+	struct memory_range *new_ranges;
+	unsigned int max_size;
+
+	if (ranges->size + extra <= ranges->max_size)
+		return 0;
+
+	max_size = ranges->max_size ? ranges->max_size : 64;
+	while (max_size < ranges->size + extra)
+		max_size *= 2;
+	new_ranges = realloc(ranges->ranges, max_size * sizeof(*new_ranges));
+	if (!new_ranges)
+		return -1;
+
+	ranges->ranges = new_ranges;
+	ranges->max_size = max_size;
+	return 0;
+}
+
+/* Index of the first range that ends at or after addr */
+static unsigned int mem_regions_search(const struct memory_ranges *ranges,
+				       unsigned long long addr)
+{
+	unsigned int lo = 0, hi = ranges->size, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (ranges->ranges[mid].end < addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/**
+ * mem_regions_alloc_and_add() - add a memory region, growing the ranges
+ * @ranges: ranges to add the memory region to
+ * @base: base address of memory region
+ * @length: length of memory region in bytes
+ * @type: type of memory region
+ *
+ * Like mem_regions_add(), but make room first.  Returns %0 on success,
+ * or %-1 if we ran out of memory.
+ */
+int mem_regions_alloc_and_add(struct memory_ranges *ranges,
+			      unsigned long long base,
+			      unsigned long long length, int type)
+{
+	if (mem_regions_grow(ranges, 1))
+		return -1;
+
+	return mem_regions_add(ranges, base, length, type);
+}
+
+/**
+ * mem_regions_alloc_and_insert() - add a memory region in address order
+ * @ranges: sorted ranges to add the memory region to
+ * @base: base address of memory region
+ * @length: length of memory region in bytes
+ * @type: type of memory region
+ *
+ * Returns %0 on success, or %-1 if the region overlaps one that is
+ * already there or we ran out of memory.
+ */
+int mem_regions_alloc_and_insert(struct memory_ranges *ranges,
+				 unsigned long long base,
+				 unsigned long long length, int type)
+{
+	struct memory_range *range;
+	unsigned int i;
+
+	i = mem_regions_search(ranges, base);
+	if (i < ranges->size && ranges->ranges[i].start <= base + length - 1)
+		return -1;
+	if (mem_regions_grow(ranges, 1))
+		return -1;
+
+	range = ranges->ranges + i;
+	memmove(range + 1, range, (ranges->size - i) * sizeof(*range));
+	range->start = base;
+	range->end = base + length - 1;
+	range->type = type;
+	ranges->size++;
+
+	return 0;
+}
+
+/**
+ * mem_regions_alloc_and_exclude() - take a region out of sorted ranges
+ * @ranges: sorted ranges to exclude the region from
+ * @range: memory range to exclude
+ *
+ * Unlike mem_regions_exclude(), the region may cover any number of the
+ * ranges, or parts of them.  Returns %0 on success, or %-1 if a range
+ * had to be split and we ran out of memory.
+ */
+int mem_regions_alloc_and_exclude(struct memory_ranges *ranges,
+				  const struct memory_range *range)
+{
+	struct memory_range *r;
+	unsigned int i, j;
+
+	i = mem_regions_search(ranges, range->start);
+	if (i == ranges->size || ranges->ranges[i].start > range->end)
+		return 0;
+
+	r = ranges->ranges + i;
+	if (r->start < range->start && r->end > range->end) {
+		/* Split this range in two around the region */
+		if (mem_regions_grow(ranges, 1))
+			return -1;
+		r = ranges->ranges + i;
+		memmove(r + 1, r, (ranges->size - i) * sizeof(*r));
+		r[0].end = range->start - 1;
+		r[1].start = range->end + 1;
+		ranges->size++;
+		return 0;
+	}
+	if (r->start < range->start) {
+		/* Shrink the end of this range */
+		r->end = range->start - 1;
+		i++;
+	}
+
+	/* Drop the ranges the region covers and shrink the one it ends in */
+	for (j = i; j < ranges->size && ranges->ranges[j].end <= range->end; j++)
+		;
+	if (j < ranges->size && ranges->ranges[j].start <= range->end)
+		ranges->ranges[j].start = range->end + 1;
+	memmove(ranges->ranges + i, ranges->ranges + j,
+		(ranges->size - j) * sizeof(*r));
+	ranges->size -= j - i;
+
+	return 0;
+}
+
+/**
+ * mem_regions_find() - find the range that contains a region
+ * @ranges: sorted ranges to search
+ * @base: base address of the region
+ * @length: length of the region in bytes
+ *
+ * Returns the range that contains all of the region, or %NULL.
+ */
+struct memory_range *mem_regions_find(struct memory_ranges *ranges,
+				      unsigned long long base,
+				      unsigned long long length)
+{
+	struct memory_range *range;
+	unsigned int i;
+
+	i = mem_regions_search(ranges, base);
+	if (i == ranges->size)
+		return NULL;
+	range = ranges->ranges + i;
+	if (range->start > base || range->end < base + length - 1)
+		return NULL;
+
+	return range;
+}
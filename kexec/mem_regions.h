@@ -12,4 +12,19 @@ int mem_regions_exclude(struct memory_ranges *ranges,
 int mem_regions_add(struct memory_ranges *ranges, unsigned long long base,
                     unsigned long long length, int type);
 
+int mem_regions_alloc_and_add(struct memory_ranges *ranges,
+			      unsigned long long base,
+			      unsigned long long length, int type);
+
+int mem_regions_alloc_and_insert(struct memory_ranges *ranges,
+				 unsigned long long base,
+				 unsigned long long length, int type);
+
+int mem_regions_alloc_and_exclude(struct memory_ranges *ranges,
+				  const struct memory_range *range);
+
+struct memory_range *mem_regions_find(struct memory_ranges *ranges,
+				      unsigned long long base,
+				      unsigned long long length);
+
 #endif
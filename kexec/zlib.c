@@ -1,6 +1,14 @@
 #include "kexec-zlib.h"
 #include "kexec.h"
 
+/* Start of a gzip member, see RFC 1952 */
+int is_gzip_buffer(const char *buf, off_t size)
+{
+	const unsigned char *p = (const unsigned char *)buf;
+
+	return size >= 18 && p[0] == 0x1f && p[1] == 0x8b && p[2] == 8;
+}
+
 #ifdef HAVE_LIBZ
 #define _GNU_SOURCE
 #include <stdio.h>
@@ -55,57 +63,70 @@ out:
 	return is_zlib_file;
 }
 
-char *zlib_decompress_file(const char *filename, off_t *r_size)
+/*
+ * Inflate the gzip data in buf, which may hold several members one after
+ * the other like gzread() accepts.  The trailer of the last member gives
+ * the uncompressed size modulo 4GiB, which sizes the first allocation.
+ */
+char *zlib_decompress_buffer(const char *in, off_t in_size, off_t *r_size)
 {
-	gzFile fp;
-	int errnum;
-	const char *msg;
+	const unsigned char *trailer;
+	z_stream strm;
 	char *buf;
-	off_t size = 0, allocated;
-	ssize_t result;
+	off_t size, allocated, consumed;
+	uint32_t isize;
+	int result;
 
 	dbgprintf("Try gzip decompression.\n");
 
 	*r_size = 0;
-	if (!filename) {
+	if (!is_gzip_buffer(in, in_size))
 		return NULL;
-	}
-	fp = gzopen(filename, "rb");
-	if (fp == 0) {
-		_gzerror(fp, &errnum, &msg);
-		dbgprintf("Cannot open `%s': %s\n", filename, msg);
-		return NULL;
-	}
-	if (gzdirect(fp)) {
-		/* It's not in gzip format */
+
+	trailer = (const unsigned char *)in + in_size - 4;
+	isize = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) |
+		((uint32_t)trailer[3] << 24);
+	buf = decompress_alloc(isize, in_size, &allocated);
+
+	memset(&strm, 0, sizeof(strm));
+	if (inflateInit2(&strm, 16 + MAX_WBITS) != Z_OK) {
+		free(buf);
 		return NULL;
 	}
-	allocated = 65536;
-	buf = xmalloc(allocated);
-	do {
+	size = 0;
+	consumed = 0;
+	for (;;) {
 		if (size == allocated) {
 			allocated <<= 1;
 			buf = xrealloc(buf, allocated);
 		}
-		result = gzread(fp, buf + size, allocated - size);
-		if (result < 0) {
-			if ((errno == EINTR) || (errno == EAGAIN))
-				continue;
-			_gzerror(fp, &errnum, &msg);
-			dbgprintf("Read on %s of %d bytes failed: %s\n",
-				  filename, (int)(allocated - size), msg);
+		/* z_stream counts are only an int wide */
+		strm.next_in = (unsigned char *)in + consumed;
+		strm.avail_in = in_size - consumed > UINT_MAX ?
+			UINT_MAX : in_size - consumed;
+		strm.next_out = (unsigned char *)buf + size;
+		strm.avail_out = allocated - size > UINT_MAX ?
+			UINT_MAX : allocated - size;
+		result = inflate(&strm, Z_NO_FLUSH);
+		consumed = (const char *)strm.next_in - in;
+		size = (char *)strm.next_out - buf;
+		if (result == Z_STREAM_END) {
+			if (!is_gzip_buffer(in + consumed, in_size - consumed))
+				break;
+			/* On to the next member */
+			inflateReset(&strm);
+			continue;
+		}
+		if (result == Z_BUF_ERROR && size == allocated)
+			continue;
+		if (result != Z_OK) {
+			dbgprintf("gzip decompression failed: %s\n",
+				  strm.msg ? strm.msg : "truncated input");
 			size = 0;
-			goto fail;
+			break;
 		}
-		size += result;
-	} while(result > 0);
-
-fail:
-	result = gzclose(fp);
-	if (result != Z_OK) {
-		_gzerror(fp, &errnum, &msg);
-		dbgprintf(" Close of %s failed: %s\n", filename, msg);
 	}
+	inflateEnd(&strm);
 
 	if (size > 0) {
 		*r_size = size;
@@ -115,7 +136,28 @@ fail:
 	}
 	return buf;
 }
+
+char *zlib_decompress_file(const char *filename, off_t *r_size)
+{
+	char *in, *buf;
+	off_t in_size;
+	int mapped;
+
+	*r_size = 0;
+	if (!filename)
+		return NULL;
+	in = slurp_file_map(filename, &in_size, &mapped);
+	buf = zlib_decompress_buffer(in, in_size, r_size);
+	slurp_file_release(in, in_size, mapped);
+	return buf;
+}
 #else
+char *zlib_decompress_buffer(const char *UNUSED(in), off_t UNUSED(in_size),
+			     off_t *UNUSED(r_size))
+{
+	return NULL;
+}
+
 char *zlib_decompress_file(const char *UNUSED(filename), off_t *UNUSED(r_size))
 {
 	return NULL;
@@ -14,7 +14,8 @@
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
 #define MAX(x, y) ((x) > (y) ? (x) : (y))
 
-extern struct sha256_region sha256_regions[SHA256_REGIONS];
+extern uint64_t sha256_regions;
+extern uint64_t sha256_nr_regions;
 
 unsigned long crash_base = (unsigned long) -1;
 unsigned long crash_size = (unsigned long) -1;
@@ -69,25 +70,45 @@ void setup_arch(void)
  * We use [0x2000 - 0x10000] for purgatory. This area is never used
  * by s390 Linux kernels.
  *
+ * The region table is a segment of its own but not one of the regions,
+ * so it sits in one of the gaps: that gap is copied last, once the
+ * table is no longer needed.
+ *
  * This functions assumes that the sha256_regions[] is sorted.
  */
 void post_verification_setup_arch(void)
 {
-	unsigned long start, len, last = crash_base + 0x10000;
+	unsigned long start, last, gap = 0, gap_end = 0;
+	unsigned long table = sha256_regions;
 	struct sha256_region *ptr, *end;
 
-	end = &sha256_regions[sizeof(sha256_regions)/sizeof(sha256_regions[0])];
-	for (ptr = sha256_regions; ptr < end; ptr++) {
-		if (!ptr->start)
-			continue;
+	ptr = (struct sha256_region *) table;
+	end = ptr + sha256_nr_regions;
+	for (; ptr < end; ptr++) {
 		start = MAX(ptr->start, crash_base + 0x10000);
-		len = ptr->len - (start - ptr->start);
-		memcpy_fast((void *) last, (void *) last - crash_base,
-			    start - last);
-		memswap((void *) start - crash_base, (void *) start, len);
-		last = start + len;
+		memswap((void *) start - crash_base, (void *) start,
+			ptr->len - (start - ptr->start));
+	}
+
+	last = crash_base + 0x10000;
+	for (ptr = (struct sha256_region *) table; ; ptr++) {
+		if (ptr < end)
+			start = MAX(ptr->start, crash_base + 0x10000);
+		else
+			start = crash_base + crash_size;
+		if (table >= last && table < start) {
+			gap = last;
+			gap_end = start;
+		} else {
+			memcpy_fast((void *) last, (void *) last - crash_base,
+				    start - last);
+		}
+		if (ptr == end)
+			break;
+		last = ptr->start + ptr->len;
 	}
-	memcpy_fast((void *) last, (void *) last - crash_base,
-		    crash_base + crash_size - last);
+	if (gap_end)
+		memcpy_fast((void *) gap, (void *) gap - crash_base,
+			    gap_end - gap);
 	memcpy_fast((void *) crash_base, (void *) 0, 0x2000);
 }
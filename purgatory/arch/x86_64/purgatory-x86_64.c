@@ -3,14 +3,35 @@
 #include <purgatory.h>
 #include "purgatory-x86_64.h"
 
+#define X86_CR0_MP		0x00000002
+#define X86_CR0_EM		0x00000004
+#define X86_CR0_TS		0x00000008
+#define X86_CR4_OSFXSR		0x00000200
+#define X86_CR4_OSXMMEXCPT	0x00000400
+
 uint8_t reset_vga = 0;
 uint8_t legacy_pic = 0;
 uint8_t panic_kernel = 0;
 unsigned long jump_back_entry = 0;
 char *cmdline_end = NULL;
 
+/* relocate_kernel leaves SSE turned off, and the SHA-256 code wants it */
+static void x86_enable_sse(void)
+{
+	unsigned long cr0, cr4;
+
+	asm volatile("movq %%cr0, %0" : "=r" (cr0));
+	cr0 &= ~(X86_CR0_EM | X86_CR0_TS);
+	cr0 |= X86_CR0_MP;
+	asm volatile("movq %0, %%cr0" : : "r" (cr0));
+	asm volatile("movq %%cr4, %0" : "=r" (cr4));
+	cr4 |= X86_CR4_OSFXSR | X86_CR4_OSXMMEXCPT;
+	asm volatile("movq %0, %%cr4" : : "r" (cr4));
+}
+
 void setup_arch(void)
 {
+	x86_enable_sse();
 	if (reset_vga)    x86_reset_vga();
 	if (legacy_pic)   x86_setup_legacy_pic();
 }
@@ -3,23 +3,85 @@
 #include <stdint.h>
 #include <purgatory.h>
 #include <sha256.h>
+#include <crc32c.h>
 #include <string.h>
 #include "../kexec/kexec-sha256.h"
 
-struct sha256_region sha256_regions[SHA256_REGIONS] = {};
+/* The address of the struct sha256_region table, and its length */
+uint64_t sha256_regions = 0;
+uint64_t sha256_nr_regions = 0;
 sha256_digest_t sha256_digest = { };
+uint32_t verify_mode = VERIFY_SHA256;
+
+/* Whether the zero fill at the end of a region is still all zeroes */
+static int zero_fill_ok(const struct sha256_region *ptr)
+{
+	const uint8_t *p;
+	uint64_t len;
+
+	p = (const uint8_t *)((uintptr_t)(ptr->start + ptr->len - ptr->zero_len));
+	for (len = ptr->zero_len; len && ((uintptr_t)p & 7); len--)
+		if (*p++)
+			return 0;
+	for (; len >= 8; len -= 8, p += 8)
+		if (*(const uint64_t *)p)
+			return 0;
+	for (; len; len--)
+		if (*p++)
+			return 0;
+	return 1;
+}
+
+static int verify_crc32c(struct sha256_region *regions, size_t nr)
+{
+	struct sha256_region *ptr;
+	uint32_t crc;
+	size_t i;
+	int ret = 0;
+
+	for (i = 0; i < nr; i++) {
+		ptr = &regions[i];
+		crc = crc32c(0, (uint8_t *)((uintptr_t)ptr->start),
+			     ptr->len - ptr->zero_len);
+		if (crc != ptr->crc) {
+			printf("crc32c of region %d does not match: "
+			       "%x, expected %x\n", (int)i, crc, ptr->crc);
+			ret = 1;
+		}
+	}
+	return ret;
+}
 
 int verify_sha256_digest(void)
 {
-	struct sha256_region *ptr, *end;
+	struct sha256_region *regions, *ptr, *end;
 	sha256_digest_t digest;
 	size_t i;
-	sha256_context ctx;
+	sha256_context ctx, region_ctx;
+
+	if (verify_mode == VERIFY_NONE)
+		return 0;
+
+	regions = (struct sha256_region *)((uintptr_t)sha256_regions);
+	end = regions + sha256_nr_regions;
+	for(ptr = regions; ptr < end; ptr++) {
+		if (!zero_fill_ok(ptr)) {
+			printf("zero fill of region %d is not zero\n",
+			       (int)(ptr - regions));
+			return 1;
+		}
+	}
+	if (verify_mode == VERIFY_CRC32C)
+		return verify_crc32c(regions, sha256_nr_regions);
+
+	/* sha256_digest is of the digests of the regions, in order */
 	sha256_starts(&ctx);
-	end = &sha256_regions[sizeof(sha256_regions)/sizeof(sha256_regions[0])];
-	for(ptr = sha256_regions; ptr < end; ptr++) {
-		sha256_update(&ctx, (uint8_t *)((uintptr_t)ptr->start),
-			      ptr->len);
+	for(ptr = regions; ptr < end; ptr++) {
+		sha256_starts(&region_ctx);
+		sha256_update(&region_ctx, (uint8_t *)((uintptr_t)ptr->start),
+			      ptr->len - ptr->zero_len);
+		sha256_finish(&region_ctx, digest);
+		sha256_update(&ctx, digest, sizeof(digest));
 	}
 	sha256_finish(&ctx, digest);
 	if (memcmp(digest, sha256_digest, sizeof(digest)) != 0) {
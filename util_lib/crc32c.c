@@ -0,0 +1,121 @@
+/*
+ * CRC-32C (Castagnoli), using the cpu's crc32 instructions where
+ * there are some.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation (version 2 of the License).
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdint.h>
+#include <crc32c.h>
+
+/* The arm64 instructions are only used with --with-arm64-crypto */
+#if defined(__aarch64__) && defined(CRC32C_ARM64)
+#define CRC32C_HW_ARM64
+#endif
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#elif defined(CRC32C_HW_ARM64) && __STDC_HOSTED__
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32	(1 << 7)
+#endif
+#endif
+
+#define CRC32C_POLY	0x82f63b78	/* reversed */
+
+static uint32_t crc32c_table[256];
+static int crc32c_hw = -1;
+
+static void crc32c_init(void)
+{
+	uint32_t crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+		crc32c_table[i] = crc;
+	}
+
+#if defined(__x86_64__)
+	{
+		unsigned int eax, ebx, ecx, edx;
+
+		__cpuid(1, eax, ebx, ecx, edx);
+		crc32c_hw = !!(ecx & bit_SSE4_2);
+	}
+#elif defined(CRC32C_HW_ARM64) && __STDC_HOSTED__
+	crc32c_hw = !!(getauxval(AT_HWCAP) & HWCAP_CRC32);
+#elif defined(CRC32C_HW_ARM64)
+	{
+		uint64_t isar0;
+
+		asm volatile("mrs %0, id_aa64isar0_el1" : "=r" (isar0));
+		crc32c_hw = ((isar0 >> 16) & 0xf) != 0;
+	}
+#else
+	crc32c_hw = 0;
+#endif
+}
+
+static uint32_t crc32c_u8(uint32_t crc, uint8_t v)
+{
+#if defined(__x86_64__)
+	if (crc32c_hw) {
+		asm("crc32b %1, %0" : "+r" (crc) : "rm" (v));
+		return crc;
+	}
+#elif defined(CRC32C_HW_ARM64)
+	if (crc32c_hw) {
+		asm(".arch_extension crc\n\t"
+		    "crc32cb %w0, %w0, %w1" : "+r" (crc) : "r" (v));
+		return crc;
+	}
+#endif
+	return (crc >> 8) ^ crc32c_table[(crc ^ v) & 0xff];
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	if (crc32c_hw < 0)
+		crc32c_init();
+
+	crc = ~crc;
+	while (len && ((uintptr_t)p & 7)) {
+		crc = crc32c_u8(crc, *p++);
+		len--;
+	}
+#if defined(__x86_64__) || defined(CRC32C_HW_ARM64)
+	if (crc32c_hw) {
+		/* Eight bytes at a time, little endian like the table */
+		uint64_t crc64 = crc;
+
+		for (; len >= 8; p += 8, len -= 8) {
+#if defined(__x86_64__)
+			asm("crc32q %1, %0" : "+r" (crc64)
+			    : "rm" (*(const uint64_t *)p));
+#else
+			asm(".arch_extension crc\n\t"
+			    "crc32cx %w0, %w0, %x1" : "+r" (crc64)
+			    : "r" (*(const uint64_t *)p));
+#endif
+		}
+		crc = crc64;
+	}
+#endif
+	while (len--)
+		crc = crc32c_u8(crc, *p++);
+
+	return ~crc;
+}
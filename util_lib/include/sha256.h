@@ -18,5 +18,15 @@ void sha256_starts( sha256_context *ctx );
 void sha256_update( sha256_context *ctx, const uint8_t *input, size_t length );
 void sha256_finish( sha256_context *ctx, sha256_digest_t digest );
 
+/* The block function sha256_update() uses, and a way to turn off the
+ * cpu's SHA-256 instructions (to compare against the generic code). */
+const char *sha256_impl( void );
+void sha256_use_hw( int use );
+
+/* util_lib/sha256-$(ARCH).c, where there is one (SHA256_HW is defined) */
+extern const char sha256_hw_name[];
+int sha256_hw_probe( void );
+void sha256_hw_blocks( uint32_t state[8], const uint8_t *data, size_t blocks );
+
 
 #endif /* SHA256_H */
@@ -0,0 +1,99 @@
+/*
+ * SHA-256 block function using the ARMv8 cryptography extensions
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include <arm_neon.h>
+#if __STDC_HOSTED__
+#include <sys/auxv.h>
+#endif
+
+#include "sha256.h"
+
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2	(1 << 6)
+#endif
+
+const char sha256_hw_name[] = "armv8-ce";
+
+static const uint32_t sha256_k[64] =
+{
+	0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5,
+	0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+	0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3,
+	0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+	0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC,
+	0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+	0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7,
+	0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+	0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13,
+	0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+	0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3,
+	0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+	0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5,
+	0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+	0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208,
+	0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+};
+
+/*
+ * Userspace asks the kernel; the purgatory runs at EL1 or EL2 and can
+ * read ID_AA64ISAR0_EL1 (SHA2 is bits 15:12) itself.
+ */
+int sha256_hw_probe( void )
+{
+#if __STDC_HOSTED__
+	return !!( getauxval( AT_HWCAP ) & HWCAP_SHA2 );
+#else
+	uint64_t isar0;
+
+	asm volatile( "mrs %0, id_aa64isar0_el1" : "=r" ( isar0 ) );
+	return ( ( isar0 >> 12 ) & 0xf ) != 0;
+#endif
+}
+
+/*
+ * Four rounds per step.  msg[] holds the last 16 words of the message
+ * schedule, with W[j - 4] in msg[j & 3] when step j starts.
+ */
+void sha256_hw_blocks( uint32_t state[8], const uint8_t *data, size_t blocks )
+{
+	uint32x4_t abcd, efgh, abcd_save, efgh_save, msg[4], tmp, prev;
+	int i;
+
+	abcd = vld1q_u32( &state[0] );
+	efgh = vld1q_u32( &state[4] );
+
+	while( blocks-- )
+	{
+		abcd_save = abcd;
+		efgh_save = efgh;
+
+#pragma GCC unroll 16
+		for( i = 0; i < 16; i++ )
+		{
+			if( i < 4 )
+				msg[i] = vreinterpretq_u32_u8( vrev32q_u8(
+					vld1q_u8( data + 16 * i ) ) );
+			else
+				msg[i & 3] = vsha256su1q_u32(
+					vsha256su0q_u32( msg[i & 3], msg[(i + 1) & 3] ),
+					msg[(i + 2) & 3], msg[(i + 3) & 3] );
+			tmp = vaddq_u32( msg[i & 3], vld1q_u32( &sha256_k[4 * i] ) );
+			prev = abcd;
+			abcd = vsha256hq_u32( abcd, efgh, tmp );
+			efgh = vsha256h2q_u32( efgh, prev, tmp );
+		}
+
+		abcd = vaddq_u32( abcd, abcd_save );
+		efgh = vaddq_u32( efgh, efgh_save );
+		data += 64;
+	}
+
+	vst1q_u32( &state[0], abcd );
+	vst1q_u32( &state[4], efgh );
+}
@@ -0,0 +1,106 @@
+/*
+ * SHA-256 block function using the x86 SHA extensions (SHA-NI)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+#include "sha256.h"
+
+const char sha256_hw_name[] = "sha-ni";
+
+static const uint32_t sha256_k[64] =
+{
+	0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5,
+	0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+	0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3,
+	0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+	0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC,
+	0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+	0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7,
+	0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+	0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13,
+	0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+	0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3,
+	0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+	0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5,
+	0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+	0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208,
+	0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+};
+
+/*
+ * The purgatory runs with whatever %cr4 relocate_kernel left behind,
+ * which does not enable SSE; its setup_arch() turns it back on before
+ * anything is hashed.
+ */
+int sha256_hw_probe( void )
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if( __get_cpuid_max( 0, NULL ) < 7 )
+		return 0;
+	__cpuid( 1, eax, ebx, ecx, edx );
+	if( !( ecx & bit_SSE4_1 ) || !( ecx & bit_SSSE3 ) )
+		return 0;
+	__cpuid_count( 7, 0, eax, ebx, ecx, edx );
+	return !!( ebx & bit_SHA );
+}
+
+/*
+ * Four rounds per step.  msg[] holds the last 16 words of the message
+ * schedule, with W[j - 4] in msg[j & 3] when step j starts.
+ */
+void sha256_hw_blocks( uint32_t state[8], const uint8_t *data, size_t blocks )
+{
+	const __m128i bswap = _mm_set_epi64x( 0x0c0d0e0f08090a0bULL,
+					      0x0405060700010203ULL );
+	__m128i abef, cdgh, abef_save, cdgh_save, msg[4], tmp;
+	int i;
+
+	/* The instructions want the state as ABEF and CDGH */
+	tmp  = _mm_shuffle_epi32( _mm_loadu_si128( (const __m128i *) &state[0] ), 0xB1 );
+	cdgh = _mm_shuffle_epi32( _mm_loadu_si128( (const __m128i *) &state[4] ), 0x1B );
+	abef = _mm_alignr_epi8( tmp, cdgh, 8 );
+	cdgh = _mm_blend_epi16( cdgh, tmp, 0xF0 );
+
+	while( blocks-- )
+	{
+		abef_save = abef;
+		cdgh_save = cdgh;
+
+#pragma GCC unroll 16
+		for( i = 0; i < 16; i++ )
+		{
+			if( i < 4 )
+				msg[i] = _mm_shuffle_epi8( _mm_loadu_si128(
+					(const __m128i *) ( data + 16 * i ) ), bswap );
+			else
+			{
+				tmp = _mm_sha256msg1_epu32( msg[i & 3], msg[(i + 1) & 3] );
+				tmp = _mm_add_epi32( tmp, _mm_alignr_epi8(
+					msg[(i + 3) & 3], msg[(i + 2) & 3], 4 ) );
+				msg[i & 3] = _mm_sha256msg2_epu32( tmp, msg[(i + 3) & 3] );
+			}
+			tmp = _mm_add_epi32( msg[i & 3], _mm_loadu_si128(
+				(const __m128i *) &sha256_k[4 * i] ) );
+			cdgh = _mm_sha256rnds2_epu32( cdgh, abef, tmp );
+			abef = _mm_sha256rnds2_epu32( abef, cdgh,
+						      _mm_shuffle_epi32( tmp, 0x0E ) );
+		}
+
+		abef = _mm_add_epi32( abef, abef_save );
+		cdgh = _mm_add_epi32( cdgh, cdgh_save );
+		data += 64;
+	}
+
+	tmp  = _mm_shuffle_epi32( abef, 0x1B );
+	cdgh = _mm_shuffle_epi32( cdgh, 0xB1 );
+	_mm_storeu_si128( (__m128i *) &state[0], _mm_blend_epi16( tmp, cdgh, 0xF0 ) );
+	_mm_storeu_si128( (__m128i *) &state[4], _mm_alignr_epi8( cdgh, tmp, 8 ) );
+}
@@ -184,9 +184,57 @@ void sha256_process( sha256_context *ctx, const uint8_t data[64] )
 	ctx->state[7] += H;
 }
 
+/*
+ * -1 until the cpu has been asked whether it has SHA-256 instructions,
+ * then whether sha256_update() should use them.
+ */
+static int sha256_hw = -1;
+
+static int sha256_use_hw_blocks( void )
+{
+#ifdef SHA256_HW
+	if( sha256_hw < 0 )
+		sha256_hw = sha256_hw_probe();
+	return sha256_hw;
+#else
+	return 0;
+#endif
+}
+
+void sha256_use_hw( int use )
+{
+	sha256_hw = use ? -1 : 0;
+}
+
+const char *sha256_impl( void )
+{
+#ifdef SHA256_HW
+	if( sha256_use_hw_blocks() )
+		return sha256_hw_name;
+#endif
+	return "generic";
+}
+
+static void sha256_blocks( sha256_context *ctx, const uint8_t *data,
+			   size_t blocks )
+{
+#ifdef SHA256_HW
+	if( sha256_use_hw_blocks() )
+	{
+		sha256_hw_blocks( ctx->state, data, blocks );
+		return;
+	}
+#endif
+	while( blocks-- )
+	{
+		sha256_process( ctx, data );
+		data += 64;
+	}
+}
+
 void sha256_update( sha256_context *ctx, const uint8_t *input, size_t length )
 {
-	size_t left, fill;
+	size_t left, fill, blocks;
 
 	if( ! length ) return;
 
@@ -208,11 +256,12 @@ void sha256_update( sha256_context *ctx, const uint8_t *input, size_t length )
 		left = 0;
 	}
 
-	while( length >= 64 )
+	blocks = length / 64;
+	if( blocks )
 	{
-		sha256_process( ctx, input );
-		length -= 64;
-		input  += 64;
+		sha256_blocks( ctx, input, blocks );
+		length -= blocks * 64;
+		input  += blocks * 64;
 	}
 
 	if( length )
@@ -262,6 +311,7 @@ void sha256_finish( sha256_context *ctx, sha256_digest_t digest )
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
 
 /*
  * those are the standard FIPS-180-2 test vectors
@@ -284,22 +334,73 @@ static char *val[] =
 	"f1809a48a497200e046d39ccc7112cd0"
 };
 
+/*
+ * Hash a buffer of the given size with each block function and print
+ * how fast they went.
+ */
+static int bench( size_t mib )
+{
+	size_t i, size = mib << 20;
+	uint8_t *data;
+	sha256_context ctx;
+	sha256_digest_t digest[2];
+	struct timespec start, end;
+	double secs;
+	int hw;
+
+	data = malloc( size );
+	if( ! data )
+	{
+		perror( "malloc" );
+		return( 1 );
+	}
+	for( i = 0; i < size; i++ )
+		data[i] = i * 2654435761U >> 24;
+
+	for( hw = 0; hw < 2; hw++ )
+	{
+		sha256_use_hw( hw );
+		clock_gettime( CLOCK_MONOTONIC, &start );
+		sha256_starts( &ctx );
+		sha256_update( &ctx, data, size );
+		sha256_finish( &ctx, digest[hw] );
+		clock_gettime( CLOCK_MONOTONIC, &end );
+		secs = ( end.tv_sec - start.tv_sec ) +
+			( end.tv_nsec - start.tv_nsec ) / 1e9;
+		printf( " %-8s %zu MiB in %.3fs: %.1f MB/s\n", sha256_impl(),
+			mib, secs, size / secs / 1e6 );
+	}
+	free( data );
+
+	if( memcmp( digest[0], digest[1], sizeof( digest[0] ) ) )
+	{
+		printf( " digests differ!\n" );
+		return( 1 );
+	}
+	return( 0 );
+}
+
 int main( int argc, char *argv[] )
 {
 	FILE *f;
-	int i, j;
+	int i, j, hw;
 	char output[65];
 	sha256_context ctx;
 	unsigned char buf[1000];
 	unsigned char sha256sum[32];
 
+	if( argc >= 2 && strcmp( argv[1], "-b" ) == 0 )
+		return( bench( argc > 2 ? strtoul( argv[2], NULL, 0 ) : 256 ) );
+
 	if( argc < 2 )
 	{
 		printf( "\n SHA-256 Validation Tests:\n\n" );
 		
+		for( hw = 0; hw < 2; hw++ )
 		for( i = 0; i < 3; i++ )
 		{
-			printf( " Test %d ", i + 1 );
+			sha256_use_hw( hw );
+			printf( " Test %d (%s) ", i + 1, sha256_impl() );
 			
 			sha256_starts( &ctx );
 			
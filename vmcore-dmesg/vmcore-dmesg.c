@@ -5,7 +5,9 @@
 #include <endian.h>
 #include <byteswap.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -13,36 +15,150 @@
 #include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <elf.h>
 #include <stdbool.h>
 #include <inttypes.h>
 #include <ctype.h>
+#include <getopt.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <time.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 /* The 32bit and 64bit note headers make it clear we don't care */
 typedef Elf32_Nhdr Elf_Nhdr;
 
-static const char *fname;
-static Elf64_Ehdr ehdr;
-static Elf64_Phdr *phdr;
-
-static char osrelease[4096];
-static loff_t log_buf_vaddr;
-static loff_t log_end_vaddr;
-static loff_t log_buf_len_vaddr;
-static loff_t logged_chars_vaddr;
-
-/* record format logs */
-static loff_t log_first_idx_vaddr;
-static loff_t log_next_idx_vaddr;
-
-/* struct printk_log (or older log) size */
-static uint64_t log_sz;
+/* Inputs that cannot be mapped are read through a small block cache */
+#define CACHE_BLOCK_SIZE	(64*1024)
+#define CACHE_BLOCKS		64
+
+struct core_reader {
+	const char *map;	/* the whole core, if it could be mapped */
+	uint64_t size;
+	struct cache_block {
+		uint64_t block;
+		size_t len;	/* 0 if the slot is empty */
+		char *data;
+	} cache[CACHE_BLOCKS];
+};
+
+/*
+ * Records are formatted into a buffer that starts at OUT_BUF_MIN and
+ * doubles each time a big log fills it, up to OUT_BUF_MAX.  Runs of
+ * text of OUT_REF_MIN bytes or more are not copied into it at all but
+ * queued by reference, and everything is flushed with writev().
+ */
+#define OUT_BUF_MIN	(64*1024)
+#define OUT_BUF_MAX	(1024*1024)
+#define OUT_REF_MIN	128
+#define OUT_IOV_MAX	64
+
+/* How records are written out */
+enum dmesg_format {
+	FORMAT_TEXT,
+	FORMAT_JSON,
+	FORMAT_BINARY,
+};
+
+/* What to print, shared by every core */
+struct dmesg_opts {
+	enum dmesg_format format;
+	int json_core;		/* tag JSON records with the core's name */
+	int max_level;		/* -1 to print every level */
+	uint64_t since_nsec;
+	uint64_t until_nsec;
+	uint64_t last;		/* 0 for every record */
+};
+
+/*
+ * --format=binary writes one struct dmesg_binary_header, then for every
+ * record a struct dmesg_binary_record followed by text_len bytes of
+ * text.  Everything is in the byte order of the machine that ran
+ * vmcore-dmesg.
+ */
+#define DMESG_BINARY_MAGIC	"VMDMESG\0"
+#define DMESG_BINARY_VERSION	1
+
+struct dmesg_binary_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;	/* sizeof(struct dmesg_binary_record) */
+};
+
+struct dmesg_binary_record {
+	uint64_t ts_nsec;
+	uint16_t text_len;
+	uint8_t facility;	/* 0xff if the log does not say */
+	uint8_t level;		/* 0xff if the log does not say */
+	uint32_t reserved;
+};
+
+/* Everything we know about the core being read */
+struct vmcore {
+	const struct dmesg_opts *opts;
+	const char *fname;
+	int fd;
+	Elf64_Ehdr ehdr;
+	Elf64_Phdr *phdr;
+	size_t phnum;		/* e_phnum, or sh_info of section 0 */
 
-/* struct printk_log (or older log) field offsets */
-static uint64_t log_offset_ts_nsec = UINT64_MAX;
-static uint16_t log_offset_len = UINT16_MAX;
-static uint16_t log_offset_text_len = UINT16_MAX;
+	/* PT_LOAD headers sorted by p_vaddr, and the highest end address
+	 * of any of them up to each index, for looking up overlapping
+	 * segments.
+	 */
+	Elf64_Phdr **load_index;
+	uint64_t *load_max_end;
+	size_t nr_loads;
+
+	struct core_reader core;
+	char *note_buf;
+	char *log_copy;		/* log buffer, when it is not mapped */
+
+	char osrelease[4096];
+	loff_t log_buf_vaddr;
+	loff_t log_end_vaddr;
+	loff_t log_buf_len_vaddr;
+	loff_t logged_chars_vaddr;
+
+	/* record format logs */
+	loff_t log_first_idx_vaddr;
+	loff_t log_next_idx_vaddr;
+
+	/* struct printk_log (or older log) size */
+	uint64_t log_sz;
+
+	/* struct printk_log (or older log) field offsets */
+	uint64_t log_offset_ts_nsec;
+	uint16_t log_offset_len;
+	uint16_t log_offset_text_len;
+	uint16_t log_offset_facility;	/* followed by the flags and level */
+
+	/* Formatted output waiting for out_flush() */
+	char *fmt_buf;
+	size_t fmt_size;
+	size_t fmt_len;
+	size_t fmt_seg;		/* start of what is not queued in iov yet */
+	struct iovec iov[OUT_IOV_MAX];
+	int nr_iov;
+
+	/* The log goes to out_fd, or into out_mem when out_fd < 0 */
+	int out_fd;
+	char *out_mem;
+	size_t out_len;
+	size_t out_max;
+
+	/* Where a failure returns to in batch mode, else it exits */
+	jmp_buf *abort;
+};
 
 #if __BYTE_ORDER == __LITTLE_ENDIAN
 #define ELFDATANATIVE ELFDATA2LSB
@@ -52,205 +168,463 @@ static uint16_t log_offset_text_len = UINT16_MAX;
 #error "Unknown machine endian"
 #endif
 
-static uint16_t file16_to_cpu(uint16_t val)
+static void __attribute__((noreturn)) fail(struct vmcore *vc, int status)
+{
+	if (vc->abort)
+		longjmp(*vc->abort, status);
+	exit(status);
+}
+
+static uint16_t file16_to_cpu(struct vmcore *vc, uint16_t val)
 {
-	if (ehdr.e_ident[EI_DATA] != ELFDATANATIVE)
+	if (vc->ehdr.e_ident[EI_DATA] != ELFDATANATIVE)
 		val = bswap_16(val);
 	return val;
 }
 
-static uint32_t file32_to_cpu(uint32_t val)
+static uint32_t file32_to_cpu(struct vmcore *vc, uint32_t val)
 {
-	if (ehdr.e_ident[EI_DATA] != ELFDATANATIVE)
+	if (vc->ehdr.e_ident[EI_DATA] != ELFDATANATIVE)
 		val = bswap_32(val);
 	return val;
 }
 
-static uint64_t file64_to_cpu(uint64_t val)
+static uint64_t file64_to_cpu(struct vmcore *vc, uint64_t val)
 {
-	if (ehdr.e_ident[EI_DATA] != ELFDATANATIVE)
+	if (vc->ehdr.e_ident[EI_DATA] != ELFDATANATIVE)
 		val = bswap_64(val);
 	return val;
 }
 
-static uint64_t vaddr_to_offset(uint64_t vaddr)
+static void core_open(struct vmcore *vc)
+{
+	struct core_reader *core = &vc->core;
+	struct stat st;
+	void *map;
+
+	memset(core, 0, sizeof(*core));
+	if (fstat(vc->fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size <= 0)
+		return;
+	if ((uint64_t)st.st_size != (size_t)st.st_size)
+		return;
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, vc->fd, 0);
+	if (map == MAP_FAILED)
+		return;
+	core->map = map;
+	core->size = st.st_size;
+}
+
+static void core_close(struct vmcore *vc)
+{
+	struct core_reader *core = &vc->core;
+	int i;
+
+	if (core->map)
+		munmap((void *)core->map, core->size);
+	for (i = 0; i < CACHE_BLOCKS; i++)
+		free(core->cache[i].data);
+	memset(core, 0, sizeof(*core));
+}
+
+/* Return the cached block holding offset, reading it in on a miss */
+static struct cache_block *core_cache_block(struct vmcore *vc, uint64_t offset)
+{
+	uint64_t block = offset / CACHE_BLOCK_SIZE;
+	struct cache_block *cb = &vc->core.cache[block % CACHE_BLOCKS];
+	ssize_t ret;
+
+	if (cb->len && cb->block == block)
+		return cb;
+	if (!cb->data) {
+		cb->data = malloc(CACHE_BLOCK_SIZE);
+		if (!cb->data) {
+			fprintf(stderr, "Cannot malloc %d bytes\n",
+				CACHE_BLOCK_SIZE);
+			fail(vc, 21);
+		}
+	}
+	ret = pread(vc->fd, cb->data, CACHE_BLOCK_SIZE,
+		    block * CACHE_BLOCK_SIZE);
+	if (ret < 0)
+		return NULL;
+	cb->block = block;
+	cb->len = ret;
+	return cb;
+}
+
+/* Read from the core file, like pread() */
+static ssize_t core_read(struct vmcore *vc, void *buf, size_t size,
+			 uint64_t offset)
+{
+	struct core_reader *core = &vc->core;
+	char *ptr = buf;
+	size_t done = 0;
+
+	if (core->map) {
+		if (offset >= core->size)
+			return 0;
+		if (size > core->size - offset)
+			size = core->size - offset;
+		memcpy(buf, core->map + offset, size);
+		return size;
+	}
+
+	/* Big reads gain nothing from the cache */
+	if (size >= CACHE_BLOCK_SIZE)
+		return pread(vc->fd, buf, size, offset);
+
+	while (done < size) {
+		struct cache_block *cb;
+		size_t off, chunk;
+
+		cb = core_cache_block(vc, offset + done);
+		if (!cb)
+			return -1;
+		off = (offset + done) - cb->block * CACHE_BLOCK_SIZE;
+		if (off >= cb->len)
+			break;
+		chunk = cb->len - off;
+		if (chunk > size - done)
+			chunk = size - done;
+		memcpy(ptr + done, cb->data + off, chunk);
+		done += chunk;
+	}
+	return done;
+}
+
+static int load_cmp(const void *a, const void *b)
+{
+	const Elf64_Phdr *pa = *(Elf64_Phdr * const *)a;
+	const Elf64_Phdr *pb = *(Elf64_Phdr * const *)b;
+
+	if (pa->p_vaddr != pb->p_vaddr)
+		return pa->p_vaddr < pb->p_vaddr ? -1 : 1;
+	/* Keep file order among equals, the first one has always won */
+	return pa < pb ? -1 : (pa > pb);
+}
+
+static void build_load_index(struct vmcore *vc)
+{
+	uint64_t max_end = 0;
+	size_t i;
+
+	vc->load_index = calloc(vc->phnum ? vc->phnum : 1,
+				sizeof(*vc->load_index));
+	vc->load_max_end = calloc(vc->phnum ? vc->phnum : 1,
+				  sizeof(*vc->load_max_end));
+	if (!vc->load_index || !vc->load_max_end) {
+		fprintf(stderr, "Calloc of the %zu entry phdr index failed: %s\n",
+			vc->phnum, strerror(errno));
+		fail(vc, 15);
+	}
+	vc->nr_loads = 0;
+	for (i = 0; i < vc->phnum; i++) {
+		if (vc->phdr[i].p_type != PT_LOAD || !vc->phdr[i].p_memsz)
+			continue;
+		vc->load_index[vc->nr_loads++] = &vc->phdr[i];
+	}
+	qsort(vc->load_index, vc->nr_loads, sizeof(*vc->load_index), load_cmp);
+	for (i = 0; i < vc->nr_loads; i++) {
+		Elf64_Phdr *p = vc->load_index[i];
+		if (p->p_vaddr + p->p_memsz > max_end)
+			max_end = p->p_vaddr + p->p_memsz;
+		vc->load_max_end[i] = max_end;
+	}
+}
+
+static Elf64_Phdr *vaddr_to_phdr(struct vmcore *vc, uint64_t vaddr)
 {
 	/* Just hand the simple case where kexec gets
 	 * the virtual address on the program headers right.
 	 */
+	Elf64_Phdr *found = NULL;
+	size_t lo = 0, hi = vc->nr_loads;
 	ssize_t i;
-	for (i = 0; i < ehdr.e_phnum; i++) {
-		if (phdr[i].p_vaddr > vaddr)
-			continue;
-		if ((phdr[i].p_vaddr + phdr[i].p_memsz) <= vaddr)
+
+	/* Find the last segment starting at or below vaddr */
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (vc->load_index[mid]->p_vaddr <= vaddr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	/* Walk back over any segments it overlaps, preferring the one
+	 * that comes first in the file like a linear scan would.
+	 */
+	for (i = (ssize_t)lo - 1; i >= 0 && vc->load_max_end[i] > vaddr; i--) {
+		Elf64_Phdr *p = vc->load_index[i];
+		if ((p->p_vaddr + p->p_memsz) <= vaddr)
 			continue;
-		return (vaddr - phdr[i].p_vaddr) + phdr[i].p_offset;
+		if (!found || p < found)
+			found = p;
 	}
+	if (found)
+		return found;
 	fprintf(stderr, "No program header covering vaddr 0x%llxfound kexec bug?\n",
 		(unsigned long long)vaddr);
-	exit(30);
+	fail(vc, 30);
+}
+
+/*
+ * Return a pointer straight into the mapped core for size bytes of
+ * memory at vaddr, or NULL when they have to be copied out instead.
+ */
+static const char *vaddr_to_ptr(struct vmcore *vc, uint64_t vaddr, size_t size)
+{
+	Elf64_Phdr *seg;
+	uint64_t delta;
+
+	if (!vc->core.map)
+		return NULL;
+	seg = vaddr_to_phdr(vc, vaddr);
+	delta = vaddr - seg->p_vaddr;
+	if (delta + size > seg->p_filesz)
+		return NULL;
+	if (seg->p_offset + delta + size > vc->core.size)
+		return NULL;
+	return vc->core.map + seg->p_offset + delta;
+}
+
+/*
+ * Read size bytes of memory starting at vaddr, which may cross from one
+ * program header into the next.  Whatever lies past p_filesz in a
+ * segment reads as zeros; that is how kdump --elide-zero and
+ * makedumpfile leave zero pages out of a core.
+ */
+static ssize_t pread_vaddr(struct vmcore *vc, void *buf, size_t size,
+			   uint64_t vaddr)
+{
+	char *ptr = buf;
+	size_t done = 0;
+
+	while (done < size) {
+		Elf64_Phdr *seg = vaddr_to_phdr(vc, vaddr + done);
+		uint64_t delta = vaddr + done - seg->p_vaddr;
+		size_t chunk = size - done;
+		ssize_t ret;
+
+		if (chunk > seg->p_memsz - delta)
+			chunk = seg->p_memsz - delta;
+		if (delta >= seg->p_filesz) {
+			memset(ptr + done, 0, chunk);
+		} else {
+			if (chunk > seg->p_filesz - delta)
+				chunk = seg->p_filesz - delta;
+			ret = core_read(vc, ptr + done, chunk,
+					seg->p_offset + delta);
+			if (ret < 0 || (size_t)ret != chunk)
+				return -1;
+		}
+		done += chunk;
+	}
+	return size;
 }
 
-static unsigned machine_pointer_bits(void)
+static unsigned machine_pointer_bits(struct vmcore *vc)
 {
 	uint8_t bits = 0;
 
 	/* Default to the size of the elf class */
-	switch(ehdr.e_ident[EI_CLASS]) {
+	switch(vc->ehdr.e_ident[EI_CLASS]) {
 	case ELFCLASS32:        bits = 32; break;
 	case ELFCLASS64:        bits = 64; break;
 	}
 
 	/* Report the architectures pointer size */
-	switch(ehdr.e_machine) {
+	switch(vc->ehdr.e_machine) {
 	case EM_386:            bits = 32; break;
 	}
 
         return bits;
 }
 
-static void read_elf32(int fd)
+static void read_elf32(struct vmcore *vc)
 {
+	Elf64_Ehdr *ehdr = &vc->ehdr;
 	Elf32_Ehdr ehdr32;
 	Elf32_Phdr *phdr32;
 	size_t phdrs32_size;
 	ssize_t ret, i;
 
-	ret = pread(fd, &ehdr32, sizeof(ehdr32), 0);
+	ret = pread(vc->fd, &ehdr32, sizeof(ehdr32), 0);
 	if (ret != sizeof(ehdr32)) {
 		fprintf(stderr, "Read of Elf header from %s failed: %s\n",
-			fname, strerror(errno));
-		exit(10);
-	}
-
-	ehdr.e_type		= file16_to_cpu(ehdr32.e_type);
-	ehdr.e_machine		= file16_to_cpu(ehdr32.e_machine);
-	ehdr.e_version		= file32_to_cpu(ehdr32.e_version);
-	ehdr.e_entry		= file32_to_cpu(ehdr32.e_entry);
-	ehdr.e_phoff		= file32_to_cpu(ehdr32.e_phoff);
-	ehdr.e_shoff		= file32_to_cpu(ehdr32.e_shoff);
-	ehdr.e_flags		= file32_to_cpu(ehdr32.e_flags);
-	ehdr.e_ehsize		= file16_to_cpu(ehdr32.e_ehsize);
-	ehdr.e_phentsize	= file16_to_cpu(ehdr32.e_phentsize);
-	ehdr.e_phnum		= file16_to_cpu(ehdr32.e_phnum);
-	ehdr.e_shentsize	= file16_to_cpu(ehdr32.e_shentsize);
-	ehdr.e_shnum		= file16_to_cpu(ehdr32.e_shnum);
-	ehdr.e_shstrndx		= file16_to_cpu(ehdr32.e_shstrndx);
-	
-	if (ehdr.e_version != EV_CURRENT) {
+			vc->fname, strerror(errno));
+		fail(vc, 10);
+	}
+
+	ehdr->e_type		= file16_to_cpu(vc, ehdr32.e_type);
+	ehdr->e_machine		= file16_to_cpu(vc, ehdr32.e_machine);
+	ehdr->e_version		= file32_to_cpu(vc, ehdr32.e_version);
+	ehdr->e_entry		= file32_to_cpu(vc, ehdr32.e_entry);
+	ehdr->e_phoff		= file32_to_cpu(vc, ehdr32.e_phoff);
+	ehdr->e_shoff		= file32_to_cpu(vc, ehdr32.e_shoff);
+	ehdr->e_flags		= file32_to_cpu(vc, ehdr32.e_flags);
+	ehdr->e_ehsize		= file16_to_cpu(vc, ehdr32.e_ehsize);
+	ehdr->e_phentsize	= file16_to_cpu(vc, ehdr32.e_phentsize);
+	ehdr->e_phnum		= file16_to_cpu(vc, ehdr32.e_phnum);
+	ehdr->e_shentsize	= file16_to_cpu(vc, ehdr32.e_shentsize);
+	ehdr->e_shnum		= file16_to_cpu(vc, ehdr32.e_shnum);
+	ehdr->e_shstrndx	= file16_to_cpu(vc, ehdr32.e_shstrndx);
+
+	if (ehdr->e_version != EV_CURRENT) {
 		fprintf(stderr, "Bad Elf header version %u\n",
-			ehdr.e_version);
-		exit(11);
+			ehdr->e_version);
+		fail(vc, 11);
 	}
-	if (ehdr.e_phentsize != sizeof(Elf32_Phdr)) {
+	if (ehdr->e_phentsize != sizeof(Elf32_Phdr)) {
 		fprintf(stderr, "Bad Elf progra header size %u expected %zu\n",
-			ehdr.e_phentsize, sizeof(Elf32_Phdr));
-		exit(12);
+			ehdr->e_phentsize, sizeof(Elf32_Phdr));
+		fail(vc, 12);
 	}
-	phdrs32_size = ehdr.e_phnum * sizeof(Elf32_Phdr);
-	phdr32 = calloc(ehdr.e_phnum, sizeof(Elf32_Phdr));
-	if (!phdr32) {
-		fprintf(stderr, "Calloc of %u phdrs32 failed: %s\n",
-			ehdr.e_phnum, strerror(errno));
-		exit(14);
+	vc->phnum = ehdr->e_phnum;
+	if (ehdr->e_phnum == PN_XNUM) {
+		Elf32_Shdr shdr;
+
+		/* Too many headers for e_phnum, the count is in section 0 */
+		if (!ehdr->e_shoff ||
+		    ehdr->e_shentsize != sizeof(Elf32_Shdr)) {
+			fprintf(stderr, "Bad Elf section header for %u phdrs\n",
+				PN_XNUM);
+			fail(vc, 12);
+		}
+		ret = pread(vc->fd, &shdr, sizeof(shdr), ehdr->e_shoff);
+		if (ret < 0 || (size_t)ret != sizeof(shdr)) {
+			fprintf(stderr, "Read of section header from %s failed: %s\n",
+				vc->fname, strerror(errno));
+			fail(vc, 16);
+		}
+		vc->phnum = file32_to_cpu(vc, shdr.sh_info);
+	}
+	phdrs32_size = vc->phnum * sizeof(Elf32_Phdr);
+	vc->phdr = calloc(vc->phnum, sizeof(Elf64_Phdr));
+	if (!vc->phdr) {
+		fprintf(stderr, "Calloc of %zu phdrs failed: %s\n",
+			vc->phnum, strerror(errno));
+		fail(vc, 15);
 	}
-	phdr = calloc(ehdr.e_phnum, sizeof(Elf64_Phdr));
-	if (!phdr) {
-		fprintf(stderr, "Calloc of %u phdrs failed: %s\n",
-			ehdr.e_phnum, strerror(errno));
-		exit(15);
+	phdr32 = calloc(vc->phnum, sizeof(Elf32_Phdr));
+	if (!phdr32) {
+		fprintf(stderr, "Calloc of %zu phdrs32 failed: %s\n",
+			vc->phnum, strerror(errno));
+		fail(vc, 14);
 	}
-	ret = pread(fd, phdr32, phdrs32_size, ehdr.e_phoff);
+	ret = pread(vc->fd, phdr32, phdrs32_size, ehdr->e_phoff);
 	if (ret < 0 || (size_t)ret != phdrs32_size) {
 		fprintf(stderr, "Read of program header @ 0x%llu for %zu bytes failed: %s\n",
-			(unsigned long long)ehdr.e_phoff, phdrs32_size, strerror(errno));
-		exit(16);
-	}
-	for (i = 0; i < ehdr.e_phnum; i++) {
-		phdr[i].p_type		= file32_to_cpu(phdr32[i].p_type);
-		phdr[i].p_offset	= file32_to_cpu(phdr32[i].p_offset);
-		phdr[i].p_vaddr		= file32_to_cpu(phdr32[i].p_vaddr);
-		phdr[i].p_paddr		= file32_to_cpu(phdr32[i].p_paddr);
-		phdr[i].p_filesz	= file32_to_cpu(phdr32[i].p_filesz);
-		phdr[i].p_memsz		= file32_to_cpu(phdr32[i].p_memsz);
-		phdr[i].p_flags		= file32_to_cpu(phdr32[i].p_flags);
-		phdr[i].p_align		= file32_to_cpu(phdr32[i].p_align);
+			(unsigned long long)ehdr->e_phoff, phdrs32_size, strerror(errno));
+		free(phdr32);
+		fail(vc, 16);
+	}
+	for (i = 0; i < (ssize_t)vc->phnum; i++) {
+		Elf64_Phdr *phdr = &vc->phdr[i];
+		phdr->p_type		= file32_to_cpu(vc, phdr32[i].p_type);
+		phdr->p_offset		= file32_to_cpu(vc, phdr32[i].p_offset);
+		phdr->p_vaddr		= file32_to_cpu(vc, phdr32[i].p_vaddr);
+		phdr->p_paddr		= file32_to_cpu(vc, phdr32[i].p_paddr);
+		phdr->p_filesz		= file32_to_cpu(vc, phdr32[i].p_filesz);
+		phdr->p_memsz		= file32_to_cpu(vc, phdr32[i].p_memsz);
+		phdr->p_flags		= file32_to_cpu(vc, phdr32[i].p_flags);
+		phdr->p_align		= file32_to_cpu(vc, phdr32[i].p_align);
 	}
 	free(phdr32);
 }
 
 
-static void read_elf64(int fd)
+static void read_elf64(struct vmcore *vc)
 {
+	Elf64_Ehdr *ehdr = &vc->ehdr;
 	Elf64_Ehdr ehdr64;
 	Elf64_Phdr *phdr64;
 	size_t phdrs_size;
 	ssize_t ret, i;
 
-	ret = pread(fd, &ehdr64, sizeof(ehdr64), 0);
-	if (ret < 0 || (size_t)ret != sizeof(ehdr)) {
+	ret = pread(vc->fd, &ehdr64, sizeof(ehdr64), 0);
+	if (ret < 0 || (size_t)ret != sizeof(ehdr64)) {
 		fprintf(stderr, "Read of Elf header from %s failed: %s\n",
-			fname, strerror(errno));
-		exit(10);
-	}
-
-	ehdr.e_type		= file16_to_cpu(ehdr64.e_type);
-	ehdr.e_machine		= file16_to_cpu(ehdr64.e_machine);
-	ehdr.e_version		= file32_to_cpu(ehdr64.e_version);
-	ehdr.e_entry		= file64_to_cpu(ehdr64.e_entry);
-	ehdr.e_phoff		= file64_to_cpu(ehdr64.e_phoff);
-	ehdr.e_shoff		= file64_to_cpu(ehdr64.e_shoff);
-	ehdr.e_flags		= file32_to_cpu(ehdr64.e_flags);
-	ehdr.e_ehsize		= file16_to_cpu(ehdr64.e_ehsize);
-	ehdr.e_phentsize	= file16_to_cpu(ehdr64.e_phentsize);
-	ehdr.e_phnum		= file16_to_cpu(ehdr64.e_phnum);
-	ehdr.e_shentsize	= file16_to_cpu(ehdr64.e_shentsize);
-	ehdr.e_shnum		= file16_to_cpu(ehdr64.e_shnum);
-	ehdr.e_shstrndx		= file16_to_cpu(ehdr64.e_shstrndx);
-
-	if (ehdr.e_version != EV_CURRENT) {
+			vc->fname, strerror(errno));
+		fail(vc, 10);
+	}
+
+	ehdr->e_type		= file16_to_cpu(vc, ehdr64.e_type);
+	ehdr->e_machine		= file16_to_cpu(vc, ehdr64.e_machine);
+	ehdr->e_version		= file32_to_cpu(vc, ehdr64.e_version);
+	ehdr->e_entry		= file64_to_cpu(vc, ehdr64.e_entry);
+	ehdr->e_phoff		= file64_to_cpu(vc, ehdr64.e_phoff);
+	ehdr->e_shoff		= file64_to_cpu(vc, ehdr64.e_shoff);
+	ehdr->e_flags		= file32_to_cpu(vc, ehdr64.e_flags);
+	ehdr->e_ehsize		= file16_to_cpu(vc, ehdr64.e_ehsize);
+	ehdr->e_phentsize	= file16_to_cpu(vc, ehdr64.e_phentsize);
+	ehdr->e_phnum		= file16_to_cpu(vc, ehdr64.e_phnum);
+	ehdr->e_shentsize	= file16_to_cpu(vc, ehdr64.e_shentsize);
+	ehdr->e_shnum		= file16_to_cpu(vc, ehdr64.e_shnum);
+	ehdr->e_shstrndx	= file16_to_cpu(vc, ehdr64.e_shstrndx);
+
+	if (ehdr->e_version != EV_CURRENT) {
 		fprintf(stderr, "Bad Elf header version %u\n",
-			ehdr.e_version);
-		exit(11);
+			ehdr->e_version);
+		fail(vc, 11);
 	}
-	if (ehdr.e_phentsize != sizeof(Elf64_Phdr)) {
+	if (ehdr->e_phentsize != sizeof(Elf64_Phdr)) {
 		fprintf(stderr, "Bad Elf progra header size %u expected %zu\n",
-			ehdr.e_phentsize, sizeof(Elf64_Phdr));
-		exit(12);
+			ehdr->e_phentsize, sizeof(Elf64_Phdr));
+		fail(vc, 12);
 	}
-	phdrs_size = ehdr.e_phnum * sizeof(Elf64_Phdr);
-	phdr64 = calloc(ehdr.e_phnum, sizeof(Elf64_Phdr));
-	if (!phdr64) {
-		fprintf(stderr, "Calloc of %u phdrs64 failed: %s\n",
-			ehdr.e_phnum, strerror(errno));
-		exit(14);
+	vc->phnum = ehdr->e_phnum;
+	if (ehdr->e_phnum == PN_XNUM) {
+		Elf64_Shdr shdr;
+
+		/* Too many headers for e_phnum, the count is in section 0 */
+		if (!ehdr->e_shoff ||
+		    ehdr->e_shentsize != sizeof(Elf64_Shdr)) {
+			fprintf(stderr, "Bad Elf section header for %u phdrs\n",
+				PN_XNUM);
+			fail(vc, 12);
+		}
+		ret = pread(vc->fd, &shdr, sizeof(shdr), ehdr->e_shoff);
+		if (ret < 0 || (size_t)ret != sizeof(shdr)) {
+			fprintf(stderr, "Read of section header from %s failed: %s\n",
+				vc->fname, strerror(errno));
+			fail(vc, 16);
+		}
+		vc->phnum = file32_to_cpu(vc, shdr.sh_info);
+	}
+	phdrs_size = vc->phnum * sizeof(Elf64_Phdr);
+	vc->phdr = calloc(vc->phnum, sizeof(Elf64_Phdr));
+	if (!vc->phdr) {
+		fprintf(stderr, "Calloc of %zu phdrs failed: %s\n",
+			vc->phnum, strerror(errno));
+		fail(vc, 15);
 	}
-	phdr = calloc(ehdr.e_phnum, sizeof(Elf64_Phdr));
-	if (!phdr) {
-		fprintf(stderr, "Calloc of %u phdrs failed: %s\n",
-			ehdr.e_phnum, strerror(errno));
-		exit(15);
+	phdr64 = calloc(vc->phnum, sizeof(Elf64_Phdr));
+	if (!phdr64) {
+		fprintf(stderr, "Calloc of %zu phdrs64 failed: %s\n",
+			vc->phnum, strerror(errno));
+		fail(vc, 14);
 	}
-	ret = pread(fd, phdr64, phdrs_size, ehdr.e_phoff);
+	ret = pread(vc->fd, phdr64, phdrs_size, ehdr->e_phoff);
 	if (ret < 0 || (size_t)ret != phdrs_size) {
 		fprintf(stderr, "Read of program header @ %llu for %zu bytes failed: %s\n",
-			(unsigned long long)(ehdr.e_phoff), phdrs_size, strerror(errno));
-		exit(16);
-	}
-	for (i = 0; i < ehdr.e_phnum; i++) {
-		phdr[i].p_type		= file32_to_cpu(phdr64[i].p_type);
-		phdr[i].p_flags		= file32_to_cpu(phdr64[i].p_flags);
-		phdr[i].p_offset	= file64_to_cpu(phdr64[i].p_offset);
-		phdr[i].p_vaddr		= file64_to_cpu(phdr64[i].p_vaddr);
-		phdr[i].p_paddr		= file64_to_cpu(phdr64[i].p_paddr);
-		phdr[i].p_filesz	= file64_to_cpu(phdr64[i].p_filesz);
-		phdr[i].p_memsz		= file64_to_cpu(phdr64[i].p_memsz);
-		phdr[i].p_align		= file64_to_cpu(phdr64[i].p_align);
+			(unsigned long long)(ehdr->e_phoff), phdrs_size, strerror(errno));
+		free(phdr64);
+		fail(vc, 16);
+	}
+	for (i = 0; i < (ssize_t)vc->phnum; i++) {
+		Elf64_Phdr *phdr = &vc->phdr[i];
+		phdr->p_type		= file32_to_cpu(vc, phdr64[i].p_type);
+		phdr->p_flags		= file32_to_cpu(vc, phdr64[i].p_flags);
+		phdr->p_offset		= file64_to_cpu(vc, phdr64[i].p_offset);
+		phdr->p_vaddr		= file64_to_cpu(vc, phdr64[i].p_vaddr);
+		phdr->p_paddr		= file64_to_cpu(vc, phdr64[i].p_paddr);
+		phdr->p_filesz		= file64_to_cpu(vc, phdr64[i].p_filesz);
+		phdr->p_memsz		= file64_to_cpu(vc, phdr64[i].p_memsz);
+		phdr->p_align		= file64_to_cpu(vc, phdr64[i].p_align);
 	}
 	free(phdr64);
 }
 
-static void scan_vmcoreinfo(char *start, size_t size)
+static void scan_vmcoreinfo(struct vmcore *vc, char *start, size_t size)
 {
 	char *last = start + size - 1;
 	char *pos, *eol;
@@ -262,13 +636,13 @@ static void scan_vmcoreinfo(char *start, size_t size)
 	.str = "SYMBOL(" #sym  ")=",			\
 	.name = #sym,					\
 	.len = sizeof("SYMBOL(" #sym  ")=") - 1,	\
-	.vaddr = & sym ## _vaddr,			\
+	.vaddr = offsetof(struct vmcore, sym ## _vaddr),\
  }
-	static struct symbol {
+	static const struct symbol {
 		const char *str;
 		const char *name;
 		size_t len;
-		loff_t *vaddr;
+		size_t vaddr;
 	} symbol[] = {
 		SYMBOL(log_buf),
 		SYMBOL(log_end),
@@ -309,10 +683,10 @@ static void scan_vmcoreinfo(char *start, size_t size)
 		/* Copy OSRELEASE if I see it */
 		if ((len >= 10) && (memcmp("OSRELEASE=", pos, 10) == 0)) {
 			size_t to_copy = len - 10;
-			if (to_copy >= sizeof(osrelease))
-				to_copy = sizeof(osrelease) - 1;
-			memcpy(osrelease, pos + 10, to_copy);
-			osrelease[to_copy] = '\0';
+			if (to_copy >= sizeof(vc->osrelease))
+				to_copy = sizeof(vc->osrelease) - 1;
+			memcpy(vc->osrelease, pos + 10, to_copy);
+			vc->osrelease[to_copy] = '\0';
 		}
 		/* See if the line is mentions a symbol I am looking for */
 		for (i = 0; i < sizeof(symbol)/sizeof(symbol[0]); i++ ) {
@@ -324,51 +698,53 @@ static void scan_vmcoreinfo(char *start, size_t size)
 			/* Found a symbol now decode it */
 			vaddr = strtoull(pos + symbol[i].len, NULL, 16);
 			/* Remember the virtual address */
-			*symbol[i].vaddr = vaddr;
+			*(loff_t *)((char *)vc + symbol[i].vaddr) = vaddr;
 		}
 
 		/* Check for "SIZE(printk_log)" or older "SIZE(log)=" */
 		str = "SIZE(log)=";
 		if (memcmp(str, pos, strlen(str)) == 0)
-			log_sz = strtoull(pos + strlen(str), NULL, 10);
+			vc->log_sz = strtoull(pos + strlen(str), NULL, 10);
 
 		str = "SIZE(printk_log)=";
 		if (memcmp(str, pos, strlen(str)) == 0)
-			log_sz = strtoull(pos + strlen(str), NULL, 10);
+			vc->log_sz = strtoull(pos + strlen(str), NULL, 10);
 
 		/* Check for struct printk_log (or older log) field offsets */
 		str = "OFFSET(log.ts_nsec)=";
 		if (memcmp(str, pos, strlen(str)) == 0)
-			log_offset_ts_nsec = strtoull(pos + strlen(str), NULL,
-							10);
+			vc->log_offset_ts_nsec = strtoull(pos + strlen(str),
+							  NULL, 10);
 		str = "OFFSET(printk_log.ts_nsec)=";
 		if (memcmp(str, pos, strlen(str)) == 0)
-			log_offset_ts_nsec = strtoull(pos + strlen(str), NULL,
-							10);
+			vc->log_offset_ts_nsec = strtoull(pos + strlen(str),
+							  NULL, 10);
 
 		str = "OFFSET(log.len)=";
 		if (memcmp(str, pos, strlen(str)) == 0)
-			log_offset_len = strtoul(pos + strlen(str), NULL, 10);
+			vc->log_offset_len = strtoul(pos + strlen(str),
+						     NULL, 10);
 
 		str = "OFFSET(printk_log.len)=";
 		if (memcmp(str, pos, strlen(str)) == 0)
-			log_offset_len = strtoul(pos + strlen(str), NULL, 10);
+			vc->log_offset_len = strtoul(pos + strlen(str),
+						     NULL, 10);
 
 		str = "OFFSET(log.text_len)=";
 		if (memcmp(str, pos, strlen(str)) == 0)
-			log_offset_text_len = strtoul(pos + strlen(str), NULL,
-							10);
+			vc->log_offset_text_len = strtoul(pos + strlen(str),
+							  NULL, 10);
 		str = "OFFSET(printk_log.text_len)=";
 		if (memcmp(str, pos, strlen(str)) == 0)
-			log_offset_text_len = strtoul(pos + strlen(str), NULL,
-							10);
+			vc->log_offset_text_len = strtoul(pos + strlen(str),
+							  NULL, 10);
 
 		if (last_line)
 			break;
 	}
 }
 
-static void scan_notes(int fd, loff_t start, loff_t lsize)
+static void scan_notes(struct vmcore *vc, loff_t start, loff_t lsize)
 {
 	char *buf, *last, *note, *next;
 	size_t size;
@@ -377,20 +753,20 @@ static void scan_notes(int fd, loff_t start, loff_t lsize)
 	if (lsize > SSIZE_MAX) {
 		fprintf(stderr, "Unable to handle note section of %llu bytes\n",
 			(unsigned long long)lsize);
-		exit(20);
+		fail(vc, 20);
 	}
 	size = lsize;
-	buf = malloc(size);
+	buf = vc->note_buf = malloc(size);
 	if (!buf) {
 		fprintf(stderr, "Cannot malloc %zu bytes\n", size);
-		exit(21);
+		fail(vc, 21);
 	}
 	last = buf + size - 1;
-	ret = pread(fd, buf, size, start);
+	ret = core_read(vc, buf, size, start);
 	if (ret != (ssize_t)size) {
 		fprintf(stderr, "Cannot read note section @ 0x%llx of %zu bytes: %s\n",
 			(unsigned long long)start, size, strerror(errno));
-		exit(22);
+		fail(vc, 22);
 	}
 
 	for (note = buf; (note + sizeof(Elf_Nhdr)) < last; note = next)
@@ -398,11 +774,11 @@ static void scan_notes(int fd, loff_t start, loff_t lsize)
 		Elf_Nhdr *hdr;
 		char *n_name, *n_desc;
 		size_t n_namesz, n_descsz, n_type;
-		
+
 		hdr = (Elf_Nhdr *)note;
-		n_namesz = file32_to_cpu(hdr->n_namesz);
-		n_descsz = file32_to_cpu(hdr->n_descsz);
-		n_type   = file32_to_cpu(hdr->n_type);
+		n_namesz = file32_to_cpu(vc, hdr->n_namesz);
+		n_descsz = file32_to_cpu(vc, hdr->n_descsz);
+		n_type   = file32_to_cpu(vc, hdr->n_type);
 
 		n_name = note + sizeof(*hdr);
 		n_desc = n_name + ((n_namesz + 3) & ~3);
@@ -413,132 +789,358 @@ static void scan_notes(int fd, loff_t start, loff_t lsize)
 
 		if ((memcmp(n_name, "VMCOREINFO", 11) != 0) || (n_type != 0))
 			continue;
-		scan_vmcoreinfo(n_desc, n_descsz);
+		scan_vmcoreinfo(vc, n_desc, n_descsz);
 	}
 	free(buf);
+	vc->note_buf = NULL;
 }
 
-static void scan_note_headers(int fd)
+static void scan_note_headers(struct vmcore *vc)
 {
-	int i;
-	for (i = 0; i < ehdr.e_phnum; i++) {
-		if (phdr[i].p_type != PT_NOTE)
+	size_t i;
+	for (i = 0; i < vc->phnum; i++) {
+		if (vc->phdr[i].p_type != PT_NOTE)
 			continue;
-		scan_notes(fd, phdr[i].p_offset, phdr[i].p_filesz);
+		scan_notes(vc, vc->phdr[i].p_offset, vc->phdr[i].p_filesz);
 	}
 }
 
-static uint64_t read_file_pointer(int fd, uint64_t addr)
+static uint64_t read_file_pointer(struct vmcore *vc, uint64_t addr)
 {
 	uint64_t result;
 	ssize_t ret;
 
-	if (machine_pointer_bits() == 64) {
+	if (machine_pointer_bits(vc) == 64) {
 		uint64_t scratch;
-		ret = pread(fd, &scratch, sizeof(scratch), addr);
+		ret = pread_vaddr(vc, &scratch, sizeof(scratch), addr);
 		if (ret != sizeof(scratch)) {
 			fprintf(stderr, "Failed to read pointer @ 0x%llx: %s\n",
 				(unsigned long long)addr, strerror(errno));
-			exit(40);
+			fail(vc, 40);
 		}
-		result = file64_to_cpu(scratch);
+		result = file64_to_cpu(vc, scratch);
 	} else {
 		uint32_t scratch;
-		ret = pread(fd, &scratch, sizeof(scratch), addr);
+		ret = pread_vaddr(vc, &scratch, sizeof(scratch), addr);
 		if (ret != sizeof(scratch)) {
 			fprintf(stderr, "Failed to read pointer @ 0x%llx: %s\n",
 				(unsigned long long)addr, strerror(errno));
-			exit(40);
+			fail(vc, 40);
 		}
-		result = file32_to_cpu(scratch);
+		result = file32_to_cpu(vc, scratch);
 	}
 	return result;
 }
 
-static uint32_t read_file_u32(int fd, uint64_t addr)
+static uint32_t read_file_u32(struct vmcore *vc, uint64_t addr)
 {
 	uint32_t scratch;
 	ssize_t ret;
-	ret = pread(fd, &scratch, sizeof(scratch), addr);
+	ret = pread_vaddr(vc, &scratch, sizeof(scratch), addr);
 	if (ret != sizeof(scratch)) {
 		fprintf(stderr, "Failed to read value @ 0x%llx: %s\n",
 			(unsigned long long)addr, strerror(errno));
-		exit(41);
+		fail(vc, 41);
 	}
-	return file32_to_cpu(scratch);
+	return file32_to_cpu(vc, scratch);
 }
 
-static int32_t read_file_s32(int fd, uint64_t addr)
+static int32_t read_file_s32(struct vmcore *vc, uint64_t addr)
 {
-	return read_file_u32(fd, addr);
+	return read_file_u32(vc, addr);
 }
 
-static void write_to_stdout(char *buf, unsigned int nr)
+static void write_out(struct vmcore *vc, char *buf, unsigned int nr)
 {
 	ssize_t ret;
 
-	ret = write(STDOUT_FILENO, buf, nr);
+	if (vc->out_fd < 0) {
+		if (vc->out_len + nr > vc->out_max) {
+			size_t max = vc->out_max ? vc->out_max : 65536;
+			char *mem;
+			while (max < vc->out_len + nr)
+				max *= 2;
+			mem = realloc(vc->out_mem, max);
+			if (!mem) {
+				fprintf(stderr, "Cannot grow the output buffer "
+					"to %zu bytes\n", max);
+				fail(vc, 54);
+			}
+			vc->out_mem = mem;
+			vc->out_max = max;
+		}
+		memcpy(vc->out_mem + vc->out_len, buf, nr);
+		vc->out_len += nr;
+		return;
+	}
+
+	ret = write(vc->out_fd, buf, nr);
 	if (ret != nr) {
 		fprintf(stderr, "Failed to write out the dmesg log buffer!:"
 			" %s\n", strerror(errno));
-		exit(54);
+		fail(vc, 54);
 	}
+	vc->out_len += nr;
 }
 
-static void dump_dmesg_legacy(int fd)
+static void write_outv(struct vmcore *vc, struct iovec *iov, int nr)
 {
-	uint64_t log_buf, log_buf_offset;
+	ssize_t ret;
+
+	if (vc->out_fd < 0) {
+		for (; nr > 0; iov++, nr--)
+			write_out(vc, iov->iov_base, iov->iov_len);
+		return;
+	}
+
+	while (nr > 0) {
+		ret = writev(vc->out_fd, iov, nr);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			fprintf(stderr, "Failed to write out the dmesg log buffer!:"
+				" %s\n", strerror(errno));
+			fail(vc, 54);
+		}
+		vc->out_len += ret;
+		/* Step over whatever made it out */
+		while (nr > 0 && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			nr--;
+		}
+		if (nr > 0) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+}
+
+/* Queue the formatted bytes since the last reference */
+static void out_close_seg(struct vmcore *vc)
+{
+	if (vc->fmt_len == vc->fmt_seg)
+		return;
+	vc->iov[vc->nr_iov].iov_base = vc->fmt_buf + vc->fmt_seg;
+	vc->iov[vc->nr_iov].iov_len = vc->fmt_len - vc->fmt_seg;
+	vc->nr_iov++;
+	vc->fmt_seg = vc->fmt_len;
+}
+
+static void out_flush(struct vmcore *vc)
+{
+	out_close_seg(vc);
+	write_outv(vc, vc->iov, vc->nr_iov);
+	vc->nr_iov = 0;
+	vc->fmt_len = vc->fmt_seg = 0;
+}
+
+/* Return room for size more formatted bytes, at fmt_buf + fmt_len */
+static char *out_reserve(struct vmcore *vc, size_t size)
+{
+	size_t new_size;
+	char *buf;
+
+	if (vc->fmt_len + size <= vc->fmt_size)
+		return vc->fmt_buf + vc->fmt_len;
+
+	/* Nothing queued may point into the buffer while it moves */
+	new_size = vc->fmt_size;
+	if (vc->fmt_size) {
+		out_flush(vc);
+		if (new_size < OUT_BUF_MAX)
+			new_size *= 2;
+	} else {
+		new_size = OUT_BUF_MIN;
+	}
+	while (new_size < size)
+		new_size *= 2;
+	if (new_size != vc->fmt_size) {
+		buf = realloc(vc->fmt_buf, new_size);
+		if (!buf) {
+			fprintf(stderr, "Cannot grow the output buffer to %zu "
+				"bytes\n", new_size);
+			fail(vc, 54);
+		}
+		vc->fmt_buf = buf;
+		vc->fmt_size = new_size;
+	}
+	return vc->fmt_buf;
+}
+
+static void out_put(struct vmcore *vc, const void *data, size_t size)
+{
+	memcpy(out_reserve(vc, size), data, size);
+	vc->fmt_len += size;
+}
+
+/* Format into the output buffer, with room for whatever it comes to */
+static void __attribute__((format(printf, 2, 3)))
+out_printf(struct vmcore *vc, const char *fmt, ...)
+{
+	size_t room = 128;
+	va_list ap;
+	char *p;
+	int len;
+
+	for (;;) {
+		p = out_reserve(vc, room);
+		room = vc->fmt_size - vc->fmt_len;
+		va_start(ap, fmt);
+		len = vsnprintf(p, room, fmt, ap);
+		va_end(ap);
+		if (len < 0) {
+			fprintf(stderr, "Cannot format a log record\n");
+			fail(vc, 54);
+		}
+		if ((size_t)len < room)
+			break;
+		room = len + 1;
+	}
+	vc->fmt_len += len;
+}
+
+/*
+ * Output size bytes that stay put until the next out_flush(), like the
+ * text of the log buffer.  Long runs are handed to writev() in place.
+ */
+static void out_ref(struct vmcore *vc, const void *data, size_t size)
+{
+	if (size < OUT_REF_MIN) {
+		out_put(vc, data, size);
+		return;
+	}
+	out_close_seg(vc);
+	vc->iov[vc->nr_iov].iov_base = (void *)data;
+	vc->iov[vc->nr_iov].iov_len = size;
+	vc->nr_iov++;
+	/* Leave a slot for the formatted bytes that follow */
+	if (vc->nr_iov >= OUT_IOV_MAX - 1)
+		out_flush(vc);
+}
+
+/*
+ * Bytes that go out as they are: for the text format whatever passes
+ * isprint() or isspace() in the C locale, for JSON printable ASCII but
+ * for the quote and backslash.
+ */
+static inline int plain_byte(unsigned char c, int json)
+{
+	if (json)
+		return c >= 0x20 && c < 0x7f && c != '"' && c != '\\';
+	return (c >= 0x20 && c < 0x7f) || (c >= '\t' && c <= '\r');
+}
+
+/* Return how many bytes at the start of p are plain_byte()s */
+static size_t plain_run(const unsigned char *p, size_t len, int json)
+{
+	size_t i = 0;
+
+#if defined(__SSE2__)
+	const __m128i lo = _mm_set1_epi8(0x1f), hi = _mm_set1_epi8(0x7f);
+	const __m128i ws_lo = _mm_set1_epi8('\t' - 1);
+	const __m128i ws_hi = _mm_set1_epi8('\r' + 1);
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i backslash = _mm_set1_epi8('\\');
+
+	/* Bytes above 0x7f are negative, so the signed compares drop them */
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+		__m128i ok = _mm_and_si128(_mm_cmpgt_epi8(v, lo),
+					   _mm_cmplt_epi8(v, hi));
+		unsigned mask;
+
+		if (json)
+			ok = _mm_andnot_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(v, quote),
+					     _mm_cmpeq_epi8(v, backslash)), ok);
+		else
+			ok = _mm_or_si128(ok,
+				_mm_and_si128(_mm_cmpgt_epi8(v, ws_lo),
+					      _mm_cmplt_epi8(v, ws_hi)));
+		mask = _mm_movemask_epi8(ok);
+		if (mask != 0xffff)
+			return i + __builtin_ctz(~mask);
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	for (; i + 16 <= len; i += 16) {
+		uint8x16_t v = vld1q_u8(p + i);
+		uint8x16_t ok = vandq_u8(vcgeq_u8(v, vdupq_n_u8(0x20)),
+					 vcleq_u8(v, vdupq_n_u8(0x7e)));
+
+		if (json)
+			ok = vbicq_u8(ok,
+				vorrq_u8(vceqq_u8(v, vdupq_n_u8('"')),
+					 vceqq_u8(v, vdupq_n_u8('\\'))));
+		else
+			ok = vorrq_u8(ok,
+				vandq_u8(vcgeq_u8(v, vdupq_n_u8('\t')),
+					 vcleq_u8(v, vdupq_n_u8('\r'))));
+		/* Let the loop below find the byte that stopped us */
+		if (vminvq_u8(ok) != 0xff)
+			break;
+	}
+#endif
+	for (; i < len; i++) {
+		if (!plain_byte(p[i], json))
+			break;
+	}
+	return i;
+}
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static void dump_dmesg_legacy(struct vmcore *vc)
+{
+	uint64_t log_buf;
 	unsigned log_end, logged_chars, log_end_wrapped;
 	int log_buf_len, to_wrap;
 	char *buf;
 	ssize_t ret;
 
-	if (!log_buf_vaddr) {
+	if (!vc->log_buf_vaddr) {
 		fprintf(stderr, "Missing the log_buf symbol\n");
-		exit(50);
+		fail(vc, 50);
 	}
-	if (!log_end_vaddr) {
+	if (!vc->log_end_vaddr) {
 		fprintf(stderr, "Missing the log_end symbol\n");
-		exit(51);
+		fail(vc, 51);
 	}
-	if (!log_buf_len_vaddr) {
+	if (!vc->log_buf_len_vaddr) {
 		fprintf(stderr, "Missing the log_bug_len symbol\n");
-		exit(52);
+		fail(vc, 52);
 	}
-	if (!logged_chars_vaddr) {
+	if (!vc->logged_chars_vaddr) {
 		fprintf(stderr, "Missing the logged_chars symbol\n");
-		exit(53);
+		fail(vc, 53);
 	}
 
+	log_buf = read_file_pointer(vc, vc->log_buf_vaddr);
+	log_end = read_file_u32(vc, vc->log_end_vaddr);
+	log_buf_len = read_file_s32(vc, vc->log_buf_len_vaddr);
+	logged_chars = read_file_u32(vc, vc->logged_chars_vaddr);
 
-	log_buf = read_file_pointer(fd, vaddr_to_offset(log_buf_vaddr));
-	log_end = read_file_u32(fd, vaddr_to_offset(log_end_vaddr));
-	log_buf_len = read_file_s32(fd, vaddr_to_offset(log_buf_len_vaddr));
-	logged_chars = read_file_u32(fd, vaddr_to_offset(logged_chars_vaddr));
-
-	log_buf_offset = vaddr_to_offset(log_buf);
-
-	buf = calloc(1, log_buf_len);
+	buf = vc->log_copy = calloc(1, log_buf_len);
 	if (!buf) {
 		fprintf(stderr, "Failed to malloc %d bytes for the logbuf: %s\n",
 			log_buf_len, strerror(errno));
-		exit(51);
+		fail(vc, 51);
 	}
 
 	log_end_wrapped = log_end % log_buf_len;
 	to_wrap = log_buf_len - log_end_wrapped;
 
-	ret = pread(fd, buf, to_wrap, log_buf_offset + log_end_wrapped);
+	ret = pread_vaddr(vc, buf, to_wrap, log_buf + log_end_wrapped);
 	if (ret != to_wrap) {
 		fprintf(stderr, "Failed to read the first half of the log buffer: %s\n",
 			strerror(errno));
-		exit(52);
+		fail(vc, 52);
 	}
-	ret = pread(fd, buf + to_wrap, log_end_wrapped, log_buf_offset);
+	ret = pread_vaddr(vc, buf + to_wrap, log_end_wrapped, log_buf);
 	if (ret != log_end_wrapped) {
 		fprintf(stderr, "Faield to read the second half of the log buffer: %s\n",
 			strerror(errno));
-		exit(53);
+		fail(vc, 53);
 	}
 
 	/*
@@ -547,32 +1149,35 @@ static void dump_dmesg_legacy(int fd)
 	 */
 	logged_chars = log_end < log_buf_len ? log_end : log_buf_len;
 
-	write_to_stdout(buf + (log_buf_len -  logged_chars), logged_chars);
+	write_out(vc, buf + (log_buf_len -  logged_chars), logged_chars);
 }
 
-static inline uint16_t struct_val_u16(char *ptr, unsigned int offset)
+static inline uint16_t struct_val_u16(struct vmcore *vc, char *ptr,
+				      unsigned int offset)
 {
-	return(file16_to_cpu(*(uint16_t *)(ptr + offset)));
+	return(file16_to_cpu(vc, *(uint16_t *)(ptr + offset)));
 }
 
-static inline uint32_t struct_val_u32(char *ptr, unsigned int offset)
+static inline uint32_t struct_val_u32(struct vmcore *vc, char *ptr,
+				      unsigned int offset)
 {
-	return(file32_to_cpu(*(uint32_t *)(ptr + offset)));
+	return(file32_to_cpu(vc, *(uint32_t *)(ptr + offset)));
 }
 
-static inline uint64_t struct_val_u64(char *ptr, unsigned int offset)
+static inline uint64_t struct_val_u64(struct vmcore *vc, char *ptr,
+				      unsigned int offset)
 {
-	return(file64_to_cpu(*(uint64_t *)(ptr + offset)));
+	return(file64_to_cpu(vc, *(uint64_t *)(ptr + offset)));
 }
 
 /* human readable text of the record */
-static char *log_text(char *msg)
+static char *log_text(struct vmcore *vc, char *msg)
 {
-	return msg + log_sz;
+	return msg + vc->log_sz;
 }
 
 /* get record by index; idx must point to valid msg */
-static char *log_from_idx(char *log_buf, uint32_t idx)
+static char *log_from_idx(struct vmcore *vc, char *log_buf, uint32_t idx)
 {
 	char *msg = log_buf + idx;
 
@@ -580,13 +1185,13 @@ static char *log_from_idx(char *log_buf, uint32_t idx)
 	 * A length == 0 record is the end of buffer marker. Wrap around and
 	 * read the message at the start of the buffer.
 	 */
-	if (!struct_val_u16(msg, log_offset_len))
+	if (!struct_val_u16(vc, msg, vc->log_offset_len))
 		return log_buf;
 	return msg;
 }
 
 /* get next record; idx must point to valid msg */
-static uint32_t log_next(char *log_buf, uint32_t idx)
+static uint32_t log_next(struct vmcore *vc, char *log_buf, uint32_t idx)
 {
 	char *msg = log_buf + idx;
 	uint16_t len;
@@ -597,190 +1202,1178 @@ static uint32_t log_next(char *log_buf, uint32_t idx)
 	 * read the message at the start of the buffer as *this* one, and
 	 * return the one after that.
 	 */
-	len = struct_val_u16(msg, log_offset_len);
+	len = struct_val_u16(vc, msg, vc->log_offset_len);
 	if (!len) {
 		msg = log_buf;
-		return struct_val_u16(msg, log_offset_len);
+		return struct_val_u16(vc, msg, vc->log_offset_len);
 	}
 	return idx + len;
 }
 
+/* One record, decoded from the log buffer */
+struct dmesg_record {
+	uint64_t ts_nsec;
+	const unsigned char *text;
+	uint16_t text_len;
+	int facility;		/* -1 if the log does not say */
+	int level;
+};
+
+static void log_record(struct vmcore *vc, char *msg, struct dmesg_record *rec)
+{
+	uint8_t flags_level;
+
+	rec->ts_nsec = struct_val_u64(vc, msg, vc->log_offset_ts_nsec);
+	rec->text = (unsigned char *)log_text(vc, msg);
+	rec->text_len = struct_val_u16(vc, msg, vc->log_offset_text_len);
+	rec->facility = -1;
+	rec->level = -1;
+	if (vc->log_offset_facility == UINT16_MAX)
+		return;
+
+	/*
+	 * The facility byte is followed by "u8 flags:5, level:3", and
+	 * which end of the byte the level lands in depends on how the
+	 * compiler that built the kernel lays out bitfields.
+	 */
+	rec->facility = *(uint8_t *)(msg + vc->log_offset_facility);
+	flags_level = *(uint8_t *)(msg + vc->log_offset_facility + 1);
+	if (vc->ehdr.e_ident[EI_DATA] == ELFDATA2LSB)
+		rec->level = flags_level >> 5;
+	else
+		rec->level = flags_level & 7;
+}
+
+static int record_wanted(const struct dmesg_opts *opts,
+			 const struct dmesg_record *rec)
+{
+	if (rec->ts_nsec < opts->since_nsec || rec->ts_nsec > opts->until_nsec)
+		return 0;
+	if (opts->max_level >= 0 && rec->level > opts->max_level)
+		return 0;
+	return 1;
+}
+
+static void dump_record_text(struct vmcore *vc, const struct dmesg_record *rec)
+{
+	imaxdiv_t imaxdiv_sec, imaxdiv_usec;
+	size_t i, run;
+	char *p;
+
+	imaxdiv_sec = imaxdiv(rec->ts_nsec, 1000000000);
+	imaxdiv_usec = imaxdiv(imaxdiv_sec.rem, 1000);
+
+	out_printf(vc, "[%5llu.%06llu] ",
+		(long long unsigned int)imaxdiv_sec.quot,
+		(long long unsigned int)imaxdiv_usec.quot);
+
+	/* escape non-printable characters */
+	for (i = 0; i < rec->text_len; i++) {
+		unsigned char c;
+
+		run = plain_run(rec->text + i, rec->text_len - i, 0);
+		if (run) {
+			out_ref(vc, rec->text + i, run);
+			i += run;
+			if (i == rec->text_len)
+				break;
+		}
+		c = rec->text[i];
+		p = out_reserve(vc, 4);
+		p[0] = '\\';
+		p[1] = 'x';
+		p[2] = hex_digits[c >> 4];
+		p[3] = hex_digits[c & 0xf];
+		vc->fmt_len += 4;
+	}
+
+	out_put(vc, "\n", 1);
+}
+
+/* Length of the well formed UTF-8 sequence at p, 0 if there is none */
+static size_t utf8_len(const unsigned char *p, size_t len)
+{
+	unsigned char lo = 0x80, hi = 0xbf;
+	size_t n, i;
+
+	if (p[0] >= 0xc2 && p[0] <= 0xdf)
+		n = 2;
+	else if (p[0] >= 0xe0 && p[0] <= 0xef)
+		n = 3;
+	else if (p[0] >= 0xf0 && p[0] <= 0xf4)
+		n = 4;
+	else
+		return 0;
+	/* No overlong forms, surrogates or code points past U+10FFFF */
+	if (p[0] == 0xe0)
+		lo = 0xa0;
+	else if (p[0] == 0xed)
+		hi = 0x9f;
+	else if (p[0] == 0xf0)
+		lo = 0x90;
+	else if (p[0] == 0xf4)
+		hi = 0x8f;
+	if (n > len || p[1] < lo || p[1] > hi)
+		return 0;
+	for (i = 2; i < n; i++) {
+		if (p[i] < 0x80 || p[i] > 0xbf)
+			return 0;
+	}
+	return n;
+}
+
+/* Return how many bytes at the start of p go into a JSON string as is */
+static size_t json_run(const unsigned char *p, size_t len)
+{
+	size_t i = 0, n;
+
+	for (;;) {
+		i += plain_run(p + i, len - i, 1);
+		if (i == len || p[i] < 0x80)
+			return i;
+		n = utf8_len(p + i, len - i);
+		if (!n)
+			return i;
+		i += n;
+	}
+}
+
+/*
+ * Write size bytes as the inside of a JSON string.  Well formed UTF-8
+ * goes out as it is, and any other byte the text format would show as
+ * \xNN comes out as that same text, with the backslash escaped.
+ */
+static void dump_json_string(struct vmcore *vc, const unsigned char *str,
+			     size_t size)
+{
+	size_t i, run;
+	char *p;
+
+	for (i = 0; i < size; i++) {
+		unsigned char c;
+
+		run = json_run(str + i, size - i);
+		if (run) {
+			out_ref(vc, str + i, run);
+			i += run;
+			if (i == size)
+				break;
+		}
+		c = str[i];
+		p = out_reserve(vc, 6);
+		p[0] = '\\';
+		if (c == '"' || c == '\\') {
+			p[1] = c;
+			vc->fmt_len += 2;
+		} else if (c == '\n') {
+			p[1] = 'n';
+			vc->fmt_len += 2;
+		} else if (c == '\t') {
+			p[1] = 't';
+			vc->fmt_len += 2;
+		} else if (c >= 0x80) {
+			memcpy(p + 1, "\\x", 2);
+			p[3] = hex_digits[c >> 4];
+			p[4] = hex_digits[c & 0xf];
+			vc->fmt_len += 5;
+		} else {
+			memcpy(p + 1, "u00", 3);
+			p[4] = hex_digits[c >> 4];
+			p[5] = hex_digits[c & 0xf];
+			vc->fmt_len += 6;
+		}
+	}
+}
+
+static void dump_record_json(struct vmcore *vc, const struct dmesg_record *rec)
+{
+	out_put(vc, "{", 1);
+	if (vc->opts->json_core) {
+		out_put(vc, "\"core\":\"", 8);
+		dump_json_string(vc, (const unsigned char *)vc->fname,
+				 strlen(vc->fname));
+		out_put(vc, "\",", 2);
+	}
+	out_printf(vc, "\"ts_nsec\":%llu,", (unsigned long long)rec->ts_nsec);
+	if (rec->level >= 0)
+		out_printf(vc, "\"level\":%d,\"facility\":%d,",
+			   rec->level, rec->facility);
+	else
+		out_put(vc, "\"level\":null,\"facility\":null,", 29);
+	out_printf(vc, "\"text_len\":%u,\"text\":\"", rec->text_len);
+	dump_json_string(vc, rec->text, rec->text_len);
+	out_put(vc, "\"}\n", 3);
+}
+
+static void dump_record_binary(struct vmcore *vc,
+			       const struct dmesg_record *rec)
+{
+	struct dmesg_binary_record bin;
+
+	memset(&bin, 0, sizeof(bin));
+	bin.ts_nsec = rec->ts_nsec;
+	bin.text_len = rec->text_len;
+	bin.facility = rec->facility;
+	bin.level = rec->level;
+	out_put(vc, &bin, sizeof(bin));
+	/* The text itself goes out as is */
+	out_ref(vc, rec->text, rec->text_len);
+}
+
 /* Read headers of log records and dump accordingly */
-static void dump_dmesg_structured(int fd)
+static void dump_dmesg_structured(struct vmcore *vc)
 {
-#define OUT_BUF_SIZE	4096
-	uint64_t log_buf, log_buf_offset, ts_nsec;
-	uint32_t log_first_idx, log_next_idx, current_idx, len = 0, i;
+	const struct dmesg_opts *opts = vc->opts;
+	uint64_t log_buf, skip = 0;
+	uint32_t log_first_idx, log_next_idx, current_idx;
 	int log_buf_len;
-	char *buf, out_buf[OUT_BUF_SIZE];
+	char *buf;
 	ssize_t ret;
 	char *msg;
-	uint16_t text_len;
-	imaxdiv_t imaxdiv_sec, imaxdiv_usec;
+	struct dmesg_record rec;
 
-	if (!log_buf_vaddr) {
+	if (!vc->log_buf_vaddr) {
 		fprintf(stderr, "Missing the log_buf symbol\n");
-		exit(60);
+		fail(vc, 60);
 	}
 
-	if (!log_buf_len_vaddr) {
+	if (!vc->log_buf_len_vaddr) {
 		fprintf(stderr, "Missing the log_bug_len symbol\n");
-		exit(61);
+		fail(vc, 61);
 	}
 
-	if (!log_first_idx_vaddr) {
+	if (!vc->log_first_idx_vaddr) {
 		fprintf(stderr, "Missing the log_first_idx symbol\n");
-		exit(62);
+		fail(vc, 62);
 	}
 
-	if (!log_next_idx_vaddr) {
+	if (!vc->log_next_idx_vaddr) {
 		fprintf(stderr, "Missing the log_next_idx symbol\n");
-		exit(63);
+		fail(vc, 63);
 	}
 
-	if (!log_sz) {
+	if (!vc->log_sz) {
 		fprintf(stderr, "Missing the struct log size export\n");
-		exit(64);
+		fail(vc, 64);
 	}
 
-	if (log_offset_ts_nsec == UINT64_MAX) {
+	if (vc->log_offset_ts_nsec == UINT64_MAX) {
 		fprintf(stderr, "Missing the log.ts_nsec offset export\n");
-		exit(65);
+		fail(vc, 65);
 	}
 
-	if (log_offset_len == UINT16_MAX) {
+	if (vc->log_offset_len == UINT16_MAX) {
 		fprintf(stderr, "Missing the log.len offset export\n");
-		exit(66);
+		fail(vc, 66);
 	}
 
-	if (log_offset_text_len == UINT16_MAX) {
+	if (vc->log_offset_text_len == UINT16_MAX) {
 		fprintf(stderr, "Missing the log.text_len offset export\n");
-		exit(67);
+		fail(vc, 67);
 	}
 
-	log_buf = read_file_pointer(fd, vaddr_to_offset(log_buf_vaddr));
-	log_buf_len = read_file_s32(fd, vaddr_to_offset(log_buf_len_vaddr));
+	/* VMCOREINFO has no facility or level, but every struct printk_log
+	 * (and struct log before it) has them right after dict_len, which
+	 * follows text_len.
+	 */
+	vc->log_offset_facility = UINT16_MAX;
+	if (vc->log_offset_text_len + 6 <= vc->log_sz)
+		vc->log_offset_facility = vc->log_offset_text_len + 4;
 
-	log_first_idx = read_file_u32(fd, vaddr_to_offset(log_first_idx_vaddr));
-	log_next_idx = read_file_u32(fd, vaddr_to_offset(log_next_idx_vaddr));
+	log_buf = read_file_pointer(vc, vc->log_buf_vaddr);
+	log_buf_len = read_file_s32(vc, vc->log_buf_len_vaddr);
 
-	log_buf_offset = vaddr_to_offset(log_buf);
+	log_first_idx = read_file_u32(vc, vc->log_first_idx_vaddr);
+	log_next_idx = read_file_u32(vc, vc->log_next_idx_vaddr);
 
-	buf = calloc(1, log_buf_len);
+	/* Records are only ever read, so parse them in place if we can */
+	buf = (char *)vaddr_to_ptr(vc, log_buf, log_buf_len);
 	if (!buf) {
-		fprintf(stderr, "Failed to malloc %d bytes for the logbuf:"
+		buf = vc->log_copy = calloc(1, log_buf_len);
+		if (!buf) {
+			fprintf(stderr, "Failed to malloc %d bytes for the logbuf:"
+					" %s\n", log_buf_len, strerror(errno));
+			fail(vc, 64);
+		}
+
+		ret = pread_vaddr(vc, buf, log_buf_len, log_buf);
+		if (ret != log_buf_len) {
+			fprintf(stderr, "Failed to read log buffer of size %d bytes:"
 				" %s\n", log_buf_len, strerror(errno));
-		exit(64);
+			fail(vc, 65);
+		}
 	}
 
-	ret = pread(fd, buf, log_buf_len, log_buf_offset);
-	if (ret != log_buf_len) {
-		fprintf(stderr, "Failed to read log buffer of size %d bytes:"
-			" %s\n", log_buf_len, strerror(errno));
-		exit(65);
+	/* Only headers are looked at to count what --last has to skip */
+	if (opts->last) {
+		uint64_t wanted = 0;
+
+		for (current_idx = log_first_idx; current_idx != log_next_idx;
+		     current_idx = log_next(vc, buf, current_idx)) {
+			msg = log_from_idx(vc, buf, current_idx);
+			log_record(vc, msg, &rec);
+			wanted += record_wanted(opts, &rec);
+		}
+		if (wanted > opts->last)
+			skip = wanted - opts->last;
+	}
+
+	if (opts->format == FORMAT_BINARY) {
+		struct dmesg_binary_header hdr;
+
+		memcpy(hdr.magic, DMESG_BINARY_MAGIC, sizeof(hdr.magic));
+		hdr.version = DMESG_BINARY_VERSION;
+		hdr.record_size = sizeof(struct dmesg_binary_record);
+		out_put(vc, &hdr, sizeof(hdr));
 	}
 
 	/* Parse records and write out data at standard output */
 
 	current_idx = log_first_idx;
-	len = 0;
 	while (current_idx != log_next_idx) {
-		msg = log_from_idx(buf, current_idx);
-		ts_nsec = struct_val_u64(msg, log_offset_ts_nsec);
-		imaxdiv_sec = imaxdiv(ts_nsec, 1000000000);
-		imaxdiv_usec = imaxdiv(imaxdiv_sec.rem, 1000);
-
-		len += sprintf(out_buf + len, "[%5llu.%06llu] ",
-			(long long unsigned int)imaxdiv_sec.quot,
-			(long long unsigned int)imaxdiv_usec.quot);
-
-		/* escape non-printable characters */
-		text_len = struct_val_u16(msg, log_offset_text_len);
-		for (i = 0; i < text_len; i++) {
-			unsigned char c = log_text(msg)[i];
-
-			if (!isprint(c) && !isspace(c))
-				len += sprintf(out_buf + len, "\\x%02x", c);
-			else
-				out_buf[len++] = c;
+		msg = log_from_idx(vc, buf, current_idx);
+		log_record(vc, msg, &rec);
 
-			if (len >= OUT_BUF_SIZE - 64) {
-				write_to_stdout(out_buf, len);
-				len = 0;
-			}
+		/* Move to next record */
+		current_idx = log_next(vc, buf, current_idx);
+
+		if (!record_wanted(opts, &rec))
+			continue;
+		if (skip) {
+			skip--;
+			continue;
+		}
+
+		switch (opts->format) {
+		case FORMAT_TEXT:
+			dump_record_text(vc, &rec);
+			break;
+		case FORMAT_JSON:
+			dump_record_json(vc, &rec);
+			break;
+		case FORMAT_BINARY:
+			dump_record_binary(vc, &rec);
+			break;
 		}
+	}
 
-		out_buf[len++] = '\n';
+	out_flush(vc);
+}
 
-		/* Move to next record */
-		current_idx = log_next(buf, current_idx);
+static void dump_dmesg(struct vmcore *vc)
+{
+	const struct dmesg_opts *opts = vc->opts;
+
+	if (vc->log_first_idx_vaddr) {
+		dump_dmesg_structured(vc);
+		return;
+	}
+	if (opts->format != FORMAT_TEXT || opts->max_level >= 0 ||
+	    opts->since_nsec || opts->until_nsec != UINT64_MAX || opts->last) {
+		fprintf(stderr, "%s has a plain text log, without the records "
+			"--format and the filters need\n", vc->fname);
+		fail(vc, 68);
 	}
+	dump_dmesg_legacy(vc);
+}
 
-	if (len)
-		write_to_stdout(out_buf, len);
+static void vmcore_init(struct vmcore *vc, const struct dmesg_opts *opts,
+			const char *fname, int out_fd)
+{
+	memset(vc, 0, sizeof(*vc));
+	vc->opts = opts;
+	vc->fname = fname;
+	vc->fd = -1;
+	vc->log_offset_ts_nsec = UINT64_MAX;
+	vc->log_offset_len = UINT16_MAX;
+	vc->log_offset_text_len = UINT16_MAX;
+	vc->out_fd = out_fd;
 }
 
-static void dump_dmesg(int fd)
+/* Release everything a core holds, however far dump_vmcore() got */
+static void vmcore_close(struct vmcore *vc)
 {
-	if (log_first_idx_vaddr)
-		dump_dmesg_structured(fd);
-	else
-		dump_dmesg_legacy(fd);
+	core_close(vc);
+	free(vc->phdr);
+	free(vc->load_index);
+	free(vc->load_max_end);
+	free(vc->note_buf);
+	free(vc->log_copy);
+	free(vc->out_mem);
+	free(vc->fmt_buf);
+	if (vc->fd >= 0)
+		close(vc->fd);
+	vc->phdr = NULL;
+	vc->load_index = NULL;
+	vc->load_max_end = NULL;
+	vc->note_buf = vc->log_copy = vc->out_mem = vc->fmt_buf = NULL;
+	vc->fd = -1;
 }
 
-int main(int argc, char **argv)
+static void dump_vmcore(struct vmcore *vc)
 {
+	Elf64_Ehdr *ehdr = &vc->ehdr;
 	ssize_t ret;
-	int fd;
 
-	if (argc != 2) {
-		fprintf(stderr, "usage: %s <kernel core file>\n", argv[0]);
-		return 1;
-	}
-	fname = argv[1];
-
-	fd = open(fname, O_RDONLY);
-	if (fd < 0) {
+	vc->fd = open(vc->fname, O_RDONLY);
+	if (vc->fd < 0) {
 		fprintf(stderr, "Cannot open %s: %s\n",
-			fname, strerror(errno));
-		return 2;
+			vc->fname, strerror(errno));
+		fail(vc, 2);
 	}
-	ret = pread(fd, ehdr.e_ident, EI_NIDENT, 0);
+	ret = pread(vc->fd, ehdr->e_ident, EI_NIDENT, 0);
 	if (ret != EI_NIDENT) {
 		fprintf(stderr, "Read of e_ident from %s failed: %s\n",
-			fname, strerror(errno));
-		return 3;
+			vc->fname, strerror(errno));
+		fail(vc, 3);
 	}
-	if (memcmp(ehdr.e_ident, ELFMAG, SELFMAG) != 0) {
+	if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0) {
 		fprintf(stderr, "Missing elf signature\n");
-		return 4;
+		fail(vc, 4);
 	}
-	if (ehdr.e_ident[EI_VERSION] != EV_CURRENT) {
+	if (ehdr->e_ident[EI_VERSION] != EV_CURRENT) {
 		fprintf(stderr, "Bad elf version\n");
-		return 5;
+		fail(vc, 5);
 	}
-	if ((ehdr.e_ident[EI_CLASS] != ELFCLASS32) &&
-	    (ehdr.e_ident[EI_CLASS] != ELFCLASS64))
+	if ((ehdr->e_ident[EI_CLASS] != ELFCLASS32) &&
+	    (ehdr->e_ident[EI_CLASS] != ELFCLASS64))
 	{
 		fprintf(stderr, "Unknown elf class %u\n",
-			ehdr.e_ident[EI_CLASS]);
-		return 6;
+			ehdr->e_ident[EI_CLASS]);
+		fail(vc, 6);
 	}
-	if ((ehdr.e_ident[EI_DATA] != ELFDATA2LSB) &&
-	    (ehdr.e_ident[EI_DATA] != ELFDATA2MSB))
+	if ((ehdr->e_ident[EI_DATA] != ELFDATA2LSB) &&
+	    (ehdr->e_ident[EI_DATA] != ELFDATA2MSB))
 	{
 		fprintf(stderr, "Unkown elf data order %u\n",
-			ehdr.e_ident[EI_DATA]);
-		return 7;
+			ehdr->e_ident[EI_DATA]);
+		fail(vc, 7);
 	}
-	if (ehdr.e_ident[EI_CLASS] == ELFCLASS32)
-		read_elf32(fd);
+	if (ehdr->e_ident[EI_CLASS] == ELFCLASS32)
+		read_elf32(vc);
 	else
-		read_elf64(fd);
+		read_elf64(vc);
+
+	core_open(vc);
+	build_load_index(vc);
+	scan_note_headers(vc);
+	dump_dmesg(vc);
+}
+
+/*
+ * Batch mode: many cores, read by a bounded pool of threads.  Each log
+ * goes to its own file under an output directory, or to standard out
+ * with every line tagged by the core it came from.
+ */
+#define MAX_JOBS	256
+
+struct batch_core {
+	char *path;
+	const char *name;	/* path below the directory it was found in */
+};
+
+struct batch {
+	pthread_mutex_t lock;
+	struct batch_core *cores;
+	size_t nr;
+	size_t max;
+	size_t next;
+	const char *out_dir;
+	const struct dmesg_opts *opts;
+	unsigned failed;
+};
+
+static void batch_add(struct batch *batch, const char *path, size_t prefix)
+{
+	struct batch_core *bc;
+
+	if (batch->nr == batch->max) {
+		batch->max = batch->max ? batch->max * 2 : 64;
+		batch->cores = realloc(batch->cores,
+				       batch->max * sizeof(*batch->cores));
+		if (!batch->cores) {
+			fprintf(stderr, "Cannot grow the list of cores: %s\n",
+				strerror(errno));
+			exit(70);
+		}
+	}
+	bc = &batch->cores[batch->nr++];
+	bc->path = strdup(path);
+	if (!bc->path) {
+		fprintf(stderr, "Cannot strdup %s\n", path);
+		exit(70);
+	}
+	bc->name = bc->path + prefix;
+	while (*bc->name == '/')
+		bc->name++;
+}
 
-	scan_note_headers(fd);
-	dump_dmesg(fd);
+/* nftw() has no room for a cookie */
+static struct batch *walk_batch;
+static size_t walk_prefix;
+
+static int walk_one(const char *path, const struct stat *st, int type,
+		    struct FTW *ftw)
+{
+	char ident[SELFMAG];
+	int fd;
+
+	(void)ftw;
+	if (type != FTW_F || !S_ISREG(st->st_mode))
+		return 0;
+	/* Directories of crashes hold other things beside the cores */
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	if (pread(fd, ident, SELFMAG, 0) == SELFMAG &&
+	    memcmp(ident, ELFMAG, SELFMAG) == 0)
+		batch_add(walk_batch, path, walk_prefix);
 	close(fd);
+	return 0;
+}
+
+static int batch_cmp(const void *a, const void *b)
+{
+	const struct batch_core *ca = a, *cb = b;
+	return strcmp(ca->path, cb->path);
+}
+
+static void batch_add_path(struct batch *batch, const char *path)
+{
+	struct stat st;
+	size_t first = batch->nr;
+
+	if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode)) {
+		batch_add(batch, path, 0);
+		return;
+	}
+	walk_batch = batch;
+	walk_prefix = strlen(path);
+	if (nftw(path, walk_one, 16, FTW_PHYS) != 0) {
+		fprintf(stderr, "Cannot walk %s: %s\n", path, strerror(errno));
+		exit(71);
+	}
+	qsort(batch->cores + first, batch->nr - first, sizeof(*batch->cores),
+	      batch_cmp);
+}
+
+static void batch_add_list(struct batch *batch, const char *list)
+{
+	FILE *file;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+
+	file = strcmp(list, "-") == 0 ? stdin : fopen(list, "r");
+	if (!file) {
+		fprintf(stderr, "Cannot open %s: %s\n", list, strerror(errno));
+		exit(71);
+	}
+	while ((len = getline(&line, &size, file)) >= 0) {
+		while (len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = '\0';
+		if (len)
+			batch_add_path(batch, line);
+	}
+	free(line);
+	if (file != stdin)
+		fclose(file);
+}
+
+/* The per core file under out_dir, flattening any subdirectories */
+static int batch_open_output(struct batch *batch, struct batch_core *bc)
+{
+	char *path, *p;
+	int fd;
+
+	path = malloc(strlen(batch->out_dir) + strlen(bc->name) +
+		      sizeof("/.dmesg"));
+	if (!path)
+		return -1;
+	p = path + sprintf(path, "%s/", batch->out_dir);
+	sprintf(p, "%s.dmesg", bc->name);
+	for (; *p; p++) {
+		if (*p == '/')
+			*p = '_';
+	}
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		fprintf(stderr, "Cannot create %s: %s\n", path,
+			strerror(errno));
+	free(path);
+	return fd;
+}
+
+/*
+ * Write a buffered log to standard out, every line tagged with its core
+ * unless tag is NULL.
+ */
+static void batch_write_tagged(struct vmcore *vc, const char *tag)
+{
+	const char *line = vc->out_mem, *end = vc->out_mem + vc->out_len;
+
+	flockfile(stdout);
+	if (!tag) {
+		fwrite_unlocked(vc->out_mem, 1, vc->out_len, stdout);
+		line = end;
+	}
+	while (line < end) {
+		const char *eol = memchr(line, '\n', end - line);
+		size_t len = eol ? (size_t)(eol - line) : (size_t)(end - line);
+		fputs_unlocked(tag, stdout);
+		fputs_unlocked(": ", stdout);
+		fwrite_unlocked(line, 1, len, stdout);
+		putc_unlocked('\n', stdout);
+		line += len + 1;
+	}
+	fflush_unlocked(stdout);
+	funlockfile(stdout);
+}
+
+/* Returns the status a run on just this one core would exit with */
+static int batch_dump(struct vmcore *vc)
+{
+	jmp_buf abort;
+	int status;
+
+	vc->abort = &abort;
+	status = setjmp(abort);
+	if (status == 0)
+		dump_vmcore(vc);
+	vc->abort = NULL;
+	return status;
+}
+
+static void batch_one(struct batch *batch, struct batch_core *bc)
+{
+	struct vmcore *vc;
+	struct timespec start, end;
+	int out_fd = -1;
+	int status = 2;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	vc = malloc(sizeof(*vc));
+	if (!vc) {
+		fprintf(stderr, "Cannot malloc %zu bytes\n", sizeof(*vc));
+		exit(70);
+	}
+	if (batch->out_dir)
+		out_fd = batch_open_output(batch, bc);
+	vmcore_init(vc, batch->opts, bc->path, out_fd);
+	if (!batch->out_dir || out_fd >= 0)
+		status = batch_dump(vc);
+	if (out_fd >= 0)
+		close(out_fd);
+	else if (vc->out_len)
+		batch_write_tagged(vc, batch->opts->json_core ? NULL : bc->path);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	fprintf(stderr, "%s: %s %d, %zu bytes in %.6f s\n", bc->path,
+		status ? "failed" : "ok", status, vc->out_len,
+		(end.tv_sec - start.tv_sec) +
+		(end.tv_nsec - start.tv_nsec) / 1e9);
+	if (status) {
+		pthread_mutex_lock(&batch->lock);
+		batch->failed++;
+		pthread_mutex_unlock(&batch->lock);
+	}
+	vmcore_close(vc);
+	free(vc);
+}
+
+static void *batch_worker(void *arg)
+{
+	struct batch *batch = arg;
+	size_t i;
+
+	for (;;) {
+		pthread_mutex_lock(&batch->lock);
+		if (batch->next >= batch->nr) {
+			pthread_mutex_unlock(&batch->lock);
+			break;
+		}
+		i = batch->next++;
+		pthread_mutex_unlock(&batch->lock);
+		batch_one(batch, &batch->cores[i]);
+	}
+	return NULL;
+}
+
+static int batch_run(struct batch *batch, unsigned jobs)
+{
+	pthread_t tid[MAX_JOBS];
+	unsigned t;
+	size_t i;
+	int result;
+
+	if (jobs > batch->nr)
+		jobs = batch->nr;
+	for (t = 0; t < jobs; t++) {
+		result = pthread_create(&tid[t], NULL, batch_worker, batch);
+		if (result != 0) {
+			fprintf(stderr, "Cannot create worker thread: %s\n",
+				strerror(result));
+			exit(72);
+		}
+	}
+	for (t = 0; t < jobs; t++)
+		pthread_join(tid[t], NULL);
+
+	for (i = 0; i < batch->nr; i++)
+		free(batch->cores[i].path);
+	free(batch->cores);
+	return batch->failed ? 1 : 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s <kernel core file>\n"
+		"       %s [options] <core or directory>...\n"
+		"\n"
+		"Options:\n"
+		" -h, --help           Print this help.\n"
+		" -j, --jobs=N         Read up to N cores at once.\n"
+		" -l, --list=FILE      Also read the cores named in FILE, one per\n"
+		"                      line, or on standard input for \"-\".\n"
+		" -o, --output-dir=DIR Write each log to DIR/<core>.dmesg instead\n"
+		"                      of tagging its lines on standard output.\n"
+		" -f, --format=FORMAT  Write records as text, json or binary.\n"
+		"     --level=LEVEL    Only records of LEVEL or more urgent, by\n"
+		"                      name (emerg to debug) or number (0 to 7).\n"
+		"     --since=SECONDS  Only records logged at or after SECONDS.\n"
+		"     --until=SECONDS  Only records logged at or before SECONDS.\n"
+		"     --last=N         Only the last N records that match.\n",
+		name, name);
+}
+
+static int parse_level(const char *arg)
+{
+	static const char *const levels[] = {
+		"emerg", "alert", "crit", "err",
+		"warn", "notice", "info", "debug",
+	};
+	char *end;
+	long level;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		if (strcmp(arg, levels[i]) == 0)
+			return i;
+	}
+	level = strtol(arg, &end, 10);
+	if (end == arg || *end || level < 0 || level > 7)
+		return -1;
+	return level;
+}
+
+/* Seconds since boot, as the text format prints them, in nanoseconds */
+static int parse_seconds(const char *arg, uint64_t *nsec)
+{
+	char *end;
+	double sec;
+
+	sec = strtod(arg, &end);
+	if (end == arg || *end || sec < 0 || sec >= 18446744073.0)
+		return -1;
+	*nsec = sec * 1e9;
+	return 0;
+}
+
+enum {
+	OPT_LEVEL = 256,
+	OPT_SINCE,
+	OPT_UNTIL,
+	OPT_LAST,
+};
+
+#ifdef BENCH
+/* The benchmark below brings its own main() */
+#define main vmcore_dmesg_main
+#endif
+
+int main(int argc, char **argv)
+{
+	static const struct option options[] = {
+		{ "help",	0, 0, 'h' },
+		{ "jobs",	1, 0, 'j' },
+		{ "list",	1, 0, 'l' },
+		{ "output-dir",	1, 0, 'o' },
+		{ "format",	1, 0, 'f' },
+		{ "level",	1, 0, OPT_LEVEL },
+		{ "since",	1, 0, OPT_SINCE },
+		{ "until",	1, 0, OPT_UNTIL },
+		{ "last",	1, 0, OPT_LAST },
+		{ 0,		0, 0, 0 },
+	};
+	struct dmesg_opts opts;
+	struct batch batch;
+	struct vmcore vc;
+	struct stat st;
+	const char *list = NULL;
+	long jobs = 0;
+	char *end;
+	int opt, i;
+
+	memset(&opts, 0, sizeof(opts));
+	opts.format = FORMAT_TEXT;
+	opts.max_level = -1;
+	opts.until_nsec = UINT64_MAX;
+	memset(&batch, 0, sizeof(batch));
+	pthread_mutex_init(&batch.lock, NULL);
+	batch.opts = &opts;
+	while ((opt = getopt_long(argc, argv, "hj:l:o:f:", options, NULL)) != -1) {
+		switch (opt) {
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		case 'j':
+			jobs = strtol(optarg, &end, 0);
+			if (*end || jobs < 1 || jobs > MAX_JOBS) {
+				fprintf(stderr, "Bad number of jobs %s, "
+					"expected 1 to %d\n", optarg, MAX_JOBS);
+				return 1;
+			}
+			break;
+		case 'l':
+			list = optarg;
+			break;
+		case 'o':
+			batch.out_dir = optarg;
+			break;
+		case 'f':
+			if (strcmp(optarg, "text") == 0)
+				opts.format = FORMAT_TEXT;
+			else if (strcmp(optarg, "json") == 0)
+				opts.format = FORMAT_JSON;
+			else if (strcmp(optarg, "binary") == 0)
+				opts.format = FORMAT_BINARY;
+			else {
+				fprintf(stderr, "Unknown format %s\n", optarg);
+				return 1;
+			}
+			break;
+		case OPT_LEVEL:
+			opts.max_level = parse_level(optarg);
+			if (opts.max_level < 0) {
+				fprintf(stderr, "Bad log level %s\n", optarg);
+				return 1;
+			}
+			break;
+		case OPT_SINCE:
+			if (parse_seconds(optarg, &opts.since_nsec) < 0) {
+				fprintf(stderr, "Bad time %s\n", optarg);
+				return 1;
+			}
+			break;
+		case OPT_UNTIL:
+			if (parse_seconds(optarg, &opts.until_nsec) < 0) {
+				fprintf(stderr, "Bad time %s\n", optarg);
+				return 1;
+			}
+			break;
+		case OPT_LAST:
+			opts.last = strtoull(optarg, &end, 0);
+			if (end == optarg || *end || !opts.last) {
+				fprintf(stderr, "Bad record count %s\n", optarg);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	/* One core and nothing else is the classic single log to stdout */
+	if (argc - optind == 1 && !list && !batch.out_dir &&
+	    (stat(argv[optind], &st) < 0 || !S_ISDIR(st.st_mode))) {
+		vmcore_init(&vc, &opts, argv[optind], STDOUT_FILENO);
+		dump_vmcore(&vc);
+		vmcore_close(&vc);
+		return 0;
+	}
+	if (argc == optind && !list) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (!batch.out_dir) {
+		/* Records from many cores share standard out */
+		if (opts.format == FORMAT_BINARY) {
+			fprintf(stderr, "--format=binary needs --output-dir when "
+				"reading more than one core\n");
+			return 1;
+		}
+		opts.json_core = opts.format == FORMAT_JSON;
+	}
+
+	for (i = optind; i < argc; i++)
+		batch_add_path(&batch, argv[i]);
+	if (list)
+		batch_add_list(&batch, list);
+	if (!jobs) {
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
+		if (jobs < 1)
+			jobs = 1;
+		if (jobs > MAX_JOBS)
+			jobs = MAX_JOBS;
+	}
+	return batch_run(&batch, jobs);
+}
+
+#ifdef BENCH
+#undef main
+
+/*
+ * "make vmcore-dmesg-bench" builds vmcore-dmesg/vmcore-dmesg-bench, which
+ * formats a synthetic log_buf of -n records (1M by default) as text and
+ * as JSON, once with the record code above and once a byte at a time
+ * the way vmcore-dmesg used to, and checks that both agree.
+ */
+#define BENCH_LOG_SZ	16	/* struct printk_log */
+#define BENCH_REF_SIZE	4096
+
+static const char *bench_text[] = {
+	"Linux version 4.18.0 (gcc version 8.3.1) #1 SMP",
+	"Command line: BOOT_IMAGE=/vmlinuz root=/dev/mapper/rhel-root ro "
+		"crashkernel=auto rd.lvm.lv=rhel/root rhgb quiet",
+	"ACPI: RSDP 0x00000000000F05B0 000024 (v02 \"BOCHS \")",
+	"pci 0000:00:01.1: legacy IDE quirk: reg 0x10: [io  0x01f0-0x01f7]",
+	"\tfollowed by a tab and a path C:\\boot",
+	"BUG: unable to handle kernel NULL pointer dereference at "
+		"0000000000000008",
+	"caf\xc3\xa9 \x01\x7f binary bits",
+	"it\xe2\x80\x99s \xf0\x9f\x98\x80, cut \xe2\x80 and \xed\xa0\x80\xff",
+	"e1000 0000:00:03.0 eth0: (PCI:33MHz:32-bit) 52:54:00:12:34:56",
+	"EXT4-fs (dm-0): mounted filesystem with ordered data mode. Opts: "
+		"(null)",
+	"x",
+};
+
+/* Lay out nr records back to back, returning the end of the last */
+static char *bench_log(uint32_t nr, size_t *size)
+{
+	size_t i, len = 0, max = 0;
+	char *buf = NULL;
+
+	for (i = 0; i < nr; i++) {
+		const char *text = bench_text[i % (sizeof(bench_text) /
+						   sizeof(bench_text[0]))];
+		uint16_t text_len = strlen(text);
+		uint16_t rec_len = (BENCH_LOG_SZ + text_len + 3) & ~3;
+		uint64_t ts_nsec = i * 1234567ULL;
+		uint8_t flags_level = (i & 7) << 5;
+
+		if (len + rec_len > max) {
+			max = max ? max * 2 : 1 << 20;
+			buf = realloc(buf, max);
+			if (!buf) {
+				fprintf(stderr, "Cannot allocate %zu bytes\n",
+					max);
+				exit(1);
+			}
+		}
+		memset(buf + len, 0, rec_len);
+		memcpy(buf + len, &ts_nsec, 8);
+		memcpy(buf + len + 8, &rec_len, 2);
+		memcpy(buf + len + 10, &text_len, 2);
+		buf[len + 14] = 3;
+		buf[len + 15] = flags_level;
+		memcpy(buf + len + BENCH_LOG_SZ, text, text_len);
+		len += rec_len;
+	}
+	*size = len;
+	return buf;
+}
+
+static void bench_ref_text(struct vmcore *vc, const struct dmesg_record *rec,
+			   char *out_buf, size_t *len)
+{
+	imaxdiv_t imaxdiv_sec, imaxdiv_usec;
+	size_t i;
+
+	imaxdiv_sec = imaxdiv(rec->ts_nsec, 1000000000);
+	imaxdiv_usec = imaxdiv(imaxdiv_sec.rem, 1000);
+	*len += sprintf(out_buf + *len, "[%5llu.%06llu] ",
+		(long long unsigned int)imaxdiv_sec.quot,
+		(long long unsigned int)imaxdiv_usec.quot);
+	for (i = 0; i < rec->text_len; i++) {
+		unsigned char c = rec->text[i];
+
+		if (!isprint(c) && !isspace(c))
+			*len += sprintf(out_buf + *len, "\\x%02x", c);
+		else
+			out_buf[(*len)++] = c;
+		if (*len >= BENCH_REF_SIZE - 64) {
+			write_out(vc, out_buf, *len);
+			*len = 0;
+		}
+	}
+	out_buf[(*len)++] = '\n';
+}
+
+static void bench_ref_json(struct vmcore *vc, const struct dmesg_record *rec,
+			   char *out_buf, size_t *len)
+{
+	size_t i, n;
+
+	*len += sprintf(out_buf + *len, "{\"ts_nsec\":%llu,",
+		(unsigned long long)rec->ts_nsec);
+	if (rec->level >= 0)
+		*len += sprintf(out_buf + *len, "\"level\":%d,\"facility\":%d,",
+			rec->level, rec->facility);
+	else
+		*len += sprintf(out_buf + *len,
+				"\"level\":null,\"facility\":null,");
+	*len += sprintf(out_buf + *len, "\"text_len\":%u,\"text\":\"",
+			rec->text_len);
+	for (i = 0; i < rec->text_len; i++) {
+		unsigned char c = rec->text[i];
+
+		if (c == '"' || c == '\\')
+			*len += sprintf(out_buf + *len, "\\%c", c);
+		else if (c == '\n')
+			*len += sprintf(out_buf + *len, "\\n");
+		else if (c == '\t')
+			*len += sprintf(out_buf + *len, "\\t");
+		else if (c >= 0x80 &&
+			 (n = utf8_len(rec->text + i, rec->text_len - i))) {
+			memcpy(out_buf + *len, rec->text + i, n);
+			*len += n;
+			i += n - 1;
+		} else if (c >= 0x80)
+			*len += sprintf(out_buf + *len, "\\\\x%02x", c);
+		else if (c < 0x20 || c == 0x7f)
+			*len += sprintf(out_buf + *len, "\\u%04x", c);
+		else
+			out_buf[(*len)++] = c;
+		if (*len >= BENCH_REF_SIZE - 64) {
+			write_out(vc, out_buf, *len);
+			*len = 0;
+		}
+	}
+	*len += sprintf(out_buf + *len, "\"}\n");
+}
+
+/* Format every record of buf, with the reference code if ref */
+static double bench_pass(struct vmcore *vc, char *buf, size_t size, int ref)
+{
+	char out_buf[BENCH_REF_SIZE];
+	struct dmesg_record rec;
+	struct timespec t0, t1;
+	uint32_t idx;
+	size_t len = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (idx = 0; idx != size; idx = log_next(vc, buf, idx)) {
+		log_record(vc, log_from_idx(vc, buf, idx), &rec);
+		if (vc->opts->format == FORMAT_JSON) {
+			if (ref)
+				bench_ref_json(vc, &rec, out_buf, &len);
+			else
+				dump_record_json(vc, &rec);
+		} else {
+			if (ref)
+				bench_ref_text(vc, &rec, out_buf, &len);
+			else
+				dump_record_text(vc, &rec);
+		}
+		if (ref && len >= BENCH_REF_SIZE - 512) {
+			write_out(vc, out_buf, len);
+			len = 0;
+		}
+	}
+	if (len)
+		write_out(vc, out_buf, len);
+	out_flush(vc);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0.tv_sec) * 1e3 +
+		(t1.tv_nsec - t0.tv_nsec) / 1e6;
+}
 
+static void bench_init(struct vmcore *vc, const struct dmesg_opts *opts,
+		       int fd)
+{
+	memset(vc, 0, sizeof(*vc));
+	vc->opts = opts;
+	vc->fname = "bench";
+	vc->ehdr.e_ident[EI_DATA] = ELFDATANATIVE;
+	vc->log_sz = BENCH_LOG_SZ;
+	vc->log_offset_ts_nsec = 0;
+	vc->log_offset_len = 8;
+	vc->log_offset_text_len = 10;
+	vc->log_offset_facility = 14;
+	vc->out_fd = fd;
+}
+
+int main(int argc, char **argv)
+{
+	static const char *names[] = { "text", "json" };
+	struct dmesg_opts opts;
+	struct vmcore vc, ref;
+	unsigned long nr = 1000000;
+	size_t size;
+	char *buf;
+	int opt, fd, i;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			nr = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n records]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (!nr || nr > UINT32_MAX / 256) {
+		fprintf(stderr, "Bad number of records\n");
+		return 1;
+	}
+	buf = bench_log(nr, &size);
+	fd = open("/dev/null", O_WRONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Cannot open /dev/null: %s\n",
+			strerror(errno));
+		return 1;
+	}
+
+	memset(&opts, 0, sizeof(opts));
+	opts.max_level = -1;
+	opts.until_nsec = UINT64_MAX;
+	for (i = 0; i < 2; i++) {
+		double ms, ref_ms;
+
+		opts.format = i ? FORMAT_JSON : FORMAT_TEXT;
+
+		/* Both have to produce the same bytes */
+		bench_init(&vc, &opts, -1);
+		bench_init(&ref, &opts, -1);
+		bench_pass(&vc, buf, size, 0);
+		bench_pass(&ref, buf, size, 1);
+		if (vc.out_len != ref.out_len ||
+		    memcmp(vc.out_mem, ref.out_mem, vc.out_len) != 0) {
+			fprintf(stderr, "%s output differs from the "
+				"reference\n", names[i]);
+			return 1;
+		}
+		free(vc.out_mem);
+		free(vc.fmt_buf);
+		free(ref.out_mem);
+		free(ref.fmt_buf);
+
+		bench_init(&ref, &opts, fd);
+		ref_ms = bench_pass(&ref, buf, size, 1);
+		bench_init(&vc, &opts, fd);
+		ms = bench_pass(&vc, buf, size, 0);
+		printf("%s: %lu records, %zu bytes out: %.1f ms, "
+		       "byte at a time %.1f ms\n", names[i], nr, vc.out_len,
+		       ms, ref_ms);
+		free(vc.fmt_buf);
+		free(ref.fmt_buf);
+	}
+	close(fd);
+	free(buf);
 	return 0;
 }
+#endif